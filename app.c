@@ -0,0 +1,262 @@
+/**
+ *  mjpeg2http
+ *
+ *  Copyright (c) 2022 Antonino Nolano. Licensed under the MIT license, as
+ * follows:
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "constants.h"
+#include "metrics.h"
+#include "source.h"
+
+/*
+ * app source: frames handed over by the application in the same process
+ * (mjpeg2http_push_frame), from any thread. A frame is copied into one of
+ * the source buffers, or referenced until the last client is done with it
+ * when the application passes a release callback. source->fd is an eventfd
+ * raised while frames are ready
+ */
+
+enum app_state { APP_FREE, APP_FILLING, APP_READY, APP_BUSY };
+
+struct app_buffer {
+  uint8_t *data; /* copies */
+  size_t size;
+  const uint8_t *frame;
+  uint32_t len;
+  uint64_t timestamp;
+  uint64_t order; /* ready buffers go out oldest first */
+  void (*release)(void *opaque);
+  void *opaque;
+  enum app_state state;
+};
+
+struct app {
+  pthread_mutex_t lock;
+  int streaming;
+  struct app_buffer buffers[APP_BUFFERS];
+  int free;
+  uint64_t pushed;
+  uint32_t sequence;
+  uint32_t no_memory; /* drops to count on the capture thread */
+};
+
+static void app_raise(source_t *source) {
+  if (write(source->fd, &(uint64_t){1}, sizeof(uint64_t)) < 0)
+    perror("app source");
+}
+
+// called with the lock held, the release callback is returned to be called
+// without it
+static void app_free(struct app *a, struct app_buffer *b,
+                     void (**release)(void *), void **opaque) {
+  *release = b->release;
+  *opaque = b->opaque;
+  b->release = NULL;
+  b->state = APP_FREE;
+  ++a->free;
+}
+
+int app_source_push(source_t *source, const uint8_t *data, uint32_t len,
+                    uint64_t timestamp, void (*release)(void *),
+                    void *opaque) {
+  struct app *a = source->priv;
+  struct app_buffer *b = NULL;
+  if (len == 0)
+    return 0;
+
+  pthread_mutex_lock(&a->lock);
+  for (int i = 0; a->streaming && i < APP_BUFFERS && b == NULL; ++i) {
+    if (a->buffers[i].state == APP_FREE)
+      b = &a->buffers[i];
+  }
+  if (b == NULL) {
+    // no viewers, or every buffer is still sent: the frame is dropped
+    pthread_mutex_unlock(&a->lock);
+    return 0;
+  }
+  b->state = APP_FILLING;
+  --a->free;
+  pthread_mutex_unlock(&a->lock);
+
+  int ret = 1;
+  if (release == NULL && b->size < len) {
+    uint8_t *bigger = realloc(b->data, len);
+    if (bigger != NULL) {
+      b->data = bigger;
+      b->size = len;
+    } else {
+      ret = 0;
+    }
+  }
+  if (ret > 0 && release == NULL)
+    memcpy(b->data, data, len);
+  b->frame = release != NULL ? data : b->data;
+  b->len = len;
+  b->timestamp = timestamp;
+  b->release = release;
+  b->opaque = opaque;
+
+  pthread_mutex_lock(&a->lock);
+  if (ret > 0) {
+    b->order = a->pushed++;
+    b->state = APP_READY;
+  } else {
+    b->release = NULL;
+    b->state = APP_FREE;
+    ++a->free;
+    ++a->no_memory;
+  }
+  pthread_mutex_unlock(&a->lock);
+  // a drop wakes the capture thread too, to be counted there
+  app_raise(source);
+  return ret;
+}
+
+static int app_dequeue(source_t *source, struct source_buffer *buffer) {
+  struct app *a = source->priv;
+  struct app_buffer *b = NULL;
+  uint64_t beep;
+  int index = -1, more = 0;
+
+  if (read(source->fd, &beep, sizeof(beep)) < 0)
+    return 0;
+  pthread_mutex_lock(&a->lock);
+  for (int i = 0; i < APP_BUFFERS; ++i) {
+    if (a->buffers[i].state != APP_READY)
+      continue;
+    if (b != NULL)
+      more = 1;
+    if (b == NULL || a->buffers[i].order < b->order) {
+      b = &a->buffers[i];
+      index = i;
+    }
+  }
+  if (b != NULL)
+    b->state = APP_BUSY;
+  metrics_add(dropped[DROP_NO_MEMORY], a->no_memory);
+  a->no_memory = 0;
+  pthread_mutex_unlock(&a->lock);
+  if (b == NULL)
+    return 0;
+  if (more)
+    app_raise(source);
+
+  buffer->index = index;
+  buffer->start = (uint8_t *)b->frame;
+  buffer->bytesused = b->len;
+  buffer->sequence = a->sequence++;
+  buffer->timestamp = b->timestamp;
+  return 1;
+}
+
+static int app_requeue(source_t *source, int index) {
+  struct app *a = source->priv;
+  void (*release)(void *);
+  void *opaque;
+  pthread_mutex_lock(&a->lock);
+  app_free(a, &a->buffers[index], &release, &opaque);
+  pthread_mutex_unlock(&a->lock);
+  if (release != NULL)
+    release(opaque);
+  return 1;
+}
+
+static int app_queued(source_t *source) {
+  struct app *a = source->priv;
+  pthread_mutex_lock(&a->lock);
+  int free = a->free;
+  pthread_mutex_unlock(&a->lock);
+  return free;
+}
+
+// frames pushed before the camera was turned off are stale
+static void app_drop_ready(struct app *a) {
+  for (int i = 0; i < APP_BUFFERS; ++i) {
+    void (*release)(void *) = NULL;
+    void *opaque;
+    pthread_mutex_lock(&a->lock);
+    if (a->buffers[i].state == APP_READY)
+      app_free(a, &a->buffers[i], &release, &opaque);
+    pthread_mutex_unlock(&a->lock);
+    if (release != NULL)
+      release(opaque);
+  }
+}
+
+static int app_stream(source_t *source, int on) {
+  struct app *a = source->priv;
+  pthread_mutex_lock(&a->lock);
+  a->streaming = on;
+  pthread_mutex_unlock(&a->lock);
+  if (!on)
+    app_drop_ready(a);
+  return 1;
+}
+
+static void app_close(source_t *source) {
+  struct app *a = source->priv;
+  if (a == NULL)
+    return;
+  app_drop_ready(a);
+  for (int i = 0; i < APP_BUFFERS; ++i)
+    free(a->buffers[i].data);
+  pthread_mutex_destroy(&a->lock);
+  free(a);
+  if (source->fd >= 0)
+    close(source->fd);
+  source->fd = -1;
+  source->priv = NULL;
+}
+
+static int app_open(source_t *source, const char *location, int width,
+                    int height, int rate) {
+  struct app *a = calloc(1, sizeof(struct app));
+  if (a == NULL)
+    return -1;
+  pthread_mutex_init(&a->lock, NULL);
+  a->free = APP_BUFFERS;
+  source->priv = a;
+  source->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (source->fd < 0) {
+    perror("app source");
+    app_close(source);
+    return -1;
+  }
+  return 1;
+}
+
+const struct source_ops app_source_ops = {
+    .name = "app",
+    .open = app_open,
+    .close = app_close,
+    .dequeue = app_dequeue,
+    .requeue = app_requeue,
+    .queued = app_queued,
+    .stream = app_stream,
+};
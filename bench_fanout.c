@@ -0,0 +1,576 @@
+/**
+ *  mjpeg2http
+ *
+ *  Copyright (c) 2022 Antonino Nolano. Licensed under the MIT license, as
+ * follows:
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "constants.h"
+#include "libmjpeg2http.h"
+#include "protocol.h"
+
+/*
+ * fan-out benchmark: the library replays a synthetic MJPEG file to n
+ * loopback viewers, some of them reading at a limited rate, and the
+ * delivered frames, latency from capture to the last byte of the JPEG,
+ * skipped frames, server cpu time and worker syscalls per captured frame
+ * (from /metrics) are reported as a JSON line (drop rates are null with
+ * -f 0 since there is no capture period). The latency of the slow viewers
+ * is also reported alone: it is where socket buffers fill up
+ */
+
+#define BENCH_TOKEN "benchtoken"
+#define BENCH_METRICS_TOKEN "benchmetrics"
+#define BENCH_FRAMES 8
+#define BENCH_TICK_USEC 10000
+#define BENCH_SLOW_RCVBUF 16384
+
+enum state { HEADERS, BODY, SKIP };
+
+struct viewer {
+  int fd;
+  int slow;
+  enum state state;
+  char header[1024];
+  int header_len;
+  uint32_t remaining;
+  uint64_t timestamp;
+  uint64_t budget;
+  uint64_t frames;
+  uint64_t bytes;
+};
+
+static struct {
+  int clients;
+  int slow;
+  int slow_rate; // bytes per second
+  int fps;
+  int frame_size;
+  int duration;
+  int warmup;
+  int workers;
+  int latest;
+  int uring;
+  int zerocopy; // threshold in bytes, 0: off
+  int latency;
+  int port;
+  int verbose;
+} g_opt = {100, 10, 100000, 25, 50000, 10, 1, 1, 0, 0, 0, 0, 18099, 0};
+
+static char g_path[] = "/tmp/bench_fanoutXXXXXX";
+static char g_device[64];
+static int g_recording = 0;
+static libmjpeg2http_config_t g_config;
+
+// latency samples of all the viewers and of the slow ones
+struct samples {
+  uint32_t *usec;
+  size_t count;
+  size_t size;
+};
+static struct samples g_latency, g_slowLatency;
+
+static uint64_t now_usec(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64_t wallclock_usec() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static uint64_t process_cpu_usec() {
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return (uint64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000 +
+         ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+// frames are a SOI, filler without markers and an EOI
+static int create_source() {
+  int fd = mkstemp(g_path);
+  if (fd < 0) {
+    perror("mkstemp");
+    return -1;
+  }
+  uint8_t *jpeg = malloc(g_opt.frame_size);
+  if (jpeg == NULL) {
+    close(fd);
+    return -1;
+  }
+  int ret = 1;
+  for (int i = 0; i < BENCH_FRAMES && ret > 0; ++i) {
+    memset(jpeg, 0x10 + i, g_opt.frame_size);
+    memcpy(jpeg, "\xff\xd8\xff\xe0", 4);
+    memcpy(jpeg + g_opt.frame_size - 2, "\xff\xd9", 2);
+    if (write(fd, jpeg, g_opt.frame_size) != g_opt.frame_size) {
+      perror("write");
+      ret = -1;
+    }
+  }
+  free(jpeg);
+  close(fd);
+  snprintf(g_device, sizeof(g_device), "replay:%s@%d", g_path, g_opt.fps);
+  return ret;
+}
+
+static void *server(void *arg) {
+  libmjpeg2http_loopConfig(&g_config, "127.0.0.1", g_opt.port, g_device,
+                           BENCH_TOKEN, NULL);
+  return NULL;
+}
+
+static void record_latency(struct samples *s, uint64_t usec) {
+  if (s->count == s->size) {
+    size_t size = s->size == 0 ? 65536 : s->size * 2;
+    uint32_t *latency = realloc(s->usec, size * sizeof(uint32_t));
+    if (latency == NULL)
+      return;
+    s->usec = latency;
+    s->size = size;
+  }
+  s->usec[s->count++] = usec > UINT32_MAX ? UINT32_MAX : usec;
+}
+
+static void end_of_frame(struct viewer *v) {
+  if (!g_recording)
+    return;
+  uint64_t now = wallclock_usec();
+  uint64_t usec = now > v->timestamp ? now - v->timestamp : 0;
+  record_latency(&g_latency, usec);
+  if (v->slow)
+    record_latency(&g_slowLatency, usec);
+  ++v->frames;
+}
+
+// frames are captured on a fixed period, the ones not received are skipped
+static void print_drop_rate(FILE *out, const char *key, uint64_t frames,
+                            int viewers) {
+  double expected = (double)g_opt.fps * g_opt.duration * viewers;
+  if (g_opt.fps == 0 || viewers == 0)
+    fprintf(out, ",\"%s\":null", key);
+  else
+    fprintf(out, ",\"%s\":%.4f", key,
+            frames < expected ? 1 - frames / expected : 0);
+}
+
+// HTTP headers, then per frame part headers, JPEG and boundary
+static int parse(struct viewer *v, const char *data, int len) {
+  while (len > 0) {
+    if (v->state == HEADERS) {
+      if (v->header_len == sizeof(v->header) - 1)
+        return -1;
+      v->header[v->header_len++] = *data++;
+      --len;
+      v->header[v->header_len] = 0;
+      if (v->header_len < 4 ||
+          strcmp(v->header + v->header_len - 4, "\r\n\r\n") != 0)
+        continue;
+      char *length = strstr(v->header, "Content-Length: ");
+      char *timestamp = strstr(v->header, "X-Timestamp: ");
+      if (length == NULL || timestamp == NULL) {
+        if (strncmp(v->header, "HTTP/1.0 200", 12) != 0)
+          return -1;
+        v->remaining = strlen("--" BOUNDARY "\r\n");
+        v->state = SKIP;
+      } else {
+        long sec, usec;
+        v->remaining = atoi(length + 16);
+        sscanf(timestamp + 13, "%ld.%ld", &sec, &usec);
+        v->timestamp = (uint64_t)sec * 1000000 + usec;
+        v->state = BODY;
+      }
+      v->header_len = 0;
+    } else {
+      uint32_t n = (uint32_t)len < v->remaining ? (uint32_t)len : v->remaining;
+      data += n;
+      len -= n;
+      v->remaining -= n;
+      if (v->remaining > 0)
+        continue;
+      if (v->state == BODY) {
+        end_of_frame(v);
+        v->remaining = end_frame_len;
+        v->state = SKIP;
+      } else {
+        v->state = HEADERS;
+      }
+    }
+  }
+  return 1;
+}
+
+static int receive(struct viewer *v, size_t max) {
+  char buffer[65536];
+  if (max > sizeof(buffer))
+    max = sizeof(buffer);
+  if (max == 0)
+    return 0;
+  ssize_t n = read(v->fd, buffer, max);
+  if (n == 0 || (n < 0 && errno != EAGAIN)) {
+    fprintf(stderr, "viewer disconnected\n");
+    return -1;
+  }
+  if (n < 0)
+    return 0;
+  if (g_recording)
+    v->bytes += n;
+  if (v->budget > 0)
+    v->budget -= n < (ssize_t)v->budget ? n : v->budget;
+  return parse(v, buffer, n) < 0 ? -1 : n;
+}
+
+// blocking connection with the request sent, rcvbuf 0 keeps the default
+static int connect_server(const char *request, int rcvbuf) {
+  struct sockaddr_in addr;
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) {
+    perror("socket");
+    return -1;
+  }
+  if (rcvbuf > 0)
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(int));
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(g_opt.port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  // the server may still be starting
+  int retry = 0;
+  while (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    if (++retry == 200) {
+      perror("connect");
+      close(fd);
+      return -1;
+    }
+    usleep(10000);
+  }
+  if (write(fd, request, strlen(request)) < 0) {
+    perror("write");
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static int connect_viewer(struct viewer *v, int slow) {
+  const char *request = "GET /bench?" BENCH_TOKEN " HTTP/1.1\r\n\r\n";
+
+  memset(v, 0, sizeof(struct viewer));
+  v->slow = slow;
+  v->fd = connect_server(request, slow ? BENCH_SLOW_RCVBUF : 0);
+  if (v->fd < 0)
+    return -1;
+  fcntl(v->fd, F_SETFL, fcntl(v->fd, F_GETFL) | O_NONBLOCK);
+  return 1;
+}
+
+static uint64_t counter(const char *metrics, const char *name) {
+  const char *line = strstr(metrics, name);
+  return line != NULL ? strtoull(line + strlen(name), NULL, 10) : 0;
+}
+
+// worker syscalls and captured frames so far
+static int read_counters(uint64_t *syscalls, uint64_t *captured) {
+  const char *request = "GET /metrics?" BENCH_METRICS_TOKEN " HTTP/1.0\r\n\r\n";
+  static char metrics[2 * METRICS_BUFFER_SIZE];
+  int fd = connect_server(request, 0);
+  if (fd < 0)
+    return -1;
+  size_t len = 0;
+  ssize_t n;
+  while (len < sizeof(metrics) - 1 &&
+         (n = read(fd, metrics + len, sizeof(metrics) - 1 - len)) > 0)
+    len += n;
+  metrics[len] = 0;
+  close(fd);
+  *syscalls = counter(metrics, "\nmjpeg2http_worker_syscalls_total ");
+  *captured = counter(metrics, "\nmjpeg2http_frames_captured_total ");
+  return 1;
+}
+
+static int compare(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static uint32_t percentile(struct samples *s, double p) {
+  if (s->count == 0)
+    return 0;
+  size_t i = p * s->count;
+  return s->usec[i < s->count ? i : s->count - 1];
+}
+
+static void report(FILE *out, struct viewer *viewers, uint64_t elapsed,
+                   uint64_t server_cpu, uint64_t syscalls, uint64_t captured) {
+  uint64_t frames[2] = {0, 0}, bytes = 0;
+  for (int i = 0; i < g_opt.clients; ++i) {
+    frames[viewers[i].slow] += viewers[i].frames;
+    bytes += viewers[i].bytes;
+  }
+  qsort(g_latency.usec, g_latency.count, sizeof(uint32_t), compare);
+  qsort(g_slowLatency.usec, g_slowLatency.count, sizeof(uint32_t), compare);
+
+  double seconds = elapsed / 1e6;
+  double mb = bytes / 1e6;
+  // the latency mode sends the freshest frame whatever the policy
+  const char *policy = g_opt.latest || g_opt.latency ? "latest" : "queue";
+  fprintf(out,
+          "{\"clients\":%d,\"slow_clients\":%d,\"slow_rate\":%d,"
+          "\"fps\":%d,\"frame_size\":%d,\"workers\":%d,\"policy\":\"%s\","
+          "\"backend\":\"%s\",\"zerocopy\":%d,\"latency_mode\":%d,"
+          "\"duration_s\":%.3f,\"frames_per_s\":%.1f,\"bytes_per_s\":%.0f,"
+          "\"latency_p50_us\":%u,\"latency_p99_us\":%u,"
+          "\"latency_p999_us\":%u,\"slow_latency_p50_us\":%u,"
+          "\"slow_latency_p99_us\":%u",
+          g_opt.clients, g_opt.slow, g_opt.slow_rate, g_opt.fps,
+          g_opt.frame_size, g_opt.workers, policy,
+          g_opt.uring ? "io_uring" : "epoll", g_opt.zerocopy, g_opt.latency,
+          seconds, (frames[0] + frames[1]) / seconds, bytes / seconds,
+          percentile(&g_latency, 0.5), percentile(&g_latency, 0.99),
+          percentile(&g_latency, 0.999), percentile(&g_slowLatency, 0.5),
+          percentile(&g_slowLatency, 0.99));
+  print_drop_rate(out, "drop_rate", frames[0] + frames[1], g_opt.clients);
+  print_drop_rate(out, "fast_drop_rate", frames[0], g_opt.clients - g_opt.slow);
+  print_drop_rate(out, "slow_drop_rate", frames[1], g_opt.slow);
+  fprintf(out,
+          ",\"server_cpu_s\":%.3f,\"cpu_ms_per_mb\":%.3f,"
+          "\"cpu_ms_per_client\":%.3f,\"syscalls_per_frame\":%.1f}\n",
+          server_cpu / 1e6, mb > 0 ? server_cpu / 1e3 / mb : 0,
+          server_cpu / 1e3 / g_opt.clients,
+          captured > 0 ? (double)syscalls / captured : 0);
+  fflush(out);
+}
+
+static int run(FILE *out) {
+  struct epoll_event ev, events[64];
+  struct viewer *viewers = calloc(g_opt.clients, sizeof(struct viewer));
+  int epfd = epoll_create1(0), ret = -1, connected = 0;
+  pthread_t thread;
+
+  if (viewers == NULL || epfd < 0) {
+    perror("bench setup");
+    goto errorOnSetup;
+  }
+  if (pthread_create(&thread, NULL, server, NULL) != 0) {
+    perror("pthread_create");
+    goto errorOnSetup;
+  }
+
+  for (; connected < g_opt.clients; ++connected) {
+    struct viewer *v = &viewers[connected];
+    if (connect_viewer(v, connected < g_opt.slow) < 0)
+      goto errorOnConnect;
+    // slow viewers are served on the tick within their budget
+    if (!v->slow) {
+      ev.events = EPOLLIN;
+      ev.data.ptr = v;
+      if (epoll_ctl(epfd, EPOLL_CTL_ADD, v->fd, &ev) < 0) {
+        perror("epoll_ctl");
+        goto errorOnConnect;
+      }
+    }
+  }
+
+  uint64_t start = now_usec(CLOCK_MONOTONIC), tick = start;
+  uint64_t warmup_end = start + g_opt.warmup * 1000000ULL;
+  uint64_t end = warmup_end + g_opt.duration * 1000000ULL;
+  uint64_t cpu_start = 0, client_cpu_start = 0;
+  uint64_t syscalls_start = 0, captured_start = 0;
+  for (;;) {
+    uint64_t now = now_usec(CLOCK_MONOTONIC);
+    if (!g_recording && now >= warmup_end) {
+      if (read_counters(&syscalls_start, &captured_start) < 0)
+        goto errorOnReceive;
+      g_recording = 1;
+      cpu_start = process_cpu_usec();
+      client_cpu_start = now_usec(CLOCK_THREAD_CPUTIME_ID);
+    }
+    if (now >= end)
+      break;
+    if (now >= tick) {
+      tick += BENCH_TICK_USEC;
+      uint64_t quantum = (uint64_t)g_opt.slow_rate * BENCH_TICK_USEC / 1000000;
+      for (int i = 0; i < g_opt.slow; ++i) {
+        struct viewer *v = &viewers[i];
+        v->budget += quantum;
+        if (v->budget > 10 * quantum)
+          v->budget = 10 * quantum;
+        int n;
+        while ((n = receive(v, v->budget)) > 0)
+          ;
+        if (n < 0)
+          goto errorOnReceive;
+      }
+    }
+    int timeout = tick > now ? (tick - now + 999) / 1000 : 0;
+    int nfds = epoll_wait(epfd, events, 64, timeout);
+    for (int n = 0; n < nfds; ++n)
+      if (receive(events[n].data.ptr, SIZE_MAX) < 0)
+        goto errorOnReceive;
+  }
+
+  uint64_t client_cpu = now_usec(CLOCK_THREAD_CPUTIME_ID) - client_cpu_start;
+  uint64_t cpu = process_cpu_usec() - cpu_start;
+  uint64_t syscalls, captured;
+  if (read_counters(&syscalls, &captured) < 0)
+    goto errorOnReceive;
+  report(out, viewers, g_opt.duration * 1000000ULL,
+         cpu > client_cpu ? cpu - client_cpu : 0, syscalls - syscalls_start,
+         captured - captured_start);
+  ret = 0;
+
+errorOnReceive:
+errorOnConnect:
+  while (connected > 0)
+    close(viewers[--connected].fd);
+  libmjpeg2http_endLoop();
+  pthread_join(thread, NULL);
+
+errorOnSetup:
+  if (epfd >= 0)
+    close(epfd);
+  free(viewers);
+  return ret;
+}
+
+static void usage() {
+  printf("usage: ./bench_fanout [-n clients] [-s slow_clients] "
+         "[-r slow_bytes_per_s] [-f fps] [-z frame_size] [-d seconds] "
+         "[-w workers] [-l] [-u] [-L] [-Z threshold] [-p port] [-v]\n");
+  printf("  -f 0 replays frames as fast as possible\n");
+  printf("  -l  latest frame policy, -u  io_uring backend, -v  keep the server "
+         "log\n");
+  printf("  -Z  MSG_ZEROCOPY for frames of at least threshold bytes\n");
+  printf("  -L  latency mode: about a frame in the socket, freshest frame "
+         "picked when it has drained (latest frame policy)\n");
+}
+
+int main(int argc, char **argv) {
+  int opt;
+  while ((opt = getopt(argc, argv, "n:s:r:f:z:d:w:luLZ:p:v")) != -1) {
+    switch (opt) {
+    case 'n':
+      g_opt.clients = atoi(optarg);
+      break;
+    case 's':
+      g_opt.slow = atoi(optarg);
+      break;
+    case 'r':
+      g_opt.slow_rate = atoi(optarg);
+      break;
+    case 'f':
+      g_opt.fps = atoi(optarg);
+      break;
+    case 'z':
+      g_opt.frame_size = atoi(optarg);
+      break;
+    case 'd':
+      g_opt.duration = atoi(optarg);
+      break;
+    case 'w':
+      g_opt.workers = atoi(optarg);
+      break;
+    case 'l':
+      g_opt.latest = 1;
+      break;
+    case 'u':
+      g_opt.uring = 1;
+      break;
+    case 'L':
+      g_opt.latency = 1;
+      break;
+    case 'Z':
+      g_opt.zerocopy = atoi(optarg);
+      break;
+    case 'p':
+      g_opt.port = atoi(optarg);
+      break;
+    case 'v':
+      g_opt.verbose = 1;
+      break;
+    default:
+      usage();
+      return 1;
+    }
+  }
+  if (g_opt.clients <= 0 || g_opt.slow > g_opt.clients || g_opt.fps < 0 ||
+      g_opt.frame_size < 16 || g_opt.duration <= 0) {
+    usage();
+    return 1;
+  }
+
+  // viewers and their connections live in the same process
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+
+  // the result is the only output unless the server log is wanted
+  FILE *out = fdopen(dup(STDOUT_FILENO), "w");
+  if (out == NULL) {
+    perror("fdopen");
+    return 1;
+  }
+  if (!g_opt.verbose) {
+    int devnull = open("/dev/null", O_WRONLY);
+    if (devnull >= 0) {
+      dup2(devnull, STDOUT_FILENO);
+      close(devnull);
+    }
+  }
+
+  if (create_source() < 0)
+    return 1;
+  libmjpeg2http_defaultConfig(&g_config);
+  g_config.workers = g_opt.workers;
+  g_config.policy =
+      g_opt.latest ? MJPEG2HTTP_POLICY_LATEST : MJPEG2HTTP_POLICY_QUEUE;
+  g_config.backend =
+      g_opt.uring ? MJPEG2HTTP_BACKEND_URING : MJPEG2HTTP_BACKEND_EPOLL;
+  g_config.zerocopy = g_opt.zerocopy;
+  g_config.latency = g_opt.latency;
+  snprintf(g_config.metrics_token, sizeof(g_config.metrics_token), "%s",
+           BENCH_METRICS_TOKEN);
+  int ret = run(out);
+  unlink(g_path);
+  fclose(out);
+  return ret == 0 ? 0 : 1;
+}
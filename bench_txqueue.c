@@ -0,0 +1,178 @@
+/**
+ *  mjpeg2http
+ *
+ *  Copyright (c) 2022 Antonino Nolano. Licensed under the MIT license, as
+ * follows:
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "client.h"
+#include "constants.h"
+#include "frame.h"
+#include "list.h"
+#include "txring.h"
+
+/*
+ * tx queue benchmark: n clients hold a steady queue depth and every round
+ * each of them gets a new frame and sends its oldest one, the same way
+ * client_enqueue_frame and client_tx do. The list keeps a malloc'd message
+ * per frame and walks itself to know its size, the ring does neither. The
+ * ns per enqueue + dequeue of both are reported as a JSON line
+ */
+
+#define BENCH_FRAMES 16
+
+static struct {
+  int clients;
+  int depth;
+  int rounds;
+} g_opt = {1000, 4, 10000};
+
+static frame_t *g_frames[BENCH_FRAMES];
+
+static uint64_t now_nsec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void list_enqueue(struct dlist *queue, frame_t *frame) {
+  int size = 0;
+  list_size(size, queue);
+  // stands for the drop check of client_enqueue_frame
+  if (size > TX_RING_SIZE)
+    abort();
+  message_t *msg = malloc(sizeof(message_t));
+  msg->frame = frame_ref(frame);
+  list_add_left(&msg->node, queue);
+}
+
+static void list_dequeue(struct dlist *queue) {
+  message_t *msg = list_get_entry(list_get_first(queue), message_t, node);
+  list_del(&msg->node);
+  frame_unref(msg->frame);
+  free(msg);
+}
+
+static double bench_list() {
+  struct dlist *queues = malloc(g_opt.clients * sizeof(struct dlist));
+  for (int c = 0; c < g_opt.clients; ++c) {
+    init_list_entry(&queues[c]);
+    for (int d = 0; d < g_opt.depth; ++d)
+      list_enqueue(&queues[c], g_frames[d % BENCH_FRAMES]);
+  }
+  uint64_t start = now_nsec();
+  for (int r = 0; r < g_opt.rounds; ++r) {
+    frame_t *frame = g_frames[r % BENCH_FRAMES];
+    for (int c = 0; c < g_opt.clients; ++c) {
+      list_enqueue(&queues[c], frame);
+      list_dequeue(&queues[c]);
+    }
+  }
+  uint64_t elapsed = now_nsec() - start;
+  for (int c = 0; c < g_opt.clients; ++c)
+    while (!list_empty(&queues[c]))
+      list_dequeue(&queues[c]);
+  free(queues);
+  return (double)elapsed / ((double)g_opt.rounds * g_opt.clients);
+}
+
+static double bench_ring() {
+  struct tx_ring *queues = malloc(g_opt.clients * sizeof(struct tx_ring));
+  for (int c = 0; c < g_opt.clients; ++c) {
+    tx_ring_init(&queues[c]);
+    for (int d = 0; d < g_opt.depth; ++d)
+      tx_ring_push(&queues[c], frame_ref(g_frames[d % BENCH_FRAMES]));
+  }
+  uint64_t start = now_nsec();
+  for (int r = 0; r < g_opt.rounds; ++r) {
+    frame_t *frame = g_frames[r % BENCH_FRAMES];
+    for (int c = 0; c < g_opt.clients; ++c) {
+      if (!tx_ring_push(&queues[c], frame_ref(frame)))
+        abort();
+      frame_unref(tx_ring_pop(&queues[c]));
+    }
+  }
+  uint64_t elapsed = now_nsec() - start;
+  frame_t *frame;
+  for (int c = 0; c < g_opt.clients; ++c)
+    while ((frame = tx_ring_pop(&queues[c])) != NULL)
+      frame_unref(frame);
+  free(queues);
+  return (double)elapsed / ((double)g_opt.rounds * g_opt.clients);
+}
+
+static void usage() {
+  printf("usage: bench_txqueue [-n clients] [-q depth] [-i rounds]\n"
+         "  -n  clients, each with its own queue (default 1000)\n"
+         "  -q  frames kept in every queue, less than %d (default 4)\n"
+         "  -i  frames enqueued and sent by every client (default 10000)\n",
+         TX_RING_SIZE);
+}
+
+int main(int argc, char **argv) {
+  int opt;
+  while ((opt = getopt(argc, argv, "n:q:i:")) != -1) {
+    switch (opt) {
+    case 'n':
+      g_opt.clients = atoi(optarg);
+      break;
+    case 'q':
+      g_opt.depth = atoi(optarg);
+      break;
+    case 'i':
+      g_opt.rounds = atoi(optarg);
+      break;
+    default:
+      usage();
+      return 1;
+    }
+  }
+  // one more frame is queued before the oldest is sent
+  if (g_opt.clients <= 0 || g_opt.depth < 0 || g_opt.depth >= TX_RING_SIZE ||
+      g_opt.rounds <= 0) {
+    usage();
+    return 1;
+  }
+
+  static const uint8_t payload[1024];
+  for (int i = 0; i < BENCH_FRAMES; ++i)
+    g_frames[i] = frame_create("", 0, payload, sizeof(payload), "", 0);
+
+  // a first list run warms up the allocator
+  bench_list();
+  double list_ns = bench_list();
+  double ring_ns = bench_ring();
+
+  for (int i = 0; i < BENCH_FRAMES; ++i)
+    frame_unref(g_frames[i]);
+
+  printf("{\"clients\":%d,\"depth\":%d,\"rounds\":%d,\"list_ns\":%.1f,"
+         "\"ring_ns\":%.1f,\"speedup\":%.2f}\n",
+         g_opt.clients, g_opt.depth, g_opt.rounds, list_ns, ring_ns,
+         list_ns / ring_ns);
+  return 0;
+}
@@ -26,56 +26,221 @@
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <linux/errqueue.h>
+#include <linux/sockios.h>
+#include <netinet/tcp.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include "client.h"
+#include "metrics.h"
+#include "pool.h"
+#include "uring.h"
+
+// one set of pools per network thread
+static __thread pool_t g_rx_small, g_rx_large;
+static __thread int g_pools_ready = 0;
+
+static void client_init_pools() {
+  if (!g_pools_ready) {
+    pool_init(&g_rx_small, RXBUF_SMALL, RXBUF_PER_SLAB);
+    pool_init(&g_rx_large, RXBUF_LARGE, RXBUF_PER_SLAB);
+    g_pools_ready = 1;
+  }
+}
+
+void client_release_pools() {
+  if (g_pools_ready) {
+    pool_destroy(&g_rx_small);
+    pool_destroy(&g_rx_large);
+    g_pools_ready = 0;
+  }
+}
 
 client_t *client_init(char *hostname, int port, int fd) {
   printf("new client %s %d fd=%d\n", hostname, port, fd);
   fflush(stdout);
+  client_init_pools();
   client_t *c = malloc(sizeof(client_t));
-  c->hostname = strdup(hostname);
+  snprintf(c->hostname, sizeof(c->hostname), "%s", hostname);
   c->port = port;
   c->fd = fd;
-  init_list_entry(&c->tx_queue);
-  c->total_to_sent = c->start_token = c->end_token = c->rxbuf_pos = c->is_auth =
-      c->txbuf_pos = 0;
+  tx_ring_init(&c->tx_queue);
+  c->tx_frame = c->tx_latest = NULL;
+  c->tx_start = 0;
+  c->latency = c->out_armed = 0;
+  c->epfd = -1;
+  c->lowat = 0;
+  c->uring = NULL;
+  c->uring_tag = NULL;
+  c->inflight = 0;
+  c->zerocopy = c->zc_seq = 0;
+  c->zc_copy = 0;
+  init_list_entry(&c->zc_pending);
+  c->policy = TX_QUEUE;
+  c->tx_queue_max = TX_QUEUE_MAX;
+  c->skipped = 0;
+  c->decimation = 1;
+  c->countdown = c->fps_cap = c->clean = 0;
+  c->interval = c->frame_size = c->written = 0;
+  c->rate = c->last_ts = 0;
+  c->outq = 0;
+  shaper_init(&c->shaper, 0, 0);
+  c->egress = NULL;
+  c->rxbuf = NULL;
+  c->rxbuf_size = 0;
+  c->start_token = c->end_token = c->rxbuf_pos = c->is_auth = c->tx_pos = 0;
+  c->start_path = c->end_path = c->closing = c->keep_alive = 0;
+  c->request_len = 0;
+  c->deadline = 0;
+  c->camera = -1;
   return c;
 }
 
+// small buffer first, moved to a large one only if the request needs it
+static int client_grow_rxbuf(client_t *client) {
+  uint8_t *buf;
+  if (client->rxbuf == NULL) {
+    if ((buf = pool_get(&g_rx_small)) == NULL)
+      return -1;
+    client->rxbuf_size = RXBUF_SMALL;
+  } else if (client->rxbuf_size == RXBUF_SMALL) {
+    if ((buf = pool_get(&g_rx_large)) == NULL)
+      return -1;
+    memcpy(buf, client->rxbuf, client->rxbuf_pos);
+    pool_put(&g_rx_small, client->rxbuf);
+    client->rxbuf_size = RXBUF_LARGE;
+  } else {
+    return 0;
+  }
+  client->rxbuf = buf;
+  return 1;
+}
+
+// the request is consumed, pipelined requests stay in the buffer
+void client_release_request(client_t *client) {
+  int left = client->rxbuf_pos - client->request_len;
+  if (client->request_len > 0 && left > 0) {
+    memmove(client->rxbuf, client->rxbuf + client->request_len, left);
+    client->rxbuf_pos = left;
+    client->rxbuf[left] = 0;
+  } else {
+    if (client->rxbuf != NULL)
+      pool_put(client->rxbuf_size == RXBUF_SMALL ? &g_rx_small : &g_rx_large,
+               client->rxbuf);
+    client->rxbuf = NULL;
+    client->rxbuf_size = client->rxbuf_pos = 0;
+  }
+  client->request_len = client->start_token = client->end_token = 0;
+  client->start_path = client->end_path = 0;
+}
+
+// length of the request line and headers up to the empty line, 0 if the
+// request is not complete yet
+static int client_request_end(const uint8_t *buf, int len) {
+  const uint8_t *nl = buf, *end = buf + len;
+  while (nl < end && (nl = memchr(nl, '\n', end - nl)) != NULL) {
+    const uint8_t *next = ++nl;
+    if (next < end && *next == '\r')
+      ++next;
+    if (next < end && *next == '\n')
+      return next + 1 - buf;
+  }
+  return 0;
+}
+
+static int client_has_token(const char *s, const char *end,
+                            const char *token) {
+  int len = strlen(token);
+  for (; end - s >= len; ++s) {
+    if (strncasecmp(s, token, len) == 0)
+      return 1;
+  }
+  return 0;
+}
+
+static int client_parse_line(client_t *client, int len) {
+  const char *start = (const char *)client->rxbuf;
+  const char *end = memchr(start, '\n', len);
+  // GET /whatever?myauthtoken HTTP/1.1
+  const char *sp = memchr(start, ' ', end - start);
+  if (sp == NULL || end - sp < 2)
+    return -1;
+  const char *sq = memchr(sp + 1, '?', end - sp - 1);
+  if (sq == NULL || end - sq < 2)
+    return -1;
+  const char *eq = memchr(sq + 1, ' ', end - sq - 1);
+  if (eq == NULL)
+    return -1;
+  // GET /whatever?myauthtoken&fps=10 HTTP/1.1
+  const char *amp = memchr(sq + 1, '&', eq - sq - 1);
+  client->start_path = sp + 1 - start;
+  client->end_path = sq - start;
+  client->start_token = sq + 1 - start;
+  client->end_token = (amp != NULL ? amp : eq) - start;
+  for (; amp != NULL && amp < eq; amp = memchr(amp + 1, '&', eq - amp)) {
+    if (strncmp(amp + 1, "fps=", 4) == 0)
+      client->fps_cap = atoi(amp + 5);
+  }
+
+  // HTTP/1.1 is persistent unless the client says otherwise
+  client->keep_alive = end - eq >= 9 && strncmp(eq + 1, "HTTP/1.1", 8) == 0;
+  for (const char *line = end + 1; line < start + len; line = end + 1) {
+    end = memchr(line, '\n', start + len - line);
+    if (strncasecmp(line, "Connection:", 11) == 0) {
+      if (client_has_token(line + 11, end, "close"))
+        client->keep_alive = 0;
+      else if (client_has_token(line + 11, end, "keep-alive"))
+        client->keep_alive = 1;
+    }
+  }
+  client->request_len = len;
+  return 1;
+}
+
 int client_parse_request(client_t *client) {
-  if (client->start_token != 0) {
-    // token already decoded
+  if (client->request_len != 0) {
+    // request already decoded
     return 1;
   }
 
-  int r;
-  while ((r = read(client->fd, client->rxbuf + client->rxbuf_pos,
-                   1000 - client->rxbuf_pos)) > 0)
-    client->rxbuf_pos += r;
+  // pipelined requests are parsed from the buffer without reading again
+  int len = client->rxbuf_pos > 0
+                ? client_request_end(client->rxbuf, client->rxbuf_pos)
+                : 0;
+  if (len > 0)
+    return client_parse_line(client, len);
 
-  if (r < 0) {
-    if (errno == EAGAIN || errno == EWOULDBLOCK) {
-      const char *end = strchr((const char *)client->rxbuf, '\n');
-      if (end != NULL) {
-        // GET /whatever?myauthtoken HTTP/1.1
-        // read enough bytes to get myauthtoken
-        const char *sp = strchr((const char *)client->rxbuf, ' ');
-        if (sp == NULL || end - sp < 2)
-          return -1;
-        const char *sq = strchr(sp + 1, '?');
-        if (sq == NULL || end - sq < 2)
-          return -1;
-        const char *eq = strchr(sq + 1, ' ');
-        if (eq == NULL)
-          return -1;
-        client->start_token = sq + 1 - (const char *)client->rxbuf;
-        client->end_token = eq - (const char *)client->rxbuf;
-        return 1;
+  int r, full = 0;
+  for (;;) {
+    if (client->rxbuf_pos + 1 >= client->rxbuf_size) {
+      if ((r = client_grow_rxbuf(client)) < 0)
+        return -1;
+      if (r == 0) {
+        full = 1;
+        break;
       }
+    }
+    // keep one byte to terminate the string
+    r = read(client->fd, client->rxbuf + client->rxbuf_pos,
+             client->rxbuf_size - 1 - client->rxbuf_pos);
+    if (r <= 0)
+      break;
+    client->rxbuf_pos += r;
+  }
+  client->rxbuf[client->rxbuf_pos] = 0;
 
-      return 0;
+  if (full || r < 0) {
+    if (full || errno == EAGAIN || errno == EWOULDBLOCK) {
+      len = client_request_end(client->rxbuf, client->rxbuf_pos);
+      if (len > 0)
+        return client_parse_line(client, len);
+
+      return full ? -1 : 0;
     }
     printf("rxbuf %d error %s\n", client->fd, strerror(errno));
     fflush(stdout);
@@ -85,117 +250,449 @@ int client_parse_request(client_t *client) {
   return 0;
 }
 
-void client_free(client_t *client) {
-  printf("destroy client %s %d fd=%d\n", client->hostname, client->port,
-         client->fd);
-  fflush(stdout);
+static void client_free_messages(struct dlist *list) {
   struct dlist *itr, *save;
   message_t *msg;
-  list_iterate_safe(itr, save, &client->tx_queue) {
+  list_iterate_safe(itr, save, list) {
     list_del(&list_get_entry(itr, message_t, node)->node);
     msg = list_get_entry(itr, message_t, node);
-    if (--*(msg->payload + msg->size) == 0)
-      free(msg->payload);
+    frame_unref(msg->frame);
     free(msg);
   }
+}
+
+void client_free(client_t *client) {
+  printf("destroy client %s %d fd=%d skipped=%u\n", client->hostname,
+         client->port, client->fd, client->skipped);
+  fflush(stdout);
+  frame_t *queued;
+  while ((queued = tx_ring_pop(&client->tx_queue)) != NULL)
+    frame_unref(queued);
+  // the pages stay pinned by the kernel until the socket drops them
+  client_free_messages(&client->zc_pending);
+  if (client->tx_frame != NULL)
+    frame_unref(client->tx_frame);
+  if (client->tx_latest != NULL)
+    frame_unref(client->tx_latest);
 
+  client_release_request(client);
   close(client->fd);
-  free(client->hostname);
   free(client);
 }
 
-int client_write_txbuf(client_t *client) {
-  int txbuf_pos;
-  while ((txbuf_pos = write(client->fd, client->txbuf + client->txbuf_pos,
-                            client->total_to_sent - client->txbuf_pos)) > 0) {
-    // printf("raw: %.*s\n", txbuf_pos, client->txbuf + client->txbuf_pos);
-    client->txbuf_pos += txbuf_pos;
+static void client_frame_sent(client_t *client) {
+  frame_t *f = client->tx_frame;
+  if (f->timestamp != 0) {
+    uint64_t now = metrics_usec();
+    metrics_add(frames_sent, 1);
+    metrics_observe(&t_metrics->latency[STAGE_QUEUE],
+                    client->tx_start - f->prepared);
+    metrics_observe(&t_metrics->latency[STAGE_SEND], now - client->tx_start);
+    metrics_observe(&t_metrics->latency[STAGE_TOTAL], now - f->timestamp);
   }
+  frame_unref(f);
+  client->tx_frame = NULL;
+  client->tx_pos = 0;
+  client->zc_copy = 0;
+}
+
+static int client_zerocopy(client_t *client) {
+  return client->zerocopy != 0 && !client->zc_copy &&
+         client->tx_frame->size >= client->zerocopy;
+}
 
-  if (client->txbuf_pos == client->total_to_sent) {
-    //	printf("frame size=%d sent %s:%d\n", client->total_to_sent,
-    // client->hostname, client->port);
-    client->total_to_sent = client->txbuf_pos = 0;
+// a zero copy send of tx_frame was accepted: the frame is kept until the
+// kernel reports the send id done, consecutive sends share one entry
+static void client_zerocopy_sent(client_t *client) {
+  struct dlist *last = client->zc_pending.left;
+  message_t *msg = list_get_entry(last, message_t, node);
+  if (last == &client->zc_pending || msg->frame != client->tx_frame) {
+    msg = malloc(sizeof(message_t));
+    msg->frame = frame_ref(client->tx_frame);
+    list_add_left(&msg->node, &client->zc_pending);
   }
+  msg->seq = client->zc_seq++;
+}
 
-  if (txbuf_pos >= 0)
-    return 1;
+// ENOBUFS: too many notifications not read yet, the frame is copied;
+// EFAULT: pages that cannot be pinned (e.g. some V4L2 buffers), copied
+// from now on
+static void client_zerocopy_failed(client_t *client, int err) {
+  if (err == ENOBUFS) {
+    client->zc_copy = 1;
+    return;
+  }
+  printf("client %s %d: zero copy off, %s\n", client->hostname, client->port,
+         strerror(err));
+  fflush(stdout);
+  client->zerocopy = 0;
+}
+
+// notifications from the error queue: sends up to each notified id are done
+// and their frames released, 0 if there is nothing but a socket error
+int client_zerocopy_complete(client_t *client) {
+  char control[CMSG_SPACE(sizeof(struct sock_extended_err) +
+                          sizeof(struct sockaddr_in6))];
+  int n = 0;
+  for (;; ++n) {
+    struct msghdr msg = {.msg_control = control,
+                         .msg_controllen = sizeof(control)};
+    metrics_add(syscalls, 1);
+    if (recvmsg(client->fd, &msg, MSG_ERRQUEUE) < 0)
+      return errno == EAGAIN || errno == EWOULDBLOCK ? n : -1;
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    if (cm == NULL)
+      return -1;
+    struct sock_extended_err *err = (struct sock_extended_err *)CMSG_DATA(cm);
+    if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+      return -1;
 
-  if (errno == EAGAIN || errno == EWOULDBLOCK) {
+    // the kernel fell back to copying, e.g. loopback: no gain left
+    if ((err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) && client->zerocopy) {
+      printf("client %s %d: zero copy off, sends are copied\n",
+             client->hostname, client->port);
+      fflush(stdout);
+      client->zerocopy = 0;
+    }
+
+    // ids are completed in order on a TCP socket, ee_data is the last one
+    struct dlist *itr, *save;
+    list_iterate_safe(itr, save, &client->zc_pending) {
+      message_t *m = list_get_entry(itr, message_t, node);
+      if ((int32_t)(err->ee_data - m->seq) < 0)
+        break;
+      list_del(&m->node);
+      frame_unref(m->frame);
+      free(m);
+    }
+  }
+}
+
+// io_uring: the rest of the frame is queued as one sendmsg, submitted with
+// the sends of the other clients
+static int client_queue_send(client_t *client) {
+  if (client->inflight)
     return 0;
+  struct io_uring_sqe *sqe = uring_get_sqe(client->uring);
+  if (sqe == NULL)
+    return -1;
+  if (client->tx_pos == 0 && client->tx_frame->timestamp != 0)
+    client->tx_start = metrics_usec();
+  memset(&client->msg, 0, sizeof(struct msghdr));
+  client->msg.msg_iov = client->iov;
+  client->msg.msg_iovlen =
+      frame_iov(client->tx_frame, client->tx_pos, client->iov);
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = client->fd;
+  sqe->addr = (uintptr_t)&client->msg;
+  sqe->len = 1;
+  sqe->msg_flags = MSG_NOSIGNAL | (client_zerocopy(client) ? MSG_ZEROCOPY : 0);
+  sqe->user_data = (uintptr_t)client->uring_tag;
+  client->inflight = 1;
+  return 0;
+}
+
+static int client_write_frame(client_t *client) {
+  frame_t *f = client->tx_frame;
+  struct iovec iov[FRAME_SEGMENTS];
+  int r = 0;
+
+  if (client->uring != NULL)
+    return client_queue_send(client);
+  if (client->tx_pos == 0 && f->timestamp != 0)
+    client->tx_start = metrics_usec();
+  while (client->tx_pos < f->size) {
+    int iovcnt = frame_iov(f, client->tx_pos, iov);
+    metrics_add(syscalls, 1);
+    if (client_zerocopy(client)) {
+      struct msghdr msg = {.msg_iov = iov, .msg_iovlen = iovcnt};
+      r = sendmsg(client->fd, &msg, MSG_ZEROCOPY | MSG_NOSIGNAL);
+      if (r < 0 && (errno == ENOBUFS || errno == EFAULT)) {
+        client_zerocopy_failed(client, errno);
+        continue;
+      }
+      if (r > 0)
+        client_zerocopy_sent(client);
+    } else {
+      r = writev(client->fd, iov, iovcnt);
+    }
+    if (r <= 0)
+      break;
+    client->tx_pos += r;
+    client->written += r;
+    metrics_add(bytes_sent, r);
+  }
+
+  if (client->tx_pos == f->size) {
+    client_frame_sent(client);
+    return 1;
   }
 
-  printf("txbuf fd=%d error %s\n", client->fd, strerror(errno));
+  if (r >= 0 || errno == EAGAIN || errno == EWOULDBLOCK)
+    return 0;
+
+  printf("tx fd=%d error %s\n", client->fd, strerror(errno));
   fflush(stdout);
 
   return -1;
 }
 
+// latency mode: EPOLLOUT is reported only while there is something to send
+static void client_want_out(client_t *c, int on) {
+  if (c->epfd < 0 || c->out_armed == on)
+    return;
+  struct epoll_event ev;
+  ev.events = EPOLLIN | EPOLLET | EPOLLRDHUP | EPOLLERR | EPOLLHUP |
+              (on ? EPOLLOUT : 0);
+  ev.data.ptr = c->uring_tag;
+  metrics_add(syscalls, 1);
+  if (epoll_ctl(c->epfd, EPOLL_CTL_MOD, c->fd, &ev) == 0)
+    c->out_armed = on;
+}
+
+// latency mode: less than TCP_NOTSENT_LOWAT still to send, which is also
+// when the socket is reported writable
+static int client_drained(client_t *c) {
+  int unsent = 0;
+  if (c->lowat == 0)
+    return 1;
+  metrics_add(syscalls, 1);
+  return ioctl(c->fd, SIOCOUTQNSD, &unsent) < 0 || unsent < (int)c->lowat;
+}
+
+static int client_shaped(client_t *c, frame_t *frame) {
+  return frame->timestamp != 0 && (c->shaper.rate != 0 || c->egress != NULL);
+}
+
+// next frame to write: it counts as sent under the budgets from here on
+static void client_start_frame(client_t *c, frame_t *frame) {
+  c->tx_frame = frame;
+  c->tx_pos = 0;
+  if (client_shaped(c, frame))
+    metrics_add(bytes_shaped, frame->size);
+}
+
 int client_tx(client_t *client) {
 
   int r;
 
   do {
     r = 0;
-    if (client->total_to_sent > 0) {
-      r = client_write_txbuf(client);
-    } else if (!list_empty(&client->tx_queue)) {
-      // printf("move message from tx queue to tx buffer\n");
-      message_t *msg =
-          list_get_entry(list_get_first(&client->tx_queue), message_t, node);
-      list_del(&msg->node);
-      memcpy(client->txbuf, msg->payload, msg->size);
-      client->total_to_sent = msg->size;
-      client->txbuf_pos = 0;
-      if (--*(msg->payload + msg->size) == 0)
-        free(msg->payload);
-      free(msg);
-      r = client_write_txbuf(client);
+    if (client->tx_frame != NULL) {
+      r = client_write_frame(client);
+    } else if (client->latency && client->tx_latest != NULL &&
+               !client_drained(client)) {
+      // the freshest frame is picked when the socket is writable again
+      break;
+    } else if (tx_ring_depth(&client->tx_queue) > 0) {
+      client_start_frame(client, tx_ring_pop(&client->tx_queue));
+      r = client_write_frame(client);
+    } else if (client->tx_latest != NULL) {
+      client_start_frame(client, client->tx_latest);
+      client->tx_latest = NULL;
+      r = client_write_frame(client);
     }
   } while (r > 0);
 
+  // waiting for room: a frame held back or the rest of a partial write
+  if (r >= 0 && client->latency)
+    client_want_out(client,
+                    client->tx_latest != NULL ||
+                        (client->tx_frame != NULL && !client->inflight));
   return r;
 }
 
-void client_enqueue_frame(client_t *client, uint8_t *payload, int size,
-                          uint8_t **allocated) {
-  int tx_queue_size = 0;
-  list_size(tx_queue_size, &client->tx_queue);
-  // printf("enqueue message size=%d, still to sent=%d tx_queue_size=%d\n",
-  // size, client->total_to_sent - client->txbuf_pos, tx_queue_size);
+// result of the send queued by client_queue_send, then the next frame
+int client_tx_complete(client_t *client, int res) {
+  int zc = client_zerocopy(client);
+  client->inflight = 0;
+  if (zc && (res == -ENOBUFS || res == -EFAULT)) {
+    client_zerocopy_failed(client, -res);
+    res = 0; // sent again with copies
+  } else if (zc && res > 0) {
+    client_zerocopy_sent(client);
+  }
+  if (res < 0 && res != -EAGAIN && res != -EINTR) {
+    printf("tx fd=%d error %s\n", client->fd, strerror(-res));
+    fflush(stdout);
+    return -1;
+  }
+  if (res > 0) {
+    client->tx_pos += res;
+    client->written += res;
+    metrics_add(bytes_sent, res);
+  }
+  if (client->tx_pos == client->tx_frame->size)
+    client_frame_sent(client);
+  return client_tx(client);
+}
+
+#define ewma(avg, sample)                                                      \
+  ((avg) == 0 ? (sample) : (avg) + ((sample) - (avg)) / 8)
+
+// decides if the frame is sent: the decimation grows to what the client
+// drains while it is backlogged and shrinks again after a clean period
+static int client_pace(client_t *c, frame_t *frame) {
+  if (frame->timestamp == 0)
+    return 1; // static messages are always sent
+
+  // still sending the previous frame or more than a frame waiting in the
+  // socket buffer: the client does not keep up
+  int outq = 0;
+  metrics_add(syscalls, 1);
+  ioctl(c->fd, SIOCOUTQ, &outq);
+  int backlogged = c->tx_frame != NULL || outq > (int)c->frame_size;
+  if (c->last_ts != 0 && frame->timestamp > c->last_ts) {
+    int64_t dt = frame->timestamp - c->last_ts;
+    int64_t drained = (int64_t)c->written + c->outq - outq;
+    c->interval = ewma((int64_t)c->interval, dt);
+    if (backlogged && drained > 0)
+      c->rate = ewma((int64_t)c->rate, drained * 1000000 / dt);
+    c->written = 0;
+  }
+  c->outq = outq;
+  c->last_ts = frame->timestamp;
+  c->frame_size = ewma((int64_t)c->frame_size, (int64_t)frame->size);
+
+  uint32_t decimation = c->decimation;
+  if (backlogged && c->rate > 0 && c->interval > 0) {
+    // frames the client can take per frame interval, rounded up
+    uint64_t per_interval = c->rate * c->interval / 1000000;
+    uint64_t needed =
+        per_interval == 0
+            ? ADAPTIVE_MAX_DECIMATION
+            : (c->frame_size + per_interval - 1) / per_interval;
+    if (needed > decimation)
+      decimation = needed;
+    c->clean = 0;
+  } else if (++c->clean >= ADAPTIVE_PROBE_FRAMES) {
+    if (decimation > 1)
+      --decimation;
+    c->clean = 0;
+  }
+
+  if (decimation > ADAPTIVE_MAX_DECIMATION)
+    decimation = ADAPTIVE_MAX_DECIMATION;
+
+  if (decimation != c->decimation) {
+    printf("client %s %d -> send 1 frame out of %u\n", c->hostname, c->port,
+           decimation);
+    fflush(stdout);
+    c->decimation = decimation;
+  }
+
+  // explicit cap asked by the client with ?fps=N
+  if (c->fps_cap > 0 && c->interval > 0) {
+    // rounded up with 5% tolerance for the jitter of the average interval
+    uint64_t percent = 100000000ULL / ((uint64_t)c->fps_cap * c->interval);
+    uint32_t min = (percent + 95) / 100;
+    if (decimation < min)
+      decimation = min;
+  }
+
+  // evenly spaced frames
+  if (c->countdown > 0) {
+    --c->countdown;
+    return 0;
+  }
+  c->countdown = decimation - 1;
+  return 1;
+}
+
+// budget of the client, then of the server: a frame is taken only if both
+// have room, the one over budget is skipped instead of queued. Charged once
+// the tx queue has room for the frame
+static int client_shape(client_t *c, frame_t *frame) {
+  if (!client_shaped(c, frame))
+    return 1;
+  uint64_t now = metrics_usec();
+  if (!shaper_ready(&c->shaper, now) ||
+      (c->egress != NULL && !shaper_admit(c->egress, now, frame->size))) {
+    metrics_add(dropped[DROP_SHAPED], 1);
+    metrics_add(bytes_shaped_dropped, frame->size);
+    return 0;
+  }
+  shaper_charge(&c->shaper, now, frame->size);
+  return 1;
+}
 
-  if (tx_queue_size || client->total_to_sent) {
-    if (tx_queue_size > TX_QUEUE_MAX || allocated == NULL) {
+// a frame taken under the budgets is replaced before it is sent
+static void client_unshape(client_t *c, frame_t *frame) {
+  if (!client_shaped(c, frame))
+    return;
+  shaper_refund(&c->shaper, frame->size);
+  if (c->egress != NULL)
+    shaper_refund(c->egress, frame->size);
+  metrics_add(bytes_shaped_dropped, frame->size);
+}
+
+// latency mode: at most about a frame waits in the socket, set from the
+// average frame size and again when it changes by more than a quarter
+static void client_size_socket(client_t *c) {
+  uint32_t lowat = c->frame_size / LATENCY_LOWAT_DIV;
+  if (lowat == 0 || (c->lowat != 0 && lowat < c->lowat + c->lowat / 4 &&
+                     lowat > c->lowat - c->lowat / 4))
+    return;
+  int sndbuf = c->frame_size * LATENCY_SNDBUF_FRAMES;
+  metrics_add(syscalls, 2);
+  if (setsockopt(c->fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat,
+                 sizeof(lowat)) < 0 ||
+      setsockopt(c->fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf)) < 0) {
+    printf("client %s %d: latency mode off, %s\n", c->hostname, c->port,
+           strerror(errno));
+    fflush(stdout);
+    c->latency = 0;
+    c->lowat = 0;
+    client_want_out(c, 1);
+    return;
+  }
+  c->lowat = lowat;
+}
+
+void client_enqueue_frame(client_t *client, frame_t *frame) {
+  if (!client_pace(client, frame)) {
+    metrics_add(dropped[DROP_DECIMATION], 1);
+    return;
+  }
+  // latency mode (TX_LATEST too): frames wait for the socket to drain
+  int hold = client->latency && frame->timestamp != 0;
+  if (hold)
+    client_size_socket(client);
+
+  if ((client->tx_frame != NULL || hold) && client->policy == TX_LATEST) {
+    if (!client_shape(client, frame))
+      return;
+    // the frame waiting is stale now and its charge is given back
+    if (client->tx_latest != NULL) {
+      client_unshape(client, client->tx_latest);
+      frame_unref(client->tx_latest);
+      ++client->skipped;
+      metrics_add(dropped[DROP_LATEST], 1);
+    }
+    metrics_add(tx_queue_depth[client->tx_latest != NULL], 1);
+    client->tx_latest = frame_ref(frame);
+  } else if (client->tx_frame != NULL) {
+    int tx_queue_size = tx_ring_depth(&client->tx_queue);
+    int full = tx_queue_size > client->tx_queue_max ||
+               tx_queue_size == TX_RING_SIZE;
+    if (!full && !client_shape(client, frame))
+      return;
+    metrics_add(tx_queue_depth[tx_queue_size], 1);
+    if (full) {
+      ++client->skipped;
+      metrics_add(dropped[DROP_TX_QUEUE], 1);
       printf("tx queue %s %d-> drop message because current size %d\n",
              client->hostname, client->port, tx_queue_size);
       fflush(stdout);
       return;
     }
-    // printf("place message into queue\n");
-    message_t *msg = malloc(sizeof(message_t));
-    if (*allocated == NULL) {
-      *allocated = malloc(size + 1);
-      *(*allocated + size) = 0x02;
-      memcpy(*allocated, payload, size);
-    } else {
-      ++*(*allocated + size);
-    }
-    msg->payload = *allocated;
-    msg->size = size;
-    init_list_entry(&msg->node);
-    list_add_right(&msg->node, &client->tx_queue);
-    client_tx(client);
+    // oldest frame is sent first
+    tx_ring_push(&client->tx_queue, frame_ref(frame));
   } else {
-    int pos, sent = 0;
-    while ((pos = write(client->fd, payload + sent, size - sent)) > 0)
-      sent += pos;
-
-    if (sent < size) {
-      //	printf("place remaining bytes %d of %d into buffer tx\n", size -
-      // sent, size);
-      memcpy(client->txbuf + sent, payload + sent, size - sent);
-      client->total_to_sent = size;
-      client->txbuf_pos = sent;
-    }
+    if (!client_shape(client, frame))
+      return;
+    metrics_add(tx_queue_depth[0], 1);
+    client_start_frame(client, frame_ref(frame));
   }
+  client_tx(client);
 }
@@ -26,45 +26,108 @@
 #ifndef CLIENT_H
 #define CLIENT_H
 
+#include <netinet/in.h>
 #include <stdint.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 
 #include "constants.h"
+#include "frame.h"
 #include "list.h"
+#include "shaper.h"
+#include "txring.h"
+
+/* what to do with new frames while the client is still sending */
+enum tx_policy {
+  TX_QUEUE,  /* queue up to tx_queue_max frames, drop newer ones */
+  TX_LATEST, /* keep only the freshest frame, skip older ones */
+};
 
 typedef struct {
 
-  /* client data */
-  char *hostname;
-  int port;
+  /* frequently used data first */
   int fd;
+  int is_auth;
+  int closing;       /* disconnect once the response is sent */
+  int keep_alive;    /* last request asked for a persistent connection */
+  uint64_t deadline; /* snapshot or idle timeout, CLOCK_MONOTONIC usec */
+  int camera;        /* subscribed camera, -1 if none */
 
-  /* tx buffer */
-  uint8_t txbuf[MAX_FRAME_SIZE];
-  uint32_t txbuf_pos;
-  uint32_t total_to_sent;
+  /* latency mode: the next frame is taken once the socket has drained */
+  int latency;
+  int epfd;       /* EPOLLOUT armed only while there is something to send */
+  int out_armed;
+  uint32_t lowat; /* TCP_NOTSENT_LOWAT set, 0: not yet */
 
-  /* rx buffer */
-  uint8_t rxbuf[1000];
-  int rxbuf_pos;
+  /* frame being sent */
+  frame_t *tx_frame;
+  uint32_t tx_pos;
+  uint64_t tx_start; /* first byte of tx_frame sent, CLOCK_MONOTONIC usec */
 
-  /* tx queue */
-  struct dlist tx_queue;
+  /* io_uring backend: one send in flight, completed by client_tx_complete */
+  struct uring *uring; /* NULL: sent with writev */
+  void *uring_tag;     /* user data of the completion and epoll events */
+  int inflight;
+  struct msghdr msg;
+  struct iovec iov[FRAME_SEGMENTS];
 
-  int is_auth;
-  int start_token, end_token;
+  /* MSG_ZEROCOPY: frames stay referenced until the kernel notifies */
+  uint32_t zerocopy;       /* from this frame size, 0: always copied */
+  int zc_copy;             /* ENOBUFS: the rest of tx_frame is copied */
+  uint32_t zc_seq;         /* id of the next zero copy send */
+  struct dlist zc_pending; /* message_t, oldest send first */
+
+  /* tx queue (TX_QUEUE) or freshest frame (TX_LATEST) */
+  struct tx_ring tx_queue;
+  frame_t *tx_latest;
+  enum tx_policy policy;
+  int tx_queue_max;
+  uint32_t skipped;
+
+  /* adaptive frame rate: one frame out of decimation is sent */
+  uint16_t decimation;
+  uint16_t countdown;
+  uint16_t fps_cap;
+  uint16_t clean;
+  uint32_t interval;   /* average usec between frames */
+  uint32_t frame_size; /* average frame size */
+  uint64_t rate;       /* bytes per second drained while backlogged */
+  uint64_t last_ts;
+  uint32_t written; /* bytes written since the last frame */
+  int outq;         /* bytes in the socket queue at the last frame */
+
+  /* bandwidth budgets: frames over them are skipped whole */
+  shaper_t shaper;  /* of the client, rate 0: unlimited */
+  shaper_t *egress; /* of the server, shared by the workers, NULL: none */
+
+  /* rx buffer, taken from a pool only while the request is parsed */
+  uint8_t *rxbuf;
+  uint16_t rxbuf_size;
+  uint16_t rxbuf_pos;
+  uint16_t request_len; /* parsed request, pipelined ones follow */
+  uint16_t start_path, end_path;
+  uint16_t start_token, end_token;
+
+  /* client data */
+  int port;
+  char hostname[INET_ADDRSTRLEN];
 } client_t;
 
+/* frame kept until its zero copy sends are done (zc_pending) */
 typedef struct {
   struct dlist node;
-  uint8_t *payload;
-  int size;
+  frame_t *frame;
+  uint32_t seq; /* last zero copy send of the frame */
 } message_t;
 
 client_t *client_init(char *hostname, int port, int fd);
 void client_free(client_t *client);
+void client_release_pools();
 int client_parse_request(client_t *client);
+void client_release_request(client_t *client);
 int client_tx(client_t *client);
-void client_enqueue_frame(client_t *client, uint8_t *payload, int size,
-                          uint8_t **allocated);
+int client_tx_complete(client_t *client, int res);
+int client_zerocopy_complete(client_t *client);
+void client_enqueue_frame(client_t *client, frame_t *frame);
 
 #endif
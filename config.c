@@ -0,0 +1,187 @@
+/**
+ *  mjpeg2http
+ *
+ *  Copyright (c) 2022 Antonino Nolano. Licensed under the MIT license, as
+ * follows:
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "constants.h"
+#include "libmjpeg2http.h"
+
+void libmjpeg2http_defaultConfig(libmjpeg2http_config_t *config) {
+  memset(config, 0, sizeof(libmjpeg2http_config_t));
+  config->width = WIDTH;
+  config->height = HEIGHT;
+  config->fps = FRAME_PER_SECOND;
+  config->tx_queue_max = TX_QUEUE_MAX;
+  config->listen_backlog = SERVER_LISTEN_BACKLOG;
+  config->workers = 1;
+  config->policy = MJPEG2HTTP_POLICY_QUEUE;
+  config->backend = MJPEG2HTTP_BACKEND_EPOLL;
+  config->rtp_ttl = RTP_TTL;
+  config->shm_slots = SHM_SLOTS;
+  config->shm_slot_size = SHM_SLOT_SIZE;
+}
+
+// whole string is a number not below min
+static int parse_int(const char *value, int min, int *out) {
+  char *end;
+  errno = 0;
+  long n = strtol(value, &end, 10);
+  if (errno != 0 || end == value || *end != 0 || n < min || n > INT32_MAX)
+    return -1;
+  *out = n;
+  return 1;
+}
+
+// comma separated, at most MJPEG2HTTP_MAX_CPUS of them
+static int parse_cpus(libmjpeg2http_config_t *config, const char *value) {
+  char list[256], *save, *cpu;
+  if (strlen(value) >= sizeof(list))
+    return -1;
+  snprintf(list, sizeof(list), "%s", value);
+  config->ncpus = 0;
+  for (cpu = strtok_r(list, ",", &save); cpu != NULL;
+       cpu = strtok_r(NULL, ",", &save)) {
+    if (config->ncpus == MJPEG2HTTP_MAX_CPUS ||
+        parse_int(cpu, 0, &config->cpus[config->ncpus]) < 0)
+      return -1;
+    config->ncpus++;
+  }
+  return 1;
+}
+
+int libmjpeg2http_setConfig(libmjpeg2http_config_t *config, const char *key,
+                            const char *value) {
+  static const struct {
+    const char *key;
+    size_t offset;
+    int min;
+  } ints[] = {
+      {"width", offsetof(libmjpeg2http_config_t, width), 1},
+      {"height", offsetof(libmjpeg2http_config_t, height), 1},
+      {"fps", offsetof(libmjpeg2http_config_t, fps), 1},
+      {"max_frame_size", offsetof(libmjpeg2http_config_t, max_frame_size), 0},
+      {"tx_queue_max", offsetof(libmjpeg2http_config_t, tx_queue_max), 0},
+      {"listen_backlog", offsetof(libmjpeg2http_config_t, listen_backlog), 1},
+      {"max_clients", offsetof(libmjpeg2http_config_t, max_clients), 0},
+      {"workers", offsetof(libmjpeg2http_config_t, workers), 1},
+      {"zerocopy", offsetof(libmjpeg2http_config_t, zerocopy), 0},
+      {"rtp_camera", offsetof(libmjpeg2http_config_t, rtp_camera), 0},
+      {"rtp_ttl", offsetof(libmjpeg2http_config_t, rtp_ttl), 0},
+      {"rtp_rate", offsetof(libmjpeg2http_config_t, rtp_rate), 0},
+      {"shm_camera", offsetof(libmjpeg2http_config_t, shm_camera), 0},
+      {"shm_slots", offsetof(libmjpeg2http_config_t, shm_slots), 2},
+      {"shm_slot_size", offsetof(libmjpeg2http_config_t, shm_slot_size), 1},
+      {"client_rate", offsetof(libmjpeg2http_config_t, client_rate), 0},
+      {"egress_rate", offsetof(libmjpeg2http_config_t, egress_rate), 0},
+      {"latency", offsetof(libmjpeg2http_config_t, latency), 0},
+  };
+
+  for (size_t i = 0; i < sizeof(ints) / sizeof(ints[0]); ++i) {
+    if (strcmp(key, ints[i].key) == 0)
+      return parse_int(value, ints[i].min,
+                       (int *)((char *)config + ints[i].offset));
+  }
+
+  if (strcmp(key, "cpus") == 0)
+    return parse_cpus(config, value);
+  if (strcmp(key, "policy") == 0 && strcmp(value, "queue") == 0)
+    config->policy = MJPEG2HTTP_POLICY_QUEUE;
+  else if (strcmp(key, "policy") == 0 && strcmp(value, "latest") == 0)
+    config->policy = MJPEG2HTTP_POLICY_LATEST;
+  else if (strcmp(key, "backend") == 0 && strcmp(value, "epoll") == 0)
+    config->backend = MJPEG2HTTP_BACKEND_EPOLL;
+  else if (strcmp(key, "backend") == 0 && strcmp(value, "io_uring") == 0)
+    config->backend = MJPEG2HTTP_BACKEND_URING;
+  else if (strcmp(key, "metrics_token") == 0 &&
+           strlen(value) < sizeof(config->metrics_token))
+    snprintf(config->metrics_token, sizeof(config->metrics_token), "%s",
+             value);
+  else if (strcmp(key, "rtp") == 0 && strlen(value) < sizeof(config->rtp))
+    snprintf(config->rtp, sizeof(config->rtp), "%s", value);
+  else if (strcmp(key, "shm") == 0 && strlen(value) < sizeof(config->shm))
+    snprintf(config->shm, sizeof(config->shm), "%s", value);
+  else if (strcmp(key, "rtp_interface") == 0 &&
+           strlen(value) < sizeof(config->rtp_interface))
+    snprintf(config->rtp_interface, sizeof(config->rtp_interface), "%s",
+             value);
+  else
+    return -1;
+  return 1;
+}
+
+// blanks around the string are cut off
+static char *trim(char *s) {
+  s += strspn(s, " \t");
+  char *end = s + strlen(s);
+  while (end > s && strchr(" \t\r\n", end[-1]) != NULL)
+    *--end = 0;
+  return s;
+}
+
+int libmjpeg2http_loadConfig(libmjpeg2http_config_t *config,
+                             const char *path) {
+  FILE *file = fopen(path, "r");
+  if (file == NULL) {
+    perror(path);
+    return -1;
+  }
+
+  // the settings are applied only if the whole file is valid
+  libmjpeg2http_config_t loaded = *config;
+  char line[512];
+  int n = 0, ret = 1;
+  while (fgets(line, sizeof(line), file) != NULL) {
+    ++n;
+    char *hash = strchr(line, '#');
+    if (hash != NULL)
+      *hash = 0;
+    char *key = trim(line);
+    if (*key == 0)
+      continue;
+    char *eq = strchr(key, '=');
+    if (eq != NULL)
+      *eq = 0;
+    if (eq == NULL || libmjpeg2http_setConfig(&loaded, trim(key),
+                                              trim(eq + 1)) < 0) {
+      printf("%s:%d: invalid setting %s\n", path, n, key);
+      fflush(stdout);
+      ret = -1;
+      break;
+    }
+  }
+  if (ret > 0 && ferror(file)) {
+    perror(path);
+    ret = -1;
+  }
+  fclose(file);
+  if (ret > 0)
+    *config = loaded;
+  return ret;
+}
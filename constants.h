@@ -26,14 +26,53 @@
 #ifndef CONSTANTS_H
 #define CONSTANTS_H
 
-#define MAX_FRAME_SIZE 200000
-#define MAX_FILE_DESCRIPTORS 32
+// defaults of libmjpeg2http_config_t
 #define WIDTH 640
 #define HEIGHT 480
 #define FRAME_PER_SECOND 30
-#define TOKEN_SIZE 20
-#define NUMBER_OF_TOKEN 20
 #define TX_QUEUE_MAX 5
+#define TX_RING_SIZE 8 /* power of two, tx_queue_max is at most one less */
 #define SERVER_LISTEN_BACKLOG 10
 
+#define EPOLL_BATCH 64
+#define MAX_WORKERS 64
+#define RESERVED_FILE_DESCRIPTORS 16
+#define TOKEN_SIZE 20
+#define NUMBER_OF_TOKEN 20
+#define VIDEO_MIN_QUEUED 2
+#define ADAPTIVE_PROBE_FRAMES 30
+#define ADAPTIVE_MAX_DECIMATION 60
+#define SHAPER_BURST_MS 100
+#define LATENCY_LOWAT_DIV 2     /* TCP_NOTSENT_LOWAT: half a frame */
+#define LATENCY_SNDBUF_FRAMES 2 /* SO_SNDBUF, doubled by the kernel */
+#define RXBUF_SMALL 256
+#define RXBUF_LARGE 1024
+#define RXBUF_PER_SLAB 16
+#define METRICS_BUFFER_SIZE 16384
+#define SNAPSHOT_MAX_AGE_MS 1000
+#define SNAPSHOT_TIMEOUT_MS 2000
+#define IDLE_TIMEOUT_MS 10000
+#define URING_ENTRIES 256
+#define URING_CQ_ENTRIES 4096
+#define MAX_CAMERAS 8
+#define CAMERA_PATH_SIZE 64
+#define RELAY_BUFFERS 4
+#define RELAY_BUFFER_SIZE 262144
+#define RELAY_READ_SIZE 65536
+#define RELAY_MAX_FRAME_SIZE (16 << 20)
+#define RELAY_MAX_HEADERS 8192
+#define RELAY_BACKOFF_MIN_MS 250
+#define RELAY_BACKOFF_MAX_MS 8000
+#define RELAY_STALL_MS 5000
+#define RTP_PACKET_SIZE 1400
+#define RTP_BURST 16
+#define RTP_PACE_MAX_MS 100
+#define RTP_TTL 1
+#define SHM_SLOTS 8
+#define SHM_SLOT_SIZE (1 << 20)
+#define SHM_MAX_CONSUMERS 16
+#define PUSH_BUFFERS 4
+#define PUSH_MAX_FRAME_SIZE (16 << 20)
+#define APP_BUFFERS 4
+
 #endif
@@ -94,8 +94,9 @@ int main(int argc, char **argv) {
 
   strcpy(g_path, argv[2]);
 
-  struct epoll_event events[MAX_FILE_DESCRIPTORS];
-  int video_fd = video_init(argv[1], WIDTH, HEIGHT, FRAME_PER_SECOND);
+  struct epoll_event events[EPOLL_BATCH];
+  video_t device;
+  int video_fd = video_init(&device, argv[1], WIDTH, HEIGHT, FRAME_PER_SECOND);
   struct observed video, *ov;
   video.data.fd = video_fd;
   video.t = VIDEO;
@@ -105,7 +106,7 @@ int main(int argc, char **argv) {
 
   for (;;) {
 
-    nfds = epoll_wait(epfd, events, MAX_FILE_DESCRIPTORS, -1);
+    nfds = epoll_wait(epfd, events, EPOLL_BATCH, -1);
     if (nfds == -1) {
       perror("epoll_wait");
       exit(EXIT_FAILURE);
@@ -119,7 +120,7 @@ int main(int argc, char **argv) {
           perror("error on video");
           exit(EXIT_FAILURE);
         }
-        video_read_jpeg(dump_frame, MAX_FRAME_SIZE);
+        video_read_jpeg(&device, dump_frame, 0);
         break;
       }
     }
@@ -0,0 +1,125 @@
+/**
+ *  mjpeg2http
+ *
+ *  Copyright (c) 2022 Antonino Nolano. Licensed under the MIT license, as
+ * follows:
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "frame.h"
+
+static void frame_free(frame_t *frame) { free(frame); }
+
+static void frame_setup(frame_t *f, const char *header, int header_len,
+                        uint8_t *payload, uint32_t len, const char *trailer,
+                        int trailer_len) {
+  memcpy(f->header, header, header_len);
+  f->iov[0].iov_base = f->header;
+  f->iov[0].iov_len = header_len;
+  f->iov[1].iov_base = payload;
+  f->iov[1].iov_len = len;
+  f->iov[2].iov_base = (void *)trailer;
+  f->iov[2].iov_len = trailer_len;
+  f->iovcnt = 3;
+  f->size = header_len + len + trailer_len;
+  f->refcount = 1;
+  f->timestamp = f->prepared = 0;
+  f->sequence = 0;
+  f->camera = 0;
+  f->owner = NULL;
+}
+
+frame_t *frame_create(const char *header, int header_len,
+                      const uint8_t *payload, uint32_t len,
+                      const char *trailer, int trailer_len) {
+  if (header_len > FRAME_HEADER_SIZE)
+    return NULL;
+
+  // header and payload share the same allocation, trailer must be static
+  frame_t *f = malloc(sizeof(frame_t) + len);
+  if (f == NULL)
+    return NULL;
+
+  uint8_t *data = (uint8_t *)(f + 1);
+  memcpy(data, payload, len);
+  frame_setup(f, header, header_len, data, len, trailer, trailer_len);
+  f->release = frame_free;
+  f->priv = NULL;
+  return f;
+}
+
+frame_t *frame_wrap(const char *header, int header_len, uint8_t *payload,
+                    uint32_t len, const char *trailer, int trailer_len,
+                    void (*release)(frame_t *), void *priv) {
+  if (header_len > FRAME_HEADER_SIZE)
+    return NULL;
+
+  frame_t *f = malloc(sizeof(frame_t));
+  if (f == NULL)
+    return NULL;
+
+  frame_setup(f, header, header_len, payload, len, trailer, trailer_len);
+  f->release = release;
+  f->priv = priv;
+  return f;
+}
+
+void frame_init_static(frame_t *f, const char *message, int len) {
+  f->iov[0].iov_base = (void *)message;
+  f->iov[0].iov_len = len;
+  f->iovcnt = 1;
+  f->size = len;
+  f->refcount = 1;
+  f->release = NULL;
+  f->priv = f->owner = NULL;
+  f->timestamp = f->prepared = 0;
+  f->sequence = 0;
+  f->camera = 0;
+}
+
+int frame_iov(frame_t *f, uint32_t offset, struct iovec *iov) {
+  // segments still to be sent starting from offset
+  int n = 0;
+  for (int i = 0; i < f->iovcnt; ++i) {
+    if (offset >= f->iov[i].iov_len) {
+      offset -= f->iov[i].iov_len;
+      continue;
+    }
+    iov[n].iov_base = (uint8_t *)f->iov[i].iov_base + offset;
+    iov[n].iov_len = f->iov[i].iov_len - offset;
+    offset = 0;
+    ++n;
+  }
+  return n;
+}
+
+frame_t *frame_ref(frame_t *f) {
+  __atomic_add_fetch(&f->refcount, 1, __ATOMIC_RELAXED);
+  return f;
+}
+
+void frame_unref(frame_t *f) {
+  if (__atomic_sub_fetch(&f->refcount, 1, __ATOMIC_ACQ_REL) == 0 &&
+      f->release != NULL)
+    f->release(f);
+}
@@ -0,0 +1,69 @@
+/**
+ *  mjpeg2http
+ *
+ *  Copyright (c) 2022 Antonino Nolano. Licensed under the MIT license, as
+ * follows:
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+#define FRAME_HEADER_SIZE 256
+#define FRAME_SEGMENTS 3
+
+/*
+ * immutable frame shared by all clients: header, jpeg payload and trailer
+ * are kept as separate segments so that they can be sent with writev.
+ * The frame is released when the last reference is dropped, the counter is
+ * atomic so references may be taken and dropped from any thread.
+ */
+typedef struct frame {
+  uint32_t refcount;
+  uint32_t size;
+  int iovcnt;
+  struct iovec iov[FRAME_SEGMENTS];
+  void (*release)(struct frame *);
+  void *priv;  /* owner data, e.g. the capture buffer of a wrapped frame */
+  void *owner; /* e.g. the camera of that buffer */
+  uint64_t timestamp; /* capture, CLOCK_MONOTONIC usec, 0 for static messages */
+  uint64_t prepared;  /* published to the workers, CLOCK_MONOTONIC usec */
+  uint32_t sequence;
+  int camera; /* index of the source that captured the frame */
+  char header[FRAME_HEADER_SIZE];
+} frame_t;
+
+frame_t *frame_create(const char *header, int header_len,
+                      const uint8_t *payload, uint32_t len,
+                      const char *trailer, int trailer_len);
+// payload is not copied: release is called once the last reference is
+// dropped and must free the frame
+frame_t *frame_wrap(const char *header, int header_len, uint8_t *payload,
+                    uint32_t len, const char *trailer, int trailer_len,
+                    void (*release)(frame_t *), void *priv);
+void frame_init_static(frame_t *frame, const char *message, int len);
+int frame_iov(frame_t *frame, uint32_t offset, struct iovec *iov);
+frame_t *frame_ref(frame_t *frame);
+void frame_unref(frame_t *frame);
+
+#endif
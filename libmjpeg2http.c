@@ -25,167 +25,274 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/epoll.h>
 #include <sys/eventfd.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "client.h"
 #include "constants.h"
+#include "frame.h"
+#include "metrics.h"
 #include "libmjpeg2http.h"
-#include "list.h"
 #include "protocol.h"
-#include "server.h"
-#include "video.h"
+#include "ring.h"
+#include "rtp.h"
+#include "shaper.h"
+#include "shmring.h"
+#include "source.h"
+#include "worker.h"
 
-enum type { SERVER, CLIENT, VIDEO, TOKEN, EXITFD };
+enum type { VIDEO, TOKEN, CONTROL, EXITFD };
 
 union observed_data {
-  client_t *client;
   int fd;
+  struct camera *camera;
 };
 
 struct observed {
-  struct dlist node;
   enum type t;
   union observed_data data;
 };
 
-static char g_frame_complete[MAX_FRAME_SIZE];
-static int g_numClients;
-static const int g_maxClients = MAX_FILE_DESCRIPTORS - 2;
-static char g_token[NUMBER_OF_TOKEN * (TOKEN_SIZE + 1)];
-static int g_token_pos = -1;
-static int g_videoOn = 0;
-static int g_frame_complete_len;
-static int g_token_len;
-static int g_epfd;
-static int g_pipe_fd = -1;
-static struct observed g_pipe;
-static int g_runs = 0;
-static int g_exitfd = -1;
-
-static void cleanAll() {
-  g_numClients = 0;
-  g_token_pos = -1;
-  g_videoOn = 0;
-  g_pipe_fd = -1;
-  g_exitfd = -1;
-}
-
-static int enable_video(struct observed *video) {
+/* capture device and the number of clients subscribed to it */
+struct camera {
+  int id;
+  char path[CAMERA_PATH_SIZE];
+  source_t source;
+  struct observed video;
+  int subscribers;
+  int videoOn;
+  mjpeg2http_server_t *server;
+};
+
+/* one server: its cameras, capture loop, workers and outputs */
+struct mjpeg2http_server {
+  metrics_set_t metrics;
+  shaper_t egress __attribute__((aligned(64))); /* taken by every worker */
+  libmjpeg2http_config_t config;
+  struct camera cameras[MAX_CAMERAS];
+  int numCameras;
+  ring_t ring;
+  worker_t workers[MAX_WORKERS];
+  rtp_t rtp;
+  shmring_t shm;
+  int numClients;
+  int maxClients;
+  char token[NUMBER_OF_TOKEN * (TOKEN_SIZE + 1)];
+  pthread_mutex_t token_lock;
+  int token_pos;
+  char *ipaddress;
+  int port;
+  char *auth;
+  int token_len;
+  int epfd;
+  int pipe_fd;
+  struct observed pipe;
+  struct observed exit;
+  struct observed control;
+  int exitfd;
+  int controlfd;
+  int runs;
+};
+
+static libmjpeg2http_config_t g_settings; /* changed by the setters */
+static int g_settingsReady = 0;
+static mjpeg2http_server_t *g_server; /* of libmjpeg2http_loop */
+
+static int enable_video(struct camera *camera) {
   struct epoll_event ev;
   ev.events = EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP;
-  ev.data.ptr = video;
-  if (epoll_ctl(g_epfd, EPOLL_CTL_ADD, video->data.fd, &ev) == -1) {
+  ev.data.ptr = &camera->video;
+  if (epoll_ctl(camera->server->epfd, EPOLL_CTL_ADD, camera->source.fd,
+                &ev) == -1) {
     perror("epoll_ctl: enable video");
     return -1;
   }
   return 1;
 }
 
-static int disable_video(struct observed *video) {
-  if (epoll_ctl(g_epfd, EPOLL_CTL_DEL, video->data.fd, NULL) == -1) {
+static int disable_video(struct camera *camera) {
+  if (epoll_ctl(camera->server->epfd, EPOLL_CTL_DEL, camera->source.fd,
+                NULL) == -1) {
     perror("epoll_ctl: disable video");
     return -1;
   }
   return 1;
 }
 
-static int add_clients(int server_fd, struct dlist *clients,
-                       struct observed *video) {
-  int ret;
-  struct remotepeer peer;
-  struct epoll_event ev;
-  do {
-    ret = server_new_peer(server_fd, &peer);
-    if (ret == 0)
-      break; // no more connections to accept
-    else if (ret == -1) {
-      perror("server_new_peer error");
-      return -1;
-    }
+static void notify_control(mjpeg2http_server_t *s) {
+  uint64_t beep = 1;
+  if (write(s->controlfd, &beep, sizeof(uint64_t)) < 0)
+    perror("notify control");
+}
 
-    if (g_numClients <= g_maxClients - 1) {
-      struct observed *oc = malloc(sizeof(struct observed));
-      oc->data.client = client_init(peer.hostname, peer.port, peer.fd);
-      oc->t = CLIENT;
-      list_add_right(&oc->node, clients);
-      ev.events =
-          EPOLLIN | EPOLLOUT | EPOLLET | EPOLLRDHUP | EPOLLERR | EPOLLHUP;
-      ev.data.ptr = oc;
-      if (epoll_ctl(g_epfd, EPOLL_CTL_ADD, peer.fd, &ev) == -1) {
-        perror("epoll_ctl: add clients");
-        return -1;
-      }
-      ++g_numClients;
-    } else {
-      printf("reject new connection => increase MAX_FILE_DESCRIPTORS\n");
-      fflush(stdout);
-      close(peer.fd);
-    }
-  } while (ret > 0);
-  if (g_numClients > 0 && g_videoOn == 0) {
-    printf("turn on video because clients=%d\n", g_numClients);
-    fflush(stdout);
-    g_videoOn = 1;
-    return enable_video(video);
+// called by workers
+static int client_join(void *ctx) {
+  mjpeg2http_server_t *s = ctx;
+  int n = __atomic_add_fetch(&s->numClients, 1, __ATOMIC_ACQ_REL);
+  if (n > s->maxClients) {
+    __atomic_sub_fetch(&s->numClients, 1, __ATOMIC_ACQ_REL);
+    return 0;
   }
   return 1;
 }
 
-static int remove_client(struct observed *oc, struct observed *video) {
-  printf("remove client %s %d fd=%d\n", oc->data.client->hostname,
-         oc->data.client->port, oc->data.client->fd);
-  fflush(stdout);
-  if (epoll_ctl(g_epfd, EPOLL_CTL_DEL, oc->data.client->fd, NULL) == -1) {
-    perror("epoll_ctl: remove clients");
-    return -1;
+static void client_leave(void *ctx) {
+  mjpeg2http_server_t *s = ctx;
+  __atomic_sub_fetch(&s->numClients, 1, __ATOMIC_ACQ_REL);
+}
+
+// called by workers, the capture thread is woken up on 0 <-> 1 transitions
+static void camera_join(void *ctx, int camera) {
+  mjpeg2http_server_t *s = ctx;
+  if (__atomic_add_fetch(&s->cameras[camera].subscribers, 1,
+                         __ATOMIC_ACQ_REL) == 1)
+    notify_control(s);
+}
+
+static void camera_leave(void *ctx, int camera) {
+  mjpeg2http_server_t *s = ctx;
+  if (__atomic_sub_fetch(&s->cameras[camera].subscribers, 1,
+                         __ATOMIC_ACQ_REL) == 0)
+    notify_control(s);
+}
+
+// with a single camera every path leads to it, "" is the first camera
+static int find_camera(void *ctx, uint8_t *path, int count) {
+  mjpeg2http_server_t *s = ctx;
+  if (s->numCameras == 1 || count == 0 || (count == 1 && path[0] == '/'))
+    return 0;
+  for (int i = 0; i < s->numCameras; ++i) {
+    if (strlen(s->cameras[i].path) == (size_t)count &&
+        memcmp(s->cameras[i].path, path, count) == 0)
+      return i;
   }
-  client_free(oc->data.client);
-  list_del(&oc->node);
-  free(oc);
-  if (--g_numClients == 0 && g_videoOn == 1) {
-    printf("turn off video because clients=%d\n", g_numClients);
+  return -1;
+}
+
+static int switch_video(struct camera *c, int clients) {
+  if (clients > 0 && c->videoOn == 0) {
+    printf("turn on video %s because clients=%d\n", c->path, clients);
     fflush(stdout);
-    g_videoOn = 0;
-    return disable_video(video);
+    c->videoOn = 1;
+    if (source_stream(&c->source, 1) < 0 || enable_video(c) < 0)
+      return -1;
+  } else if (clients == 0 && c->videoOn == 1) {
+    printf("turn off video %s because clients=%d\n", c->path, clients);
+    fflush(stdout);
+    c->videoOn = 0;
+    if (disable_video(c) < 0 || source_stream(&c->source, 0) < 0)
+      return -1;
+  }
+  return 1;
+}
+
+static int handle_control(mjpeg2http_server_t *s, int fd) {
+  uint64_t beep;
+  if (read(fd, &beep, sizeof(uint64_t)) < 0 && errno != EAGAIN)
+    return -1;
+
+  for (int i = 0; i < s->numCameras; ++i) {
+    struct camera *c = &s->cameras[i];
+    if (switch_video(c, __atomic_load_n(&c->subscribers, __ATOMIC_ACQUIRE)) <
+        0)
+      return -1;
   }
   return 1;
 }
 
-static void prepare_frame(uint8_t *jpeg_image, uint32_t len) {
-  struct timeval timestamp;
-  gettimeofday(&timestamp, NULL);
-  int total = snprintf(g_frame_complete, MAX_FRAME_SIZE, frame_header, len,
-                       (int)timestamp.tv_sec, (int)timestamp.tv_usec);
-  memcpy(g_frame_complete + total, jpeg_image, len);
-  memcpy(g_frame_complete + total + len, end_frame, end_frame_len);
-  g_frame_complete_len = total + len + end_frame_len;
+static uint64_t monotonic_usec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
-static int handle_new_frame(struct dlist *clients) {
-  int n = video_read_jpeg(prepare_frame, MAX_FRAME_SIZE);
+static void requeue(struct camera *camera, int index) {
+  source_t *source = &camera->source;
+  if (source->ops->requeue != NULL && source->ops->requeue(source, index) < 0)
+    perror("requeue");
+}
+
+// last client is done with the capture buffer, give it back to the source
+static void release_video_frame(frame_t *frame) {
+  requeue(frame->owner, (intptr_t)frame->priv);
+  free(frame);
+}
+
+static int handle_new_frame(struct camera *camera) {
+  const libmjpeg2http_config_t *config = &camera->server->config;
+  source_t *source = &camera->source;
+  struct source_buffer vb;
+  int n = source->ops->dequeue(source, &vb);
   if (n > 0) {
-    uint8_t *allocated = NULL;
-    struct dlist *itr;
-    list_iterate(itr, clients) {
-      struct observed *oc = list_get_entry(itr, struct observed, node);
-      if (oc->data.client->is_auth)
-        client_enqueue_frame(oc->data.client, (uint8_t *)g_frame_complete,
-                             g_frame_complete_len, &allocated);
+    metrics_add(frames_captured, 1);
+    // a big keyframe above the limit is skipped, capture goes on
+    if (config->max_frame_size > 0 &&
+        vb.bytesused > (uint32_t)config->max_frame_size) {
+      metrics_add(dropped[DROP_TOO_LARGE], 1);
+      printf("frame of %u bytes too large -> drop\n", vb.bytesused);
+      fflush(stdout);
+      requeue(camera, vb.index);
+      return 1;
+    }
+    uint64_t now = monotonic_usec();
+    uint64_t captured =
+        vb.timestamp != 0 && vb.timestamp <= now ? vb.timestamp : now;
+
+    // X-Timestamp is the wall clock time of the capture
+    char header[FRAME_HEADER_SIZE];
+    struct timeval timestamp;
+    gettimeofday(&timestamp, NULL);
+    uint64_t wall = (uint64_t)timestamp.tv_sec * 1000000 + timestamp.tv_usec -
+                    (now - captured);
+    int total = snprintf(header, FRAME_HEADER_SIZE, frame_header,
+                         vb.bytesused, (int)(wall / 1000000),
+                         (int)(wall % 1000000), vb.sequence);
+
+    frame_t *frame;
+    if (source->ops->queued == NULL ||
+        source->ops->queued(source) >= VIDEO_MIN_QUEUED) {
+      frame = frame_wrap(header, total, vb.start, vb.bytesused, end_frame,
+                         end_frame_len, release_video_frame,
+                         (void *)(intptr_t)vb.index);
+      if (frame == NULL)
+        requeue(camera, vb.index);
+      else
+        frame->owner = camera;
+    } else {
+      // slow clients hold most buffers: copy so the driver does not starve
+      metrics_add(frames_copied, 1);
+      frame = frame_create(header, total, vb.start, vb.bytesused, end_frame,
+                           end_frame_len);
+      requeue(camera, vb.index);
     }
-    if (allocated != NULL) {
-      if (--*(allocated + g_frame_complete_len) == 0)
-        free(allocated);
+    if (frame == NULL)
+      return 1;
+    frame->camera = camera->id;
+    frame->timestamp = captured;
+    frame->prepared = monotonic_usec();
+    frame->sequence = vb.sequence;
+    metrics_observe(&t_metrics->latency[STAGE_CAPTURE],
+                    frame->prepared - captured);
+
+    // workers take their own references from the ring
+    if (!ring_publish(&camera->server->ring, frame)) {
+      metrics_add(dropped[DROP_RING_FULL], 1);
+      printf("ring full -> drop frame\n");
+      fflush(stdout);
     }
+    frame_unref(frame);
   } else if (n < 0) {
     perror("error on handle new frame");
     return -1;
@@ -193,34 +300,78 @@ static int handle_new_frame(struct dlist *clients) {
   return 1;
 }
 
-static int create_pipe(char *name) {
+// device list: [/path=]device[,[/path=]device...], paths default to /camN
+static int open_cameras(mjpeg2http_server_t *s, const char *devices) {
+  char *list = strdup(devices), *save, *item;
+  if (list == NULL)
+    return -1;
+  for (item = strtok_r(list, ",", &save); item != NULL;
+       item = strtok_r(NULL, ",", &save)) {
+    if (s->numCameras == MAX_CAMERAS) {
+      printf("libmjpeg2http: more than %d cameras\n", MAX_CAMERAS);
+      fflush(stdout);
+      break;
+    }
+    struct camera *c = &s->cameras[s->numCameras];
+    char *eq = strchr(item, '=');
+    if (item[0] == '/' && eq != NULL) {
+      *eq = 0;
+      snprintf(c->path, sizeof(c->path), "%s", item);
+      item = eq + 1;
+    } else {
+      snprintf(c->path, sizeof(c->path), "/cam%d", s->numCameras);
+    }
+    c->id = s->numCameras;
+    c->subscribers = c->videoOn = 0;
+    c->server = s;
+    c->video.t = VIDEO;
+    c->video.data.camera = c;
+    if (source_open(&c->source, item, s->config.width, s->config.height,
+                    s->config.fps) < 0)
+      break;
+    printf("libmjpeg2http camera %s -> %s\n", c->path, item);
+    ++s->numCameras;
+  }
+  free(list);
+  return item == NULL && s->numCameras > 0 ? 1 : -1;
+}
+
+static void close_cameras(mjpeg2http_server_t *s) {
+  while (s->numCameras > 0)
+    source_close(&s->cameras[--s->numCameras].source);
+}
+
+static int create_pipe(mjpeg2http_server_t *s, const char *name) {
   mkfifo(name, S_IRUSR | S_IWUSR);
-  g_pipe_fd = open(name, O_RDWR | O_TRUNC);
-  if (g_pipe_fd < 0)
+  s->pipe_fd = open(name, O_RDWR | O_TRUNC);
+  if (s->pipe_fd < 0)
     return -1;
-  g_pipe.data.fd = g_pipe_fd;
-  g_pipe.t = TOKEN;
+  s->pipe.data.fd = s->pipe_fd;
+  s->pipe.t = TOKEN;
   struct epoll_event ev;
   ev.events = EPOLLIN | EPOLLET | EPOLLRDHUP | EPOLLERR | EPOLLHUP;
-  ev.data.ptr = &g_pipe;
-  fcntl(g_pipe_fd, F_SETFL, O_NONBLOCK);
-  if (epoll_ctl(g_epfd, EPOLL_CTL_ADD, g_pipe_fd, &ev) == -1) {
-    close(g_pipe_fd);
+  ev.data.ptr = &s->pipe;
+  fcntl(s->pipe_fd, F_SETFL, O_NONBLOCK);
+  if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, s->pipe_fd, &ev) == -1) {
+    close(s->pipe_fd);
+    s->pipe_fd = -1;
     return -1;
   }
   return 1;
 }
 
-static int handle_token(int fd) {
+static int handle_token(mjpeg2http_server_t *s, int fd) {
   int r;
-  g_token_pos %= NUMBER_OF_TOKEN * (TOKEN_SIZE + 1);
-  while ((r = read(fd, g_token + g_token_pos,
-                   NUMBER_OF_TOKEN * (TOKEN_SIZE + 1) - g_token_pos)) > 0) {
-    g_token_pos %= NUMBER_OF_TOKEN * (TOKEN_SIZE + 1);
-    g_token_pos += r;
+  pthread_mutex_lock(&s->token_lock);
+  s->token_pos %= NUMBER_OF_TOKEN * (TOKEN_SIZE + 1);
+  while ((r = read(fd, s->token + s->token_pos,
+                   NUMBER_OF_TOKEN * (TOKEN_SIZE + 1) - s->token_pos)) > 0) {
+    s->token_pos %= NUMBER_OF_TOKEN * (TOKEN_SIZE + 1);
+    s->token_pos += r;
   }
+  pthread_mutex_unlock(&s->token_lock);
 
-  //	printf("token=%.*s\n", NUMBER_OF_TOKEN * (TOKEN_SIZE + 1), g_token);
+  //	printf("token=%.*s\n", NUMBER_OF_TOKEN * (TOKEN_SIZE + 1), s->token);
 
   if (r < 0) {
     if (errno == EAGAIN || errno == EWOULDBLOCK) {
@@ -232,128 +383,431 @@ static int handle_token(int fd) {
   return 0;
 }
 
-static int check_token(const char *auth, uint8_t *start, int count) {
-  if (g_token_len == count && memcmp(auth, start, count) == 0)
+// called by workers
+static int check_token(void *ctx, uint8_t *start, int count) {
+  mjpeg2http_server_t *s = ctx;
+  if (s->token_len == count && memcmp(s->auth, start, count) == 0)
     return 1;
 
-  if (g_token_pos == -1 || TOKEN_SIZE != count)
-    return 0;
-
-  for (int i = 0; i < NUMBER_OF_TOKEN * (TOKEN_SIZE + 1); i += TOKEN_SIZE + 1) {
-    if (memcmp(g_token + i, start, TOKEN_SIZE) == 0) {
-      memset(g_token + i, 0, TOKEN_SIZE);
-      return 1;
+  int found = 0;
+  pthread_mutex_lock(&s->token_lock);
+  if (s->token_pos != -1 && TOKEN_SIZE == count) {
+    for (int i = 0; i < NUMBER_OF_TOKEN * (TOKEN_SIZE + 1);
+         i += TOKEN_SIZE + 1) {
+      if (memcmp(s->token + i, start, TOKEN_SIZE) == 0) {
+        memset(s->token + i, 0, TOKEN_SIZE);
+        found = 1;
+        break;
+      }
     }
   }
-  return 0;
+  pthread_mutex_unlock(&s->token_lock);
+  return found;
 }
 
-void libmjpeg2http_endLoop() {
-  if (g_runs > 0) {
-    --g_runs;
-    uint64_t beep = 1;
-    if (write(g_exitfd, &beep, sizeof(uint64_t))) {
-      printf("trigger exit\n");
+// called by workers, /metrics is disabled without its token
+static int check_metrics_token(void *ctx, uint8_t *start, int count) {
+  mjpeg2http_server_t *s = ctx;
+  return s->config.metrics_token[0] != 0 &&
+         strlen(s->config.metrics_token) == (size_t)count &&
+         memcmp(s->config.metrics_token, start, count) == 0;
+}
+
+// every client needs one descriptor, the limit is raised up to the hard limit
+// if the requested number of clients does not fit into the soft one
+static int setup_max_clients(int requested) {
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, &rl) == -1) {
+    perror("getrlimit");
+    return -1;
+  }
+
+  rlim_t wanted = (rlim_t)requested + RESERVED_FILE_DESCRIPTORS;
+  if (requested > 0 && rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur < wanted) {
+    rlim_t old = rl.rlim_cur;
+    rl.rlim_cur = (rl.rlim_max != RLIM_INFINITY && wanted > rl.rlim_max)
+                      ? rl.rlim_max
+                      : wanted;
+    if (setrlimit(RLIMIT_NOFILE, &rl) == -1) {
+      perror("setrlimit");
+      rl.rlim_cur = old;
     }
   }
+
+  long available = rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > INT32_MAX
+                       ? INT32_MAX
+                       : (long)rl.rlim_cur - RESERVED_FILE_DESCRIPTORS;
+  if (requested > 0 && requested <= available)
+    return requested;
+  if (requested > 0)
+    printf("max clients %d limited to %ld by RLIMIT_NOFILE\n", requested,
+           available);
+  return (int)available;
+}
+
+static libmjpeg2http_config_t *settings() {
+  if (!g_settingsReady) {
+    libmjpeg2http_defaultConfig(&g_settings);
+    g_settingsReady = 1;
+  }
+  return &g_settings;
+}
+
+void libmjpeg2http_setMaxClients(int max_clients) {
+  settings()->max_clients = max_clients;
+}
+
+void libmjpeg2http_setWorkers(int workers, const int *cpus, int ncpus) {
+  libmjpeg2http_config_t *config = settings();
+  config->workers = workers;
+  config->ncpus = 0;
+  for (int i = 0; i < ncpus && i < MJPEG2HTTP_MAX_CPUS; ++i)
+    config->cpus[config->ncpus++] = cpus[i];
+}
+
+void libmjpeg2http_setPolicy(int policy) { settings()->policy = policy; }
+
+void libmjpeg2http_setMetricsToken(char *token) {
+  snprintf(settings()->metrics_token, MJPEG2HTTP_TOKEN_SIZE, "%s",
+           token != NULL ? token : "");
+}
+
+void libmjpeg2http_setBackend(int backend) { settings()->backend = backend; }
+
+void libmjpeg2http_setZeroCopy(int threshold) {
+  settings()->zerocopy = threshold;
+}
+
+// only an eventfd write: may be called from a signal handler
+void libmjpeg2http_endLoop() {
+  mjpeg2http_server_t *s = __atomic_load_n(&g_server, __ATOMIC_ACQUIRE);
+  if (s != NULL)
+    mjpeg2http_server_stop(s);
 }
 
 int libmjpeg2http_loop(char *ipaddress, int port, char *device, char *token,
                        char *tokenpipe) {
-  if (g_runs > 0) {
+  return libmjpeg2http_loopConfig(settings(), ipaddress, port, device, token,
+                                  tokenpipe);
+}
+
+int libmjpeg2http_loopConfig(const libmjpeg2http_config_t *config,
+                             char *ipaddress, int port, char *device,
+                             char *token, char *tokenpipe) {
+  if (__atomic_load_n(&g_server, __ATOMIC_ACQUIRE) != NULL) {
     printf("libmjpeg2http_loop: already running\n");
     fflush(stdout);
     return -1;
   }
+  mjpeg2http_server_t *s = mjpeg2http_server_create(config, ipaddress, port,
+                                                    device, token, tokenpipe);
+  if (s == NULL)
+    return -1;
+  __atomic_store_n(&g_server, s, __ATOMIC_RELEASE);
+  int ret = mjpeg2http_server_run(s);
+  __atomic_store_n(&g_server, NULL, __ATOMIC_RELEASE);
+  mjpeg2http_server_destroy(s);
+  return ret < 0 ? ret : 0;
+}
 
-  cleanAll();
+mjpeg2http_server_t *mjpeg2http_server_create(
+    const libmjpeg2http_config_t *config, const char *ipaddress, int port,
+    const char *device, const char *token, const char *tokenpipe) {
+  libmjpeg2http_config_t defaults;
+  if (config == NULL) {
+    libmjpeg2http_defaultConfig(&defaults);
+    config = &defaults;
+  }
+  if (device == NULL || device[0] == 0)
+    device = "app:";
+
+  // metrics blocks are cache line aligned
+  mjpeg2http_server_t *s =
+      aligned_alloc(64, (sizeof(*s) + 63) / 64 * 64);
+  if (s == NULL) {
+    perror("libmjpeg2http_server_create");
+    return NULL;
+  }
+  memset(s, 0, sizeof(*s));
+  pthread_mutex_init(&s->token_lock, NULL);
+  s->token_pos = -1;
+  s->pipe_fd = s->exitfd = s->controlfd = -1;
+
+  s->config = *config;
+  if (s->config.workers < 1)
+    s->config.workers = 1;
+  if (s->config.workers > MAX_WORKERS)
+    s->config.workers = MAX_WORKERS;
+  if (s->config.tx_queue_max > TX_RING_SIZE - 1)
+    s->config.tx_queue_max = TX_RING_SIZE - 1;
+  if (s->config.ncpus > MJPEG2HTTP_MAX_CPUS)
+    s->config.ncpus = MJPEG2HTTP_MAX_CPUS;
+  s->config.metrics_token[MJPEG2HTTP_TOKEN_SIZE - 1] = 0;
+  s->port = port;
+  s->ipaddress = strdup(ipaddress);
+  s->auth = strdup(token != NULL ? token : "");
+  if (s->ipaddress == NULL || s->auth == NULL) {
+    perror("libmjpeg2http_server_create");
+    goto errorOnCopy;
+  }
+  s->token_len = strlen(s->auth);
 
-  g_exitfd = eventfd(0, 0);
-  if (g_exitfd == -1) {
-    printf("libmjpeg2http_loop: cannot create g_exitfd\n");
+  s->exitfd = eventfd(0, 0);
+  if (s->exitfd == -1) {
+    printf("libmjpeg2http_server_create: cannot create exitfd\n");
     fflush(stdout);
-    return -1;
+    goto errorOnExitCreate;
   }
 
-  // reference counter uses 1 byte so
-  // to increase this limit more bytes
-  // must be used
-  if (g_maxClients >= 255) {
-    printf("g_maxClients=%d exceeds 255\n", g_maxClients);
+  s->maxClients = setup_max_clients(s->config.max_clients);
+  if (s->maxClients <= 0) {
+    printf("libmjpeg2http_server_create: no file descriptors left for "
+           "clients\n");
     fflush(stdout);
-    return -1;
+    goto errorOnMaxClients;
   }
 
-  signal(SIGPIPE, SIG_IGN);
-
-  g_epfd = epoll_create1(0);
-  if (g_epfd == -1) {
+  s->epfd = epoll_create1(0);
+  if (s->epfd == -1) {
     perror("epoll_create1");
-    return -1;
+    goto errorOnMaxClients;
   }
 
-  ++g_runs;
+  s->controlfd = eventfd(0, EFD_NONBLOCK);
+  if (s->controlfd == -1) {
+    perror("eventfd: control");
+    goto errorOnControlCreate;
+  }
 
-  int server_fd = server_create(ipaddress, port);
-  if (server_fd < 0)
-    goto errorOnServerCreate;
+  // register eventfd
+  struct epoll_event ev;
+  s->exit.data.fd = s->exitfd;
+  s->exit.t = EXITFD;
+  ev.events = EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP;
+  ev.data.ptr = &s->exit;
+  if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, s->exitfd, &ev) == -1) {
+    perror("epoll_ctl: exitfd");
+    goto errorOnRegister;
+  }
 
-  int video_fd = video_init(device, WIDTH, HEIGHT, FRAME_PER_SECOND);
-  if (video_fd < 0)
+  // register control eventfd used by workers to switch video on and off
+  s->control.data.fd = s->controlfd;
+  s->control.t = CONTROL;
+  ev.events = EPOLLIN;
+  ev.data.ptr = &s->control;
+  if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, s->controlfd, &ev) == -1) {
+    perror("epoll_ctl: controlfd");
+    goto errorOnRegister;
+  }
+
+  if (tokenpipe != NULL) {
+    s->token_pos = 0;
+    if (create_pipe(s, tokenpipe) < 0)
+      goto errorOnCreatePipe;
+  }
+
+  if (open_cameras(s, device) < 0)
     goto errorOnVideoInit;
 
-  struct epoll_event ev, ev2, events[MAX_FILE_DESCRIPTORS];
-  struct observed video, server, *oev, exitfd;
-  struct dlist *itr, *save;
+  return s;
 
-  video.data.fd = video_fd;
-  video.t = VIDEO;
+errorOnVideoInit:
+  close_cameras(s);
+  if (s->pipe_fd != -1)
+    close(s->pipe_fd);
+errorOnCreatePipe:
+errorOnRegister:
+  close(s->controlfd);
+errorOnControlCreate:
+  close(s->epfd);
+errorOnMaxClients:
+  close(s->exitfd);
+errorOnExitCreate:
+errorOnCopy:
+  free(s->ipaddress);
+  free(s->auth);
+  pthread_mutex_destroy(&s->token_lock);
+  free(s);
+  return NULL;
+}
+
+void mjpeg2http_server_stop(mjpeg2http_server_t *s) {
+  static const char error[] = "mjpeg2http_server_stop: cannot write exitfd\n";
+  // stays readable: the loop and every worker see it. No stdio, this may
+  // run in a signal handler
+  int saved = errno;
+  if (write(s->exitfd, &(uint64_t){1}, sizeof(uint64_t)) < 0) {
+    ssize_t r = write(STDERR_FILENO, error, sizeof(error) - 1);
+    (void)r;
+  }
+  errno = saved;
+}
 
-  g_token_len = strlen(token);
+void mjpeg2http_server_destroy(mjpeg2http_server_t *s) {
+  if (s == NULL)
+    return;
+  close_cameras(s);
+  if (s->pipe_fd != -1)
+    close(s->pipe_fd);
+  close(s->controlfd);
+  close(s->epfd);
+  close(s->exitfd);
+  free(s->ipaddress);
+  free(s->auth);
+  pthread_mutex_destroy(&s->token_lock);
+  free(s);
+}
 
-  // register webserver
-  server.data.fd = server_fd;
-  server.t = SERVER;
-  ev.events = EPOLLIN | EPOLLET | EPOLLRDHUP | EPOLLERR | EPOLLHUP;
-  ev.data.ptr = &server;
-  if (epoll_ctl(g_epfd, EPOLL_CTL_ADD, server_fd, &ev) == -1) {
-    perror("epoll_ctl: server socket");
-    goto errorOnRegisterServer;
+int mjpeg2http_push_frame_nocopy(mjpeg2http_server_t *s, const uint8_t *data,
+                                 uint32_t len, uint64_t timestamp,
+                                 void (*release)(void *opaque),
+                                 void *opaque) {
+  // cameras do not change between create and destroy
+  for (int i = 0; i < s->numCameras; ++i) {
+    if (s->cameras[i].source.ops == &app_source_ops)
+      return app_source_push(&s->cameras[i].source, data, len, timestamp,
+                             release, opaque);
   }
+  return -1;
+}
 
-  // register eventfd
-  exitfd.data.fd = g_exitfd;
-  exitfd.t = EXITFD;
-  ev2.events = EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP;
-  ev2.data.ptr = &exitfd;
-  if (epoll_ctl(g_epfd, EPOLL_CTL_ADD, g_exitfd, &ev2) == -1) {
-    perror("epoll_ctl: g_exitfd");
-    goto errorOnRegisterServer;
+int mjpeg2http_push_frame(mjpeg2http_server_t *s, const uint8_t *data,
+                          uint32_t len, uint64_t timestamp) {
+  return mjpeg2http_push_frame_nocopy(s, data, len, timestamp, NULL, NULL);
+}
+
+int mjpeg2http_server_run(mjpeg2http_server_t *s) {
+  if (__atomic_add_fetch(&s->runs, 1, __ATOMIC_ACQ_REL) > 1) {
+    __atomic_sub_fetch(&s->runs, 1, __ATOMIC_ACQ_REL);
+    printf("mjpeg2http_server_run: already running\n");
+    fflush(stdout);
+    return -1;
   }
 
-  if (tokenpipe != NULL) {
-    g_token_pos = 0;
-    if (create_pipe(tokenpipe) < 0) {
-      goto errorOnCreatePipe;
+  const libmjpeg2http_config_t *config = &s->config;
+  struct epoll_event events[EPOLL_BATCH];
+  struct observed *oev;
+  int ret = 0, started = 0;
+  printf("libmjpeg2http max clients=%d workers=%d\n", s->maxClients,
+         config->workers);
+
+  signal(SIGPIPE, SIG_IGN);
+
+  // the rtp and shm outputs read the ring after the workers
+  int rtp = config->rtp[0] != 0, rtpStarted = 0;
+  int shm = config->shm[0] != 0, shmStarted = 0;
+  if (ring_init(&s->ring, config->workers + rtp + shm) < 0) {
+    // the exitfd is drained below whichever way run ends
+    mjpeg2http_server_stop(s);
+    ret = -1;
+    goto errorOnRingInit;
+  }
+
+  shaper_init(&s->egress, config->egress_rate, SHAPER_BURST_MS * 1000ULL);
+  for (; started < config->workers; ++started) {
+    worker_t *w = &s->workers[started];
+    w->id = started;
+    w->cpu = config->ncpus > 0 ? config->cpus[started % config->ncpus] : -1;
+    w->exit_fd = s->exitfd;
+    w->ring = &s->ring;
+    w->metrics = &s->metrics;
+    w->ctx = s;
+    w->client_join = client_join;
+    w->client_leave = client_leave;
+    w->check_token = check_token;
+    w->check_metrics_token = check_metrics_token;
+    w->camera_join = camera_join;
+    w->camera_leave = camera_leave;
+    w->find_camera = find_camera;
+    w->policy =
+        config->policy == MJPEG2HTTP_POLICY_LATEST ? TX_LATEST : TX_QUEUE;
+    w->backend = config->backend == MJPEG2HTTP_BACKEND_URING ? BACKEND_URING
+                                                             : BACKEND_EPOLL;
+    w->zerocopy = config->zerocopy > 0 ? config->zerocopy : 0;
+    w->tx_queue_max = config->tx_queue_max;
+    w->listen_backlog = config->listen_backlog;
+    w->client_rate = config->client_rate;
+    w->egress = config->egress_rate > 0 ? &s->egress : NULL;
+    w->latency = config->latency;
+    if (worker_start(w, s->ipaddress, s->port) < 0) {
+      ret = -1;
+      goto errorOnWorkerStart;
     }
   }
 
-  client_t *c;
+  if (rtp) {
+    if (config->rtp_camera >= s->numCameras) {
+      printf("libmjpeg2http: no camera %d for rtp\n", config->rtp_camera);
+      fflush(stdout);
+      ret = -1;
+      goto errorOnRtpStart;
+    }
+    if (rtp_open(&s->rtp, config->rtp, config->rtp_interface,
+                 config->rtp_ttl, config->rtp_rate) < 0) {
+      ret = -1;
+      goto errorOnRtpStart;
+    }
+    s->rtp.camera = config->rtp_camera;
+    s->rtp.reader = config->workers;
+    s->rtp.ring = &s->ring;
+    s->rtp.exit_fd = s->exitfd;
+    s->rtp.metrics = &s->metrics;
+    if (rtp_start(&s->rtp) < 0) {
+      rtp_close(&s->rtp);
+      ret = -1;
+      goto errorOnRtpStart;
+    }
+    rtpStarted = 1;
+    // the camera streams as long as the rtp output runs
+    camera_join(s, s->rtp.camera);
+  }
+
+  if (shm) {
+    if (config->shm_camera >= s->numCameras) {
+      printf("libmjpeg2http: no camera %d for shm\n", config->shm_camera);
+      fflush(stdout);
+      ret = -1;
+      goto errorOnShmStart;
+    }
+    if (shmring_open(&s->shm, config->shm, config->shm_slots,
+                     config->shm_slot_size) < 0) {
+      ret = -1;
+      goto errorOnShmStart;
+    }
+    s->shm.camera = config->shm_camera;
+    s->shm.reader = config->workers + rtp;
+    s->shm.ring = &s->ring;
+    s->shm.exit_fd = s->exitfd;
+    s->shm.metrics = &s->metrics;
+    s->shm.ctx = s;
+    s->shm.camera_join = camera_join;
+    s->shm.camera_leave = camera_leave;
+    if (shmring_start(&s->shm) < 0) {
+      shmring_close(&s->shm);
+      ret = -1;
+      goto errorOnShmStart;
+    }
+    shmStarted = 1;
+  }
+
   int nfds, n;
-  declare_list(clients);
 
+  metrics_register(&s->metrics, METRICS_CAPTURE, 0);
   printf("libmjpeg2http mainloop\n");
   fflush(stdout);
 
   for (;;) {
 
-    nfds = epoll_wait(g_epfd, events, MAX_FILE_DESCRIPTORS, -1);
+    nfds = epoll_wait(s->epfd, events, EPOLL_BATCH, -1);
     if (nfds == -1) {
+      if (errno == EINTR)
+        continue;
       if (errno != EBADF)
         perror("epoll_wait");
       goto errorOnEpollWait;
     }
 
+    uint64_t start = metrics_usec();
     for (n = 0; n < nfds; ++n) {
       oev = (struct observed *)events[n].data.ptr;
       switch (oev->t) {
@@ -362,110 +816,65 @@ int libmjpeg2http_loop(char *ipaddress, int port, char *device, char *token,
         goto exitFromMainLoop;
 
       case TOKEN:
-        if (handle_token(oev->data.fd) < 0)
+        if (handle_token(s, oev->data.fd) < 0)
           goto errorOnHandleToken;
         break;
 
+      case CONTROL:
+        if (handle_control(s, oev->data.fd) < 0)
+          goto errorOnHandleControl;
+        break;
+
       case VIDEO:
         if (events[n].events & (EPOLLRDHUP | EPOLLERR | EPOLLHUP)) {
           perror("error on video");
           goto errorOnVideo;
         }
-        if (handle_new_frame(&clients) < 0)
+        if (handle_new_frame(oev->data.camera) < 0)
           goto errorOnHandleNewFrame;
         break;
-
-      case SERVER:
-        if (events[n].events & (EPOLLRDHUP | EPOLLERR | EPOLLHUP)) {
-          perror("error on server");
-          goto errorOnServer;
-        }
-        if (events[n].events & EPOLLIN) {
-          if (add_clients(server_fd, &clients, &video) < 0)
-            goto errorOnAddClients;
-        }
-        break;
-
-      case CLIENT:
-        c = oev->data.client;
-        if (events[n].events & (EPOLLRDHUP | EPOLLERR | EPOLLHUP)) {
-          printf("generic error fd=%d\n", c->fd);
-          fflush(stdout);
-          if (remove_client(oev, &video) < 0)
-            goto errorOnRemoveClient;
-          break;
-        }
-
-        if (events[n].events & EPOLLOUT) {
-          if (client_tx(c) < 0) {
-            if (remove_client(oev, &video) < 0)
-              goto errorOnRemoveClient;
-            break;
-          }
-        }
-
-        if (events[n].events & EPOLLIN) {
-          if (!c->is_auth) {
-            int done = client_parse_request(c);
-            if (done > 0) {
-              if (check_token(token, c->rxbuf + c->start_token,
-                              c->end_token - c->start_token)) {
-                printf("client auth OK %s %d\n", c->hostname, c->port);
-                fflush(stdout);
-                c->is_auth = 1;
-                client_enqueue_frame(c, (uint8_t *)welcome, welcome_len, NULL);
-              } else {
-                printf("client auth KO %s %d\n", c->hostname, c->port);
-                fflush(stdout);
-                client_enqueue_frame(c, (uint8_t *)welcome_ko, welcome_ko_len,
-                                     NULL);
-                if (remove_client(oev, &video) < 0)
-                  goto errorOnRemoveClient;
-              }
-            } else if (done < 0) {
-              if (remove_client(oev, &video) < 0)
-                goto errorOnRemoveClient;
-            }
-          }
-        }
-        break;
       }
     }
+    metrics_observe(&t_metrics->loop, metrics_usec() - start);
   }
 
 exitFromMainLoop:
-errorOnRemoveClient:
-errorOnAddClients:
-errorOnServer:
 errorOnVideo:
 errorOnHandleNewFrame:
+errorOnHandleControl:
 errorOnHandleToken:
 errorOnEpollWait:
-  list_iterate_safe(itr, save, &clients) {
-    list_del(&list_get_entry(itr, struct observed, node)->node);
-    oev = list_get_entry(itr, struct observed, node);
-    client_free(oev->data.client);
-    free(oev);
+errorOnShmStart:
+errorOnRtpStart:
+errorOnWorkerStart:
+  // wake up all workers, the eventfd stays readable
+  mjpeg2http_server_stop(s);
+  while (started > 0)
+    worker_join(&s->workers[--started]);
+  if (rtpStarted) {
+    rtp_join(&s->rtp);
+    rtp_close(&s->rtp);
   }
+  if (shmStarted) {
+    shmring_join(&s->shm);
+    shmring_close(&s->shm);
+  }
+  ring_destroy(&s->ring);
 
-errorOnCreatePipe:
-  if (g_pipe_fd != -1)
-    close(g_pipe_fd);
-
-errorOnRegisterServer:
-  video_deinit();
-
-errorOnVideoInit:
-  shutdown(server_fd, SHUT_RDWR);
-  close(server_fd);
-
-errorOnServerCreate:
-  close(g_epfd);
-  close(g_exitfd);
-  g_runs = 0;
+errorOnRingInit:
+  // the cameras stay open until destroy, off and ready for another run
+  for (int i = 0; i < s->numCameras; ++i) {
+    s->cameras[i].subscribers = 0;
+    switch_video(&s->cameras[i], 0);
+  }
+  metrics_register(NULL, METRICS_CAPTURE, 0);
+  uint64_t beep;
+  if (read(s->exitfd, &beep, sizeof(beep)) < 0)
+    perror("read exitfd");
+  __atomic_sub_fetch(&s->runs, 1, __ATOMIC_ACQ_REL);
 
   printf("libmjpeg2http exit from loop\n");
   fflush(stdout);
 
-  return 0;
+  return ret;
 }
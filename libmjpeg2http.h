@@ -25,18 +25,195 @@
 #ifndef LIBMJPEG2HTTP_H
 #define LIBMJPEG2HTTP_H
 
+#include <stdint.h>
+
 // ensure we can call these functions from C++.
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-// run loop (blocking call) - not thread-safe
+#define MJPEG2HTTP_MAX_CPUS 64
+#define MJPEG2HTTP_TOKEN_SIZE 128
+#define MJPEG2HTTP_ADDRESS_SIZE 64
+
+// run-time settings of libmjpeg2http_loopConfig, the setters below change
+// the ones used by libmjpeg2http_loop
+typedef struct {
+  int width; // requested capture format
+  int height;
+  int fps;
+  int max_frame_size; // larger frames are dropped, 0: driver sizeimage
+  int tx_queue_max;   // frames queued per client (MJPEG2HTTP_POLICY_QUEUE),
+                      // up to TX_RING_SIZE - 1 (constants.h)
+  int listen_backlog;
+  int max_clients; // see libmjpeg2http_setMaxClients
+  int workers;     // see libmjpeg2http_setWorkers
+  int cpus[MJPEG2HTTP_MAX_CPUS];
+  int ncpus;
+  int policy;   // see libmjpeg2http_setPolicy
+  int backend;  // see libmjpeg2http_setBackend
+  int zerocopy; // see libmjpeg2http_setZeroCopy
+  // see libmjpeg2http_setMetricsToken, "" disables /metrics
+  char metrics_token[MJPEG2HTTP_TOKEN_SIZE];
+  // RTP/JPEG (RFC 2435) copy of one camera sent to "a.b.c.d:port", unicast
+  // or multicast, "" disables it
+  char rtp[MJPEG2HTTP_ADDRESS_SIZE];
+  char rtp_interface[MJPEG2HTTP_ADDRESS_SIZE]; // multicast source address
+  int rtp_camera; // index in the device list
+  int rtp_ttl;    // multicast
+  int rtp_rate;   // bytes/s of the pacing, 0: half the frame interval
+  // shared memory ring of one camera handed out on a unix socket, ""
+  // disables it (see mjpeg2http_shm_attach)
+  char shm[MJPEG2HTTP_ADDRESS_SIZE];
+  int shm_camera;    // index in the device list
+  int shm_slots;     // frames kept
+  int shm_slot_size; // larger frames are skipped
+  // bandwidth budgets in bytes/s, 0: unlimited. Frames over them are
+  // skipped, clients are also paced by the kernel at client_rate
+  int client_rate; // every HTTP client
+  int egress_rate; // all HTTP clients of the server together
+  // 1: at most about a frame waits in the socket of a client
+  // (TCP_NOTSENT_LOWAT, SO_SNDBUF from the frame size), the freshest frame
+  // is picked when it has drained. Implies MJPEG2HTTP_POLICY_LATEST
+  int latency;
+} libmjpeg2http_config_t;
+
+// fills config with the defaults
+void libmjpeg2http_defaultConfig(libmjpeg2http_config_t *config);
+
+// sets one field by name (width, height, fps, max_frame_size, tx_queue_max,
+// listen_backlog, max_clients, workers, cpus=0,1,..., policy=queue|latest,
+// backend=epoll|io_uring, zerocopy, metrics_token, rtp, rtp_interface,
+// rtp_camera, rtp_ttl, rtp_rate, shm, shm_camera, shm_slots, shm_slot_size,
+// client_rate, egress_rate, latency), -1 if key or value is not valid
+int libmjpeg2http_setConfig(libmjpeg2http_config_t *config, const char *key,
+                            const char *value);
+
+// reads "key = value" lines, # starts a comment, -1 on the first error and
+// then config is left as it was
+int libmjpeg2http_loadConfig(libmjpeg2http_config_t *config,
+                             const char *path);
+
+// run loop (blocking call) - not thread-safe. device may list several
+// cameras: [/path=]device,[/path=]device,... (paths default to /camN)
 int libmjpeg2http_loop(char *ipaddress, int port, char *device, char *token,
                        char *tokenpipe);
+int libmjpeg2http_loopConfig(const libmjpeg2http_config_t *config,
+                             char *ipaddress, int port, char *device,
+                             char *token, char *tokenpipe);
+
+// limits the number of connected clients, 0 (default) means as many as
+// RLIMIT_NOFILE allows. Must be called before libmjpeg2http_loop
+void libmjpeg2http_setMaxClients(int max_clients);
+
+// number of network threads, each with its own listening socket, and the
+// cpus they are pinned to (round robin, ncpus 0 means no affinity).
+// Must be called before libmjpeg2http_loop
+void libmjpeg2http_setWorkers(int workers, const int *cpus, int ncpus);
+
+// how frames are delivered to clients that are still sending:
+// MJPEG2HTTP_POLICY_QUEUE (default) queues a few frames and drops the new
+// ones, MJPEG2HTTP_POLICY_LATEST sends the freshest frame and skips the others.
+// Must be called before libmjpeg2http_loop
+#define MJPEG2HTTP_POLICY_QUEUE 0
+#define MJPEG2HTTP_POLICY_LATEST 1
+void libmjpeg2http_setPolicy(int policy);
 
-// interrupts loop and deallocates all resources - not thread-safe
+// enables GET /metrics?token (Prometheus text format) with its own token,
+// disabled by default. Must be called before libmjpeg2http_loop
+void libmjpeg2http_setMetricsToken(char *token);
+
+// network backend of the workers: MJPEG2HTTP_BACKEND_EPOLL (default) or
+// MJPEG2HTTP_BACKEND_URING, batched io_uring sends and multishot accept, with
+// epoll as the fallback if io_uring is not available.
+// Must be called before libmjpeg2http_loop
+#define MJPEG2HTTP_BACKEND_EPOLL 0
+#define MJPEG2HTTP_BACKEND_URING 1
+void libmjpeg2http_setBackend(int backend);
+
+// frames of at least threshold bytes are sent with MSG_ZEROCOPY and kept
+// until the kernel reports the send done, smaller ones are copied as usual.
+// 0 (default) disables it. Must be called before libmjpeg2http_loop
+void libmjpeg2http_setZeroCopy(int threshold);
+
+// interrupts loop and deallocates all resources, safe from a signal handler
 void libmjpeg2http_endLoop();
 
+// one server with its own cameras, workers, clients and metrics: several
+// can run in the same process on different ports. config NULL takes the
+// defaults, device as for libmjpeg2http_loop, NULL or "app:" is fed by
+// mjpeg2http_push_frame. The cameras are opened here, NULL on error
+typedef struct mjpeg2http_server mjpeg2http_server_t;
+mjpeg2http_server_t *mjpeg2http_server_create(
+    const libmjpeg2http_config_t *config, const char *ipaddress, int port,
+    const char *device, const char *token, const char *tokenpipe);
+// starts the workers and outputs and captures until mjpeg2http_server_stop
+// (blocking call), may be run again afterwards. -1 if it could not start
+int mjpeg2http_server_run(mjpeg2http_server_t *server);
+// thread-safe, also from a signal handler: run returns soon after
+void mjpeg2http_server_stop(mjpeg2http_server_t *server);
+// closes the cameras, run must have returned
+void mjpeg2http_server_destroy(mjpeg2http_server_t *server);
+
+// hands a JPEG to the app: camera of server, from any thread. data is
+// copied once into a frame buffer, timestamp is the capture time
+// (CLOCK_MONOTONIC usec, 0: now). 1 if queued, 0 if dropped because there
+// are no viewers, every buffer is still being sent or the copy is out of
+// memory, -1 without an app: camera
+int mjpeg2http_push_frame(mjpeg2http_server_t *server, const uint8_t *data,
+                          uint32_t len, uint64_t timestamp);
+// without the copy: data must stay valid until release(opaque) is called,
+// which happens only if 1 is returned, once the last client is done with it
+int mjpeg2http_push_frame_nocopy(mjpeg2http_server_t *server,
+                                 const uint8_t *data, uint32_t len,
+                                 uint64_t timestamp,
+                                 void (*release)(void *opaque), void *opaque);
+
+// frames pushed by a local process to a unix:/path device: connect a
+// SOCK_SEQPACKET socket to path and send one message per frame, a
+// mjpeg2http_push_t (type MJPEG2HTTP_PUSH_FRAME, len of the JPEG) followed
+// by the JPEG, or with the JPEG in a descriptor passed with SCM_RIGHTS
+// (offset 0), which is mapped instead of copied when it is a memfd sealed
+// with F_SEAL_SHRINK and F_SEAL_WRITE, read otherwise. The server answers
+// MJPEG2HTTP_PUSH_START and MJPEG2HTTP_PUSH_STOP as viewers come and go,
+// frames are only wanted in between. One producer per device
+#define MJPEG2HTTP_PUSH_FRAME 1
+#define MJPEG2HTTP_PUSH_START 2
+#define MJPEG2HTTP_PUSH_STOP 3
+typedef struct {
+  uint32_t type;
+  uint32_t len;
+  uint64_t timestamp; // capture, CLOCK_MONOTONIC usec, 0: when received
+} mjpeg2http_push_t;
+
+// consumer of the shared memory ring (shm setting), from another process.
+// Frames are read in place: data stays valid until the producer laps the
+// ring, which mjpeg2http_shm_valid tells after the frame has been used
+typedef struct mjpeg2http_shm mjpeg2http_shm_t;
+typedef struct {
+  uint64_t seq; // frame number in the ring, 0: none read yet
+  const uint8_t *data;
+  uint32_t len;
+  uint32_t sequence;  // of the camera
+  uint64_t timestamp; // capture, CLOCK_MONOTONIC usec
+} mjpeg2http_shm_frame_t;
+
+// connects to the unix socket and maps the ring, NULL on error. The camera
+// streams while at least one consumer is attached
+mjpeg2http_shm_t *mjpeg2http_shm_attach(const char *path);
+void mjpeg2http_shm_detach(mjpeg2http_shm_t *shm);
+// freshest frame, 0 if there is none yet
+int mjpeg2http_shm_latest(mjpeg2http_shm_t *shm,
+                          mjpeg2http_shm_frame_t *frame);
+// frame after frame->seq (the next one to come if 0, the freshest if
+// frame->seq was overwritten), waiting up to timeout_ms (-1: forever).
+// 0 on timeout, -1 once the producer is gone
+int mjpeg2http_shm_next(mjpeg2http_shm_t *shm, mjpeg2http_shm_frame_t *frame,
+                        int timeout_ms);
+// 1 while the data of frame has not been overwritten
+int mjpeg2http_shm_valid(mjpeg2http_shm_t *shm,
+                         const mjpeg2http_shm_frame_t *frame);
+
 #ifdef __cplusplus
 } // end of extern "C"
 #endif
@@ -25,22 +25,107 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "libmjpeg2http.h"
 
+static void usage() {
+  printf("usage example: ./mjpeg2http [-c max_clients] [-w workers] "
+         "[-a cpu,cpu,...] [-l] [-u] [-z bytes] [-m metrics_token] "
+         "[-f config_file] [-o key=value] 192.168.2.1 8080 /dev/video0 "
+         "this_is_token [/tmp/mjpeg2http_onetimetoken]\n");
+  printf("  -l  send the latest frame to slow clients instead of queueing\n");
+  printf("  -m  serve /metrics?metrics_token (Prometheus text format)\n");
+  printf("  -u  send with io_uring (epoll if not available)\n");
+  printf("  -z  send frames of at least bytes with MSG_ZEROCOPY\n");
+  printf("  -f  read key = value settings from config_file\n");
+  printf("  -o  one setting: width, height, fps, max_frame_size, "
+         "tx_queue_max, listen_backlog, max_clients, workers, cpus, policy, "
+         "backend, zerocopy, metrics_token, rtp, rtp_interface, rtp_camera, "
+         "rtp_ttl, rtp_rate, shm, shm_camera, shm_slots, shm_slot_size, "
+         "client_rate, egress_rate, latency\n");
+  printf("  options are applied in order, later ones override\n");
+  printf("  the device can also be a directory of jpeg files or an mjpeg file "
+         "to replay, with an optional @fps (@0: as fast as possible), or an "
+         "http:// url of an mjpeg stream to relay, or unix:/path where a "
+         "local producer pushes frames\n");
+  printf("  several devices: [/path=]device,[/path=]device,... served on "
+         "/path (default /cam0, /cam1, ...)\n");
+}
+
+static int set(libmjpeg2http_config_t *config, const char *key,
+               const char *value) {
+  if (libmjpeg2http_setConfig(config, key, value) > 0)
+    return 1;
+  printf("invalid setting %s=%s\n", key, value);
+  return -1;
+}
+
 int main(int argc, char **argv) {
-  if (argc < 5) {
-    printf("usage example: ./mjpeg2http 192.168.2.1 8080 /dev/video0 "
-           "this_is_token [/tmp/mjpeg2http_onetimetoken]\n");
+  int opt, r = 1;
+  char *eq;
+  libmjpeg2http_config_t config;
+  libmjpeg2http_defaultConfig(&config);
+  while ((opt = getopt(argc, argv, "c:w:a:luz:m:f:o:")) != -1) {
+    switch (opt) {
+    case 'c':
+      r = set(&config, "max_clients", optarg);
+      break;
+    case 'w':
+      r = set(&config, "workers", optarg);
+      break;
+    case 'a':
+      r = set(&config, "cpus", optarg);
+      break;
+    case 'l':
+      config.policy = MJPEG2HTTP_POLICY_LATEST;
+      break;
+    case 'm':
+      r = set(&config, "metrics_token", optarg);
+      break;
+    case 'u':
+      config.backend = MJPEG2HTTP_BACKEND_URING;
+      break;
+    case 'z':
+      r = set(&config, "zerocopy", optarg);
+      break;
+    case 'f':
+      r = libmjpeg2http_loadConfig(&config, optarg);
+      break;
+    case 'o':
+      if ((eq = strchr(optarg, '=')) == NULL) {
+        r = -1;
+        break;
+      }
+      *eq = 0;
+      r = set(&config, optarg, eq + 1);
+      break;
+    default:
+      r = -1;
+      break;
+    }
+    if (r < 0) {
+      usage();
+      return 1;
+    }
+  }
+
+  argc -= optind;
+  argv += optind;
+
+  if (argc < 4) {
+    usage();
     return 1;
   }
 
   char *tokenpipe = NULL;
 
-  if (argc == 6) {
-    tokenpipe = argv[5];
+  if (argc == 5) {
+    tokenpipe = argv[4];
   }
 
-  libmjpeg2http_loop(argv[1], atoi(argv[2]), argv[3], argv[4], tokenpipe);
+  libmjpeg2http_loopConfig(&config, argv[0], atoi(argv[1]), argv[2], argv[3],
+                           tokenpipe);
   return 0;
 }
@@ -0,0 +1,221 @@
+/**
+ *  mjpeg2http
+ *
+ *  Copyright (c) 2022 Antonino Nolano. Licensed under the MIT license, as
+ * follows:
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "metrics.h"
+
+static struct metrics g_unregistered;
+
+__thread struct metrics *t_metrics = &g_unregistered;
+
+static const char *g_drop_reason[DROP_REASONS] = {
+    "ring_full",
+    "tx_queue_full",
+    "latest_replaced",
+    "decimated",
+    "too_large",
+    "shaped",
+    "no_memory",
+};
+
+static const char *g_stage[LATENCY_STAGES] = {
+    "capture",
+    "queue",
+    "send",
+    "total",
+};
+
+void metrics_register(metrics_set_t *set, enum metrics_thread type, int id) {
+  if (set == NULL)
+    t_metrics = &g_unregistered;
+  else if (type == METRICS_RTP || type == METRICS_SHM)
+    t_metrics = &set->slot[1 + MAX_WORKERS + (type == METRICS_SHM)];
+  else
+    t_metrics = &set->slot[type == METRICS_CAPTURE ? 0 : 1 + id];
+}
+
+#define load(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+
+struct output {
+  char *buf;
+  size_t size;
+  size_t pos;
+};
+
+static void out(struct output *o, const char *format, ...) {
+  va_list ap;
+  va_start(ap, format);
+  if (o->pos < o->size) {
+    int n = vsnprintf(o->buf + o->pos, o->size - o->pos, format, ap);
+    o->pos += n > 0 ? n : 0;
+  }
+  va_end(ap);
+}
+
+// slots from first to last summed in total
+static void sum(metrics_set_t *set, struct metrics *total, int first,
+                int last) {
+  memset(total, 0, sizeof(struct metrics));
+  for (int t = first; t <= last; ++t) {
+    struct metrics *m = &set->slot[t];
+    total->frames_captured += load(m->frames_captured);
+    total->frames_copied += load(m->frames_copied);
+    total->frames_sent += load(m->frames_sent);
+    total->bytes_sent += load(m->bytes_sent);
+    total->bytes_shaped += load(m->bytes_shaped);
+    total->bytes_shaped_dropped += load(m->bytes_shaped_dropped);
+    for (int i = 0; i < DROP_REASONS; ++i)
+      total->dropped[i] += load(m->dropped[i]);
+    total->clients += load(m->clients);
+    total->clients_auth += load(m->clients_auth);
+    for (int i = 0; i < METRICS_DEPTHS; ++i)
+      total->tx_queue_depth[i] += load(m->tx_queue_depth[i]);
+    total->syscalls += load(m->syscalls);
+    total->rtp_frames += load(m->rtp_frames);
+    total->rtp_packets += load(m->rtp_packets);
+    total->rtp_bytes += load(m->rtp_bytes);
+    total->shm_frames += load(m->shm_frames);
+    total->shm_consumers += load(m->shm_consumers);
+    for (int s = 0; s < LATENCY_STAGES; ++s) {
+      for (int i = 0; i < METRICS_BUCKETS; ++i)
+        total->latency[s].bucket[i] += load(m->latency[s].bucket[i]);
+      total->latency[s].sum += load(m->latency[s].sum);
+    }
+    for (int i = 0; i < METRICS_BUCKETS; ++i)
+      total->loop.bucket[i] += load(m->loop.bucket[i]);
+    total->loop.sum += load(m->loop.sum);
+  }
+}
+
+static void histogram(struct output *o, const char *name, const char *label,
+                      struct histogram *h) {
+  const char *sep = label[0] != 0 ? "," : "";
+  uint64_t count = 0;
+  for (int i = 0; i < METRICS_BUCKETS - 1; ++i) {
+    count += h->bucket[i];
+    out(o, "%s_bucket{%s%sle=\"%.7g\"} %" PRIu64 "\n", name, label, sep,
+        (double)(16 << i) / 1e6, count);
+  }
+  count += h->bucket[METRICS_BUCKETS - 1];
+  out(o, "%s_bucket{%s%sle=\"+Inf\"} %" PRIu64 "\n", name, label, sep,
+      count);
+  out(o, "%s_sum%s%s%s %g\n", name, *sep ? "{" : "", label, *sep ? "}" : "",
+      h->sum / 1e6);
+  out(o, "%s_count%s%s%s %" PRIu64 "\n", name, *sep ? "{" : "", label,
+      *sep ? "}" : "", count);
+}
+
+int metrics_format(metrics_set_t *set, char *buf, size_t size) {
+  struct output o = {buf, size, 0};
+  struct metrics capture, workers, rtp, shm;
+  sum(set, &capture, 0, 0);
+  sum(set, &workers, 1, MAX_WORKERS);
+  sum(set, &rtp, 1 + MAX_WORKERS, 1 + MAX_WORKERS);
+  sum(set, &shm, 2 + MAX_WORKERS, 2 + MAX_WORKERS);
+
+  out(&o, "# TYPE mjpeg2http_frames_captured_total counter\n"
+          "mjpeg2http_frames_captured_total %" PRIu64 "\n",
+      capture.frames_captured);
+  out(&o, "# TYPE mjpeg2http_frames_copied_total counter\n"
+          "mjpeg2http_frames_copied_total %" PRIu64 "\n",
+      capture.frames_copied);
+  out(&o, "# TYPE mjpeg2http_frames_sent_total counter\n"
+          "mjpeg2http_frames_sent_total %" PRIu64 "\n",
+      workers.frames_sent);
+  out(&o, "# TYPE mjpeg2http_frames_dropped_total counter\n");
+  for (int i = 0; i < DROP_REASONS; ++i)
+    out(&o, "mjpeg2http_frames_dropped_total{reason=\"%s\"} %" PRIu64 "\n",
+        g_drop_reason[i], capture.dropped[i] + workers.dropped[i]);
+  out(&o, "# TYPE mjpeg2http_bytes_sent_total counter\n"
+          "mjpeg2http_bytes_sent_total %" PRIu64 "\n",
+      workers.bytes_sent);
+  out(&o, "# TYPE mjpeg2http_shaped_bytes_total counter\n");
+  out(&o, "mjpeg2http_shaped_bytes_total{result=\"sent\"} %" PRIu64 "\n",
+      workers.bytes_shaped);
+  out(&o, "mjpeg2http_shaped_bytes_total{result=\"dropped\"} %" PRIu64 "\n",
+      workers.bytes_shaped_dropped);
+  out(&o, "# TYPE mjpeg2http_clients gauge\n"
+          "mjpeg2http_clients %" PRId64 "\n",
+      workers.clients);
+  out(&o, "# TYPE mjpeg2http_clients_authenticated gauge\n"
+          "mjpeg2http_clients_authenticated %" PRId64 "\n",
+      workers.clients_auth);
+
+  // frames waiting in the tx queue when a new one is enqueued
+  uint64_t count = 0, depth = 0;
+  out(&o, "# TYPE mjpeg2http_tx_queue_depth histogram\n");
+  for (int i = 0; i < METRICS_DEPTHS; ++i) {
+    count += workers.tx_queue_depth[i];
+    depth += i * workers.tx_queue_depth[i];
+    out(&o, "mjpeg2http_tx_queue_depth_bucket{le=\"%d\"} %" PRIu64 "\n", i,
+        count);
+  }
+  out(&o, "mjpeg2http_tx_queue_depth_bucket{le=\"+Inf\"} %" PRIu64 "\n",
+      count);
+  out(&o, "mjpeg2http_tx_queue_depth_sum %" PRIu64 "\n", depth);
+  out(&o, "mjpeg2http_tx_queue_depth_count %" PRIu64 "\n", count);
+
+  out(&o, "# TYPE mjpeg2http_worker_syscalls_total counter\n"
+          "mjpeg2http_worker_syscalls_total %" PRIu64 "\n",
+      workers.syscalls);
+
+  out(&o, "# TYPE mjpeg2http_rtp_frames_sent_total counter\n"
+          "mjpeg2http_rtp_frames_sent_total %" PRIu64 "\n",
+      rtp.rtp_frames);
+  out(&o, "# TYPE mjpeg2http_rtp_packets_sent_total counter\n"
+          "mjpeg2http_rtp_packets_sent_total %" PRIu64 "\n",
+      rtp.rtp_packets);
+  out(&o, "# TYPE mjpeg2http_rtp_bytes_sent_total counter\n"
+          "mjpeg2http_rtp_bytes_sent_total %" PRIu64 "\n",
+      rtp.rtp_bytes);
+  out(&o, "# TYPE mjpeg2http_shm_frames_total counter\n"
+          "mjpeg2http_shm_frames_total %" PRIu64 "\n",
+      shm.shm_frames);
+  out(&o, "# TYPE mjpeg2http_shm_consumers gauge\n"
+          "mjpeg2http_shm_consumers %" PRId64 "\n",
+      shm.shm_consumers);
+
+  out(&o, "# TYPE mjpeg2http_frame_latency_seconds histogram\n");
+  for (int s = 0; s < LATENCY_STAGES; ++s) {
+    char label[32];
+    snprintf(label, sizeof(label), "stage=\"%s\"", g_stage[s]);
+    workers.latency[s].sum += capture.latency[s].sum;
+    for (int i = 0; i < METRICS_BUCKETS; ++i)
+      workers.latency[s].bucket[i] += capture.latency[s].bucket[i];
+    histogram(&o, "mjpeg2http_frame_latency_seconds", label,
+              &workers.latency[s]);
+  }
+  out(&o, "# TYPE mjpeg2http_loop_iteration_seconds histogram\n");
+  histogram(&o, "mjpeg2http_loop_iteration_seconds", "thread=\"capture\"",
+            &capture.loop);
+  histogram(&o, "mjpeg2http_loop_iteration_seconds", "thread=\"worker\"",
+            &workers.loop);
+
+  return o.pos < size ? (int)o.pos : -1;
+}
@@ -0,0 +1,122 @@
+/**
+ *  mjpeg2http
+ *
+ *  Copyright (c) 2022 Antonino Nolano. Licensed under the MIT license, as
+ * follows:
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "constants.h"
+
+#define METRICS_BUCKETS 18 /* le 16us .. 2^20us and +Inf */
+#define METRICS_DEPTHS (TX_RING_SIZE + 1) /* every depth of a tx queue */
+
+enum drop_reason {
+  DROP_RING_FULL,   /* a worker did not consume the ring in time */
+  DROP_TX_QUEUE,    /* tx queue of the client is full */
+  DROP_LATEST,      /* replaced by a fresher frame (TX_LATEST) */
+  DROP_DECIMATION,  /* skipped by the adaptive frame rate */
+  DROP_TOO_LARGE,   /* above the configured max_frame_size */
+  DROP_SHAPED,      /* over the client or server bandwidth budget */
+  DROP_NO_MEMORY,   /* pushed by the application, no memory to copy it */
+  DROP_REASONS,
+};
+
+/* where the time of a frame goes */
+enum latency_stage {
+  STAGE_CAPTURE, /* capture to published: driver and capture thread */
+  STAGE_QUEUE,   /* published to first byte sent: ring and tx queue */
+  STAGE_SEND,    /* first to last byte sent: network */
+  STAGE_TOTAL,   /* capture to last byte sent */
+  LATENCY_STAGES,
+};
+
+struct histogram {
+  uint64_t bucket[METRICS_BUCKETS];
+  uint64_t sum; /* usec */
+};
+
+/*
+ * counters of one thread: only the owner writes them (relaxed stores, no
+ * locked instructions), the scrape reads all of them with relaxed loads
+ */
+struct metrics {
+  uint64_t frames_captured;
+  uint64_t frames_copied; /* source short of buffers, not sent in place */
+  uint64_t frames_sent;
+  uint64_t bytes_sent;
+  uint64_t bytes_shaped;         /* frames written under a budget */
+  uint64_t bytes_shaped_dropped; /* skipped over a budget, or replaced */
+  uint64_t dropped[DROP_REASONS];
+  int64_t clients;
+  int64_t clients_auth;
+  uint64_t tx_queue_depth[METRICS_DEPTHS];
+  uint64_t syscalls; /* frame delivery: wait, notify, send, enter */
+  uint64_t rtp_frames;
+  uint64_t rtp_packets;
+  uint64_t rtp_bytes;
+  uint64_t shm_frames;
+  int64_t shm_consumers;
+  struct histogram latency[LATENCY_STAGES];
+  struct histogram loop;    /* event loop iteration */
+} __attribute__((aligned(64)));
+
+enum metrics_thread { METRICS_CAPTURE, METRICS_WORKER, METRICS_RTP,
+                     METRICS_SHM };
+
+/* counters of one server: capture, workers, rtp and shm threads */
+typedef struct metrics_set {
+  struct metrics slot[1 + MAX_WORKERS + 2];
+} metrics_set_t;
+
+// counters of the calling thread, a dummy block until metrics_register
+extern __thread struct metrics *t_metrics;
+
+// a NULL set keeps the dummy block
+void metrics_register(metrics_set_t *set, enum metrics_thread type, int id);
+// Prometheus text format, returns the length or -1 if size is too small
+int metrics_format(metrics_set_t *set, char *buf, size_t size);
+
+#define metrics_add(field, n)                                                  \
+  __atomic_store_n(&t_metrics->field, t_metrics->field + (n),                  \
+                   __ATOMIC_RELAXED)
+
+static inline uint64_t metrics_usec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static inline void metrics_observe(struct histogram *h, uint64_t usec) {
+  int i = usec <= 16 ? 0 : 64 - __builtin_clzll(usec - 1) - 4;
+  if (i >= METRICS_BUCKETS)
+    i = METRICS_BUCKETS - 1;
+  __atomic_store_n(&h->bucket[i], h->bucket[i] + 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&h->sum, h->sum + usec, __ATOMIC_RELAXED);
+}
+
+#endif
@@ -0,0 +1,138 @@
+/**
+ *  mjpeg2http
+ *
+ *  Copyright (c) 2022 Antonino Nolano. Licensed under the MIT license, as
+ * follows:
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <stddef.h>
+#include <stdlib.h>
+
+#include "pool.h"
+
+struct slab;
+
+struct block {
+  struct slab *slab;
+  union {
+    struct block *next; /* while free */
+    uint64_t align;
+  } u;
+};
+
+struct slab {
+  struct dlist node;
+  struct block *free_list;
+  uint32_t used;
+};
+
+#define BLOCK_HEADER_SIZE offsetof(struct block, u)
+#define block_data(b) ((uint8_t *)(b) + BLOCK_HEADER_SIZE)
+#define data_block(d) ((struct block *)((uint8_t *)(d)-BLOCK_HEADER_SIZE))
+
+static uint32_t block_stride(pool_t *p) {
+  uint32_t stride = BLOCK_HEADER_SIZE + p->block_size;
+  if (stride < sizeof(struct block))
+    stride = sizeof(struct block);
+  return (stride + 7) & ~7u;
+}
+
+void pool_init(pool_t *p, uint32_t block_size, uint32_t blocks_per_slab) {
+  p->block_size = block_size;
+  p->blocks_per_slab = blocks_per_slab;
+  p->slabs = p->used = 0;
+  init_list_entry(&p->partial);
+  init_list_entry(&p->full);
+}
+
+static struct slab *pool_new_slab(pool_t *p) {
+  uint32_t stride = block_stride(p);
+  struct slab *s = malloc(sizeof(struct slab) + stride * p->blocks_per_slab);
+  if (s == NULL)
+    return NULL;
+  uint8_t *start = (uint8_t *)(s + 1);
+  s->free_list = NULL;
+  s->used = 0;
+  for (int i = p->blocks_per_slab - 1; i >= 0; --i) {
+    struct block *b = (struct block *)(start + i * stride);
+    b->slab = s;
+    b->u.next = s->free_list;
+    s->free_list = b;
+  }
+  list_add_right(&s->node, &p->partial);
+  ++p->slabs;
+  return s;
+}
+
+void *pool_get(pool_t *p) {
+  struct slab *s;
+  if (list_empty(&p->partial)) {
+    if ((s = pool_new_slab(p)) == NULL)
+      return NULL;
+  } else {
+    s = list_get_entry(list_get_first(&p->partial), struct slab, node);
+  }
+
+  struct block *b = s->free_list;
+  s->free_list = b->u.next;
+  ++s->used;
+  ++p->used;
+
+  if (s->free_list == NULL) {
+    list_del(&s->node);
+    list_add_right(&s->node, &p->full);
+  }
+  return block_data(b);
+}
+
+void pool_put(pool_t *p, void *data) {
+  struct block *b = data_block(data);
+  struct slab *s = b->slab;
+
+  if (s->free_list == NULL) {
+    list_del(&s->node);
+    list_add_right(&s->node, &p->partial);
+  }
+  b->u.next = s->free_list;
+  s->free_list = b;
+  --p->used;
+
+  // keep the last slab around so that a single connection coming and going
+  // does not hit malloc every time
+  if (--s->used == 0 && p->slabs > 1) {
+    list_del(&s->node);
+    free(s);
+    --p->slabs;
+  }
+}
+
+void pool_destroy(pool_t *p) {
+  struct dlist *itr, *save;
+  list_iterate_safe(itr, save, &p->partial) {
+    list_del(itr);
+    free(list_get_entry(itr, struct slab, node));
+  }
+  list_iterate_safe(itr, save, &p->full) {
+    list_del(itr);
+    free(list_get_entry(itr, struct slab, node));
+  }
+  p->slabs = p->used = 0;
+}
@@ -0,0 +1,51 @@
+/**
+ *  mjpeg2http
+ *
+ *  Copyright (c) 2022 Antonino Nolano. Licensed under the MIT license, as
+ * follows:
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdint.h>
+
+#include "list.h"
+
+/*
+ * fixed-size block allocator: blocks are carved from slabs and an empty slab
+ * is given back to the system unless it is the last one
+ */
+typedef struct {
+  uint32_t block_size;
+  uint32_t blocks_per_slab;
+  uint32_t slabs;
+  uint32_t used;
+  struct dlist partial; /* slabs with at least one free block */
+  struct dlist full;    /* slabs without free blocks */
+} pool_t;
+
+void pool_init(pool_t *pool, uint32_t block_size, uint32_t blocks_per_slab);
+void *pool_get(pool_t *pool);
+void pool_put(pool_t *pool, void *block);
+void pool_destroy(pool_t *pool);
+
+#endif
@@ -46,6 +46,7 @@
   "Content-Type: image/jpeg\r\n"                                               \
   "Content-Length: %d\r\n"                                                     \
   "X-Timestamp: %d.%06d\r\n"                                                   \
+  "X-Sequence: %u\r\n"                                                         \
   "\r\n"
 
 #define END_FRAME "\r\n--" BOUNDARY "\r\n"
@@ -57,12 +58,56 @@
   "not authorized\r\n"                                                         \
   "\r\n"
 
-const char *welcome = FIRST_MESSAGE;
-const int welcome_len = strlen(FIRST_MESSAGE);
-const char *welcome_ko = UNAUTHORIZED_MESSAGE;
-const int welcome_ko_len = strlen(UNAUTHORIZED_MESSAGE);
-const char *frame_header = FRAME_HEADER;
-const char *end_frame = END_FRAME;
-const int end_frame_len = strlen(END_FRAME);
+/* responses other than the stream may keep the connection open */
+#define CONNECTION_CLOSE "close"
+#define CONNECTION_KEEP_ALIVE "keep-alive"
+
+#define NOT_FOUND_MESSAGE(connection)                                          \
+  "HTTP/1.1 404 Not Found\r\n"                                                 \
+  "Connection: " connection "\r\n"                                             \
+  "Content-Length: 0\r\n"                                                      \
+  "\r\n"
+
+#define METRICS_HEADER                                                         \
+  "HTTP/1.1 200 OK\r\n"                                                        \
+  "Connection: %s\r\n"                                                         \
+  "Content-Type: text/plain; version=0.0.4\r\n"                                \
+  "Content-Length: %d\r\n"                                                     \
+  "\r\n"
+
+#define SNAPSHOT_HEADER                                                        \
+  "HTTP/1.1 200 OK\r\n"                                                        \
+  "Connection: %s\r\n"                                                         \
+  "Cache-Control: no-store\r\n"
+
+#define SNAPSHOT_UNAVAILABLE(connection)                                       \
+  "HTTP/1.1 503 Service Unavailable\r\n"                                       \
+  "Connection: " connection "\r\n"                                             \
+  "Retry-After: 1\r\n"                                                         \
+  "Content-Length: 0\r\n"                                                      \
+  "\r\n"
+
+static const char welcome[] = FIRST_MESSAGE;
+static const int welcome_len = sizeof(FIRST_MESSAGE) - 1;
+static const char welcome_ko[] = UNAUTHORIZED_MESSAGE;
+static const int welcome_ko_len = sizeof(UNAUTHORIZED_MESSAGE) - 1;
+static const char frame_header[] = FRAME_HEADER;
+static const char end_frame[] = END_FRAME;
+static const char metrics_header[] = METRICS_HEADER;
+static const char snapshot_header[] = SNAPSHOT_HEADER;
+static const char *const connection_header[] = {CONNECTION_CLOSE,
+                                                CONNECTION_KEEP_ALIVE};
+static const char snapshot_ko[] = SNAPSHOT_UNAVAILABLE(CONNECTION_CLOSE);
+static const int snapshot_ko_len = sizeof(snapshot_ko) - 1;
+static const char snapshot_ko_keep_alive[] =
+    SNAPSHOT_UNAVAILABLE(CONNECTION_KEEP_ALIVE);
+static const int snapshot_ko_keep_alive_len =
+    sizeof(snapshot_ko_keep_alive) - 1;
+static const char not_found[] = NOT_FOUND_MESSAGE(CONNECTION_CLOSE);
+static const int not_found_len = sizeof(not_found) - 1;
+static const char not_found_keep_alive[] =
+    NOT_FOUND_MESSAGE(CONNECTION_KEEP_ALIVE);
+static const int not_found_keep_alive_len = sizeof(not_found_keep_alive) - 1;
+static const int end_frame_len = sizeof(END_FRAME) - 1;
 
 #endif
@@ -0,0 +1,350 @@
+/**
+ *  mjpeg2http
+ *
+ *  Copyright (c) 2022 Antonino Nolano. Licensed under the MIT license, as
+ * follows:
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "constants.h"
+#include "libmjpeg2http.h"
+#include "source.h"
+
+/*
+ * push source: frames sent by a local producer (vendor SDK, GStreamer...)
+ * over a SOCK_SEQPACKET unix socket, one frame per message. A message is a
+ * mjpeg2http_push_t followed by the JPEG, or carries a descriptor with
+ * SCM_RIGHTS holding the JPEG from offset 0, which is mapped instead of
+ * copied when it is a memfd sealed against shrinking and writes. The
+ * producer gets START and STOP as the camera is turned on and off.
+ * source->fd is an epoll set of the listening socket and the producer
+ * connection
+ */
+
+struct push_buffer {
+  uint8_t *data; /* received into, or the mapping of a passed descriptor */
+  size_t size;
+  uint8_t *map;
+  size_t maplen;
+  int busy; /* owned by the library until requeue */
+};
+
+struct push {
+  char path[108];
+  int epfd;
+  int listen_fd;
+  int producer;
+  int streaming;
+  struct push_buffer buffers[PUSH_BUFFERS];
+  int free; /* buffers not busy, changed by requeue from any thread */
+  uint32_t sequence;
+};
+
+static int push_control(struct push *p, uint32_t type) {
+  mjpeg2http_push_t msg = {type, 0, 0};
+  if (send(p->producer, &msg, sizeof(msg), MSG_NOSIGNAL | MSG_DONTWAIT) !=
+      sizeof(msg)) {
+    perror("push control");
+    return -1;
+  }
+  return 1;
+}
+
+static void push_hangup(struct push *p) {
+  printf("push %s: producer gone\n", p->path);
+  fflush(stdout);
+  close(p->producer); // leaves the epoll set as well
+  p->producer = -1;
+}
+
+// one producer at a time, it learns right away whether to send
+static void push_accept(struct push *p) {
+  int fd = accept4(p->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if (fd < 0)
+    return;
+  if (p->producer >= 0) {
+    printf("push %s: producer already connected -> reject\n", p->path);
+    fflush(stdout);
+    close(fd);
+    return;
+  }
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.fd = fd;
+  if (epoll_ctl(p->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    close(fd);
+    return;
+  }
+  p->producer = fd;
+  printf("push %s: producer connected\n", p->path);
+  fflush(stdout);
+  if (push_control(p, p->streaming ? MJPEG2HTTP_PUSH_START
+                                   : MJPEG2HTTP_PUSH_STOP) < 0)
+    push_hangup(p);
+}
+
+static int push_take_buffer(struct push *p) {
+  for (int i = 0; i < PUSH_BUFFERS; ++i) {
+    if (!__atomic_load_n(&p->buffers[i].busy, __ATOMIC_ACQUIRE)) {
+      p->buffers[i].busy = 1;
+      __atomic_sub_fetch(&p->free, 1, __ATOMIC_ACQ_REL);
+      return i;
+    }
+  }
+  return -1;
+}
+
+static void push_give_back(struct push *p, int index) {
+  struct push_buffer *b = &p->buffers[index];
+  if (b->map != NULL)
+    munmap(b->map, b->maplen);
+  b->map = NULL;
+  __atomic_store_n(&b->busy, 0, __ATOMIC_RELEASE);
+  __atomic_add_fetch(&p->free, 1, __ATOMIC_ACQ_REL);
+}
+
+// the message is dropped, a passed descriptor is closed by the kernel
+static void push_discard(struct push *p) {
+  recv(p->producer, NULL, 0, MSG_DONTWAIT | MSG_TRUNC);
+}
+
+static int push_reserve(struct push_buffer *b, size_t len) {
+  if (b->size >= len)
+    return 1;
+  uint8_t *data = realloc(b->data, len);
+  if (data == NULL)
+    return -1;
+  b->data = data;
+  b->size = len;
+  return 1;
+}
+
+// the JPEG of a passed descriptor is mapped when the producer can neither
+// shrink nor write it any more, otherwise it is copied: a mapping truncated
+// while clients send from it would kill the server with SIGBUS
+static int push_map(struct push_buffer *b, int fd, uint32_t len) {
+  const int seals = F_SEAL_SHRINK | F_SEAL_WRITE;
+  struct stat st;
+  int ret = -1;
+  if (len > 0 && len <= PUSH_MAX_FRAME_SIZE && fstat(fd, &st) == 0 &&
+      (uint64_t)st.st_size >= len) {
+    // -1 for files that cannot be sealed, e.g. on ext4
+    int sealed = fcntl(fd, F_GET_SEALS);
+    if (sealed >= 0 && (sealed & seals) == seals) {
+      b->map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+      if (b->map != MAP_FAILED) {
+        b->maplen = len;
+        ret = 1;
+      } else {
+        b->map = NULL;
+      }
+    } else if (push_reserve(b, len) > 0 &&
+               pread(fd, b->data, len, 0) == (ssize_t)len) {
+      ret = 1;
+    }
+  }
+  close(fd);
+  return ret;
+}
+
+static int push_receive(struct push *p, struct source_buffer *buffer) {
+  mjpeg2http_push_t msg;
+  // the size of the message is known before it is read
+  ssize_t size =
+      recv(p->producer, NULL, 0, MSG_PEEK | MSG_TRUNC | MSG_DONTWAIT);
+  if (size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    return 0;
+  if (size <= 0) {
+    push_hangup(p);
+    return 0;
+  }
+  if ((size_t)size < sizeof(msg) || size > PUSH_MAX_FRAME_SIZE) {
+    push_discard(p);
+    return 0;
+  }
+
+  int index = push_take_buffer(p);
+  if (index < 0) {
+    push_discard(p); // every buffer is still sent: the frame is dropped
+    return 0;
+  }
+  struct push_buffer *b = &p->buffers[index];
+  size_t len = size - sizeof(msg);
+  if (push_reserve(b, len) < 0) {
+    push_give_back(p, index);
+    push_discard(p);
+    return 0;
+  }
+
+  struct iovec iov[2] = {{&msg, sizeof(msg)}, {b->data, len}};
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } control;
+  struct msghdr mh = {0};
+  mh.msg_iov = iov;
+  mh.msg_iovlen = 2;
+  mh.msg_control = control.buf;
+  mh.msg_controllen = sizeof(control.buf);
+  if (recvmsg(p->producer, &mh, MSG_DONTWAIT | MSG_CMSG_CLOEXEC) != size) {
+    push_give_back(p, index);
+    return 0;
+  }
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+  int fd = -1;
+  if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET &&
+      cmsg->cmsg_type == SCM_RIGHTS)
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+  if (msg.type != MJPEG2HTTP_PUSH_FRAME ||
+      (fd >= 0 && push_map(b, fd, msg.len) < 0) ||
+      (fd < 0 && msg.len != len)) {
+    printf("push %s: invalid message\n", p->path);
+    fflush(stdout);
+    push_give_back(p, index);
+    return 0;
+  }
+
+  buffer->index = index;
+  buffer->start = b->map != NULL ? b->map : b->data;
+  buffer->bytesused = msg.len;
+  buffer->sequence = p->sequence++;
+  buffer->timestamp = msg.timestamp;
+  return 1;
+}
+
+static int push_dequeue(source_t *source, struct source_buffer *buffer) {
+  struct push *p = source->priv;
+  push_accept(p);
+  if (p->producer < 0)
+    return 0;
+  return push_receive(p, buffer);
+}
+
+static int push_requeue(source_t *source, int index) {
+  push_give_back(source->priv, index);
+  return 1;
+}
+
+static int push_queued(source_t *source) {
+  struct push *p = source->priv;
+  return __atomic_load_n(&p->free, __ATOMIC_ACQUIRE);
+}
+
+static int push_stream(source_t *source, int on) {
+  struct push *p = source->priv;
+  p->streaming = on;
+  if (p->producer < 0)
+    return 1;
+  // frames sent while the camera was off are stale
+  if (on) {
+    while (recv(p->producer, NULL, 0, MSG_DONTWAIT | MSG_TRUNC) > 0)
+      ;
+  }
+  if (push_control(p, on ? MJPEG2HTTP_PUSH_START : MJPEG2HTTP_PUSH_STOP) < 0)
+    push_hangup(p);
+  return 1;
+}
+
+static void push_close(source_t *source) {
+  struct push *p = source->priv;
+  if (p == NULL)
+    return;
+  if (p->producer >= 0)
+    close(p->producer);
+  if (p->listen_fd >= 0) {
+    close(p->listen_fd);
+    unlink(p->path);
+  }
+  for (int i = 0; i < PUSH_BUFFERS; ++i) {
+    if (p->buffers[i].map != NULL)
+      munmap(p->buffers[i].map, p->buffers[i].maplen);
+    free(p->buffers[i].data);
+  }
+  free(p);
+  if (source->fd >= 0)
+    close(source->fd);
+  source->fd = -1;
+  source->priv = NULL;
+}
+
+// location is unix:/path of the socket
+static int push_open(source_t *source, const char *location, int width,
+                     int height, int rate) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  struct push *p = calloc(1, sizeof(struct push));
+  if (p == NULL)
+    return -1;
+  source->priv = p;
+  p->producer = p->listen_fd = -1;
+  p->free = PUSH_BUFFERS;
+  source->fd = epoll_create1(EPOLL_CLOEXEC);
+  p->epfd = source->fd;
+  location += 5;
+  if (strlen(location) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "%s: path too long\n", location);
+    goto errorOnOpen;
+  }
+  snprintf(p->path, sizeof(p->path), "%s", location);
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", location);
+
+  p->listen_fd =
+      socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  unlink(location);
+  if (p->epfd < 0 || p->listen_fd < 0 ||
+      bind(p->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(p->listen_fd, 1) < 0) {
+    perror(location);
+    goto errorOnOpen;
+  }
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.fd = p->listen_fd;
+  if (epoll_ctl(p->epfd, EPOLL_CTL_ADD, p->listen_fd, &ev) < 0)
+    goto errorOnOpen;
+  return 1;
+
+errorOnOpen:
+  push_close(source);
+  return -1;
+}
+
+const struct source_ops push_source_ops = {
+    .name = "push",
+    .open = push_open,
+    .close = push_close,
+    .dequeue = push_dequeue,
+    .requeue = push_requeue,
+    .queued = push_queued,
+    .stream = push_stream,
+};
@@ -0,0 +1,510 @@
+/**
+ *  mjpeg2http
+ *
+ *  Copyright (c) 2022 Antonino Nolano. Licensed under the MIT license, as
+ * follows:
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "constants.h"
+#include "source.h"
+
+/*
+ * relay source: the frames of an upstream multipart/x-mixed-replace stream
+ * (e.g. another mjpeg2http) are cut out of the receive buffers and handed
+ * out as they are. One connection while the camera is on, reconnected with
+ * an exponential backoff. source->fd is an epoll set of the socket, a
+ * timerfd (backoff or stall watchdog) and an eventfd raised while the
+ * received data may hold another frame
+ */
+
+enum relay_state { RELAY_RESPONSE, RELAY_DELIMITER, RELAY_HEADERS, RELAY_BODY };
+
+struct relay_buffer {
+  uint8_t *data;
+  size_t size;
+  int busy; /* parsed into, or owned by the library until requeue */
+};
+
+struct relay {
+  char host[256];
+  char port[8];
+  char request[1024];
+  struct sockaddr_storage addr; /* resolved once, at open */
+  socklen_t addrlen;
+  int epfd;
+  int sock;
+  int connecting;
+  int timerfd;
+  int readyfd;
+  int backoff_ms;
+  struct relay_buffer buffers[RELAY_BUFFERS];
+  int free; /* buffers not busy, changed by requeue from any thread */
+
+  /* parser state, on buffers[cur] */
+  int cur;
+  size_t used, pos, scan;
+  enum relay_state state;
+  long length;       /* of the body, -1 without Content-Length */
+  char boundary[96]; /* "--" and the boundary */
+  size_t boundary_len;
+  uint32_t sequence;
+};
+
+static void relay_arm(struct relay *r, int ms) {
+  struct itimerspec its = {{0, 0}, {ms / 1000, (ms % 1000) * 1000000L}};
+  timerfd_settime(r->timerfd, 0, &its, NULL);
+}
+
+static void relay_disconnect(struct relay *r) {
+  if (r->sock >= 0)
+    close(r->sock); // leaves the epoll set as well
+  r->sock = -1;
+  r->connecting = 0;
+  r->state = RELAY_RESPONSE;
+  r->used = r->pos = r->scan = 0;
+  relay_arm(r, 0);
+}
+
+// the upstream is gone or broken: try again later, twice as late each time
+static void relay_retry(struct relay *r, const char *why) {
+  fprintf(stderr, "relay %s:%s %s, retry in %d ms\n", r->host, r->port, why,
+          r->backoff_ms);
+  relay_disconnect(r);
+  relay_arm(r, r->backoff_ms);
+  r->backoff_ms *= 2;
+  if (r->backoff_ms > RELAY_BACKOFF_MAX_MS)
+    r->backoff_ms = RELAY_BACKOFF_MAX_MS;
+}
+
+// non blocking connect, the request is sent once the socket is writable
+static void relay_connect(struct relay *r) {
+  r->sock = socket(r->addr.ss_family,
+                   SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (r->sock < 0 ||
+      (connect(r->sock, (struct sockaddr *)&r->addr, r->addrlen) < 0 &&
+       errno != EINPROGRESS)) {
+    relay_retry(r, strerror(errno));
+    return;
+  }
+
+  struct epoll_event ev;
+  ev.events = EPOLLOUT;
+  ev.data.fd = r->sock;
+  if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->sock, &ev) < 0) {
+    relay_retry(r, strerror(errno));
+    return;
+  }
+  r->connecting = 1;
+  relay_arm(r, RELAY_STALL_MS);
+}
+
+static int relay_connected(struct relay *r) {
+  int err = 0;
+  socklen_t len = sizeof(err);
+  getsockopt(r->sock, SOL_SOCKET, SO_ERROR, &err, &len);
+  if (err != 0) {
+    relay_retry(r, strerror(err));
+    return -1;
+  }
+  size_t n = strlen(r->request);
+  if (write(r->sock, r->request, n) != (ssize_t)n) {
+    relay_retry(r, "request not sent");
+    return -1;
+  }
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.fd = r->sock;
+  epoll_ctl(r->epfd, EPOLL_CTL_MOD, r->sock, &ev);
+  r->connecting = 0;
+  return 1;
+}
+
+// buffer to parse into, -1 if the library holds all of them
+static int relay_take_buffer(struct relay *r) {
+  for (int i = 0; i < RELAY_BUFFERS; ++i) {
+    if (!__atomic_load_n(&r->buffers[i].busy, __ATOMIC_ACQUIRE)) {
+      r->buffers[i].busy = 1;
+      __atomic_sub_fetch(&r->free, 1, __ATOMIC_ACQ_REL);
+      return i;
+    }
+  }
+  return -1;
+}
+
+// "multipart/x-mixed-replace;boundary=xyz": parts start with "--xyz", some
+// servers put the dashes into the boundary already
+static int relay_response(struct relay *r, char *headers) {
+  if (strncmp(headers, "HTTP/1.", 7) != 0 || strncmp(headers + 8, " 200", 4))
+    return -1;
+  char *b = strcasestr(headers, "boundary=");
+  if (b == NULL)
+    return -1;
+  b += 9;
+  if (*b == '"')
+    ++b;
+  while (*b == '-')
+    ++b;
+  size_t len = strcspn(b, "\"; \r\n");
+  if (len == 0 || len + 2 >= sizeof(r->boundary))
+    return -1;
+  r->boundary_len = snprintf(r->boundary, sizeof(r->boundary), "--%.*s",
+                             (int)len, b);
+  return 1;
+}
+
+static long relay_content_length(char *headers) {
+  char *cl = strcasestr(headers, "Content-Length:");
+  return cl != NULL ? strtol(cl + 15, NULL, 10) : -1;
+}
+
+// 1 when a frame is complete at [*start, *start + *length) of the current
+// buffer, 0 when more data is needed, -1 if the stream is not valid
+static int relay_parse(struct relay *r, size_t *start, size_t *length) {
+  uint8_t *data = r->buffers[r->cur].data;
+  for (;;) {
+    uint8_t *p = data + r->pos, *end;
+    size_t left = r->used - r->pos;
+    switch (r->state) {
+    case RELAY_RESPONSE:
+    case RELAY_HEADERS:
+      // a part may come without headers
+      if (r->state == RELAY_HEADERS && left >= 2 && p[0] == '\r' &&
+          p[1] == '\n') {
+        r->length = -1;
+        r->state = RELAY_BODY;
+        r->pos = r->scan = r->pos + 2;
+        break;
+      }
+      if ((end = memmem(p, left, "\r\n\r\n", 4)) == NULL)
+        return left > RELAY_MAX_HEADERS ? -1 : 0;
+      *end = 0;
+      if (r->state == RELAY_RESPONSE) {
+        if (relay_response(r, (char *)p) < 0)
+          return -1;
+        r->state = RELAY_DELIMITER;
+      } else {
+        r->length = relay_content_length((char *)p);
+        r->state = RELAY_BODY;
+      }
+      r->pos = r->scan = end + 4 - data;
+      break;
+
+    case RELAY_DELIMITER:
+      end = memmem(p, left, r->boundary, r->boundary_len);
+      if (end == NULL) {
+        // garbage between the parts, only a cut delimiter is kept
+        if (left > r->boundary_len)
+          r->pos = r->used - r->boundary_len;
+        return 0;
+      }
+      if ((end = memchr(end, '\n', data + r->used - end)) == NULL)
+        return 0;
+      r->pos = end + 1 - data;
+      r->state = RELAY_HEADERS;
+      break;
+
+    case RELAY_BODY:
+      *start = r->pos;
+      if (r->length >= 0) {
+        // Content-Length: nothing to scan
+        if (left < (size_t)r->length)
+          return r->length > RELAY_MAX_FRAME_SIZE ? -1 : 0;
+        *length = r->length;
+        r->pos += r->length;
+      } else {
+        // the body ends with "\r\n--boundary", scanned only once
+        end = memmem(data + r->scan, r->used - r->scan, r->boundary,
+                     r->boundary_len);
+        if (end == NULL) {
+          if (r->used - r->scan > r->boundary_len)
+            r->scan = r->used - r->boundary_len;
+          return 0;
+        }
+        r->pos = end - data;
+        *length = r->pos - *start;
+        if (*length >= 2 && end[-2] == '\r' && end[-1] == '\n')
+          *length -= 2;
+      }
+      r->state = RELAY_DELIMITER;
+      return 1;
+    }
+  }
+}
+
+// room for the next read: parsed bytes are dropped, then the buffer grows
+static int relay_make_room(struct relay *r) {
+  struct relay_buffer *b = &r->buffers[r->cur];
+  if (b->size - r->used >= RELAY_READ_SIZE)
+    return 1;
+  if (r->pos > 0) {
+    memmove(b->data, b->data + r->pos, r->used - r->pos);
+    r->used -= r->pos;
+    r->scan -= r->pos;
+    r->pos = 0;
+  }
+  if (b->size - r->used >= RELAY_READ_SIZE)
+    return 1;
+  if (b->size >= RELAY_MAX_FRAME_SIZE)
+    return -1;
+  uint8_t *data = realloc(b->data, b->size * 2);
+  if (data == NULL)
+    return -1;
+  b->data = data;
+  b->size *= 2;
+  return 1;
+}
+
+// the frame stays in its buffer, what follows it moves to a free one
+static int relay_hand_out(struct relay *r, size_t start, size_t length,
+                          struct source_buffer *buffer) {
+  int next = relay_take_buffer(r);
+  if (next < 0)
+    return 0; // every buffer is still sent: the frame is dropped
+
+  struct relay_buffer *b = &r->buffers[next];
+  size_t left = r->used - r->pos;
+  if (b->size < left) {
+    uint8_t *data = realloc(b->data, left);
+    if (data == NULL) {
+      b->busy = 0;
+      __atomic_add_fetch(&r->free, 1, __ATOMIC_ACQ_REL);
+      return 0;
+    }
+    b->data = data;
+    b->size = left;
+  }
+  memcpy(b->data, r->buffers[r->cur].data + r->pos, left);
+
+  buffer->index = r->cur;
+  buffer->start = r->buffers[r->cur].data + start;
+  buffer->bytesused = length;
+  buffer->sequence = r->sequence++;
+  buffer->timestamp = 0; // received now
+  r->cur = next;
+  r->used = left;
+  r->pos = r->scan = 0;
+  return 1;
+}
+
+static int relay_dequeue(source_t *source, struct source_buffer *buffer) {
+  struct relay *r = source->priv;
+  uint64_t n;
+
+  // backoff over or no frame for too long
+  if (read(r->timerfd, &n, sizeof(n)) > 0) {
+    if (r->sock >= 0)
+      relay_retry(r, "stalled");
+    else
+      relay_connect(r);
+    return 0;
+  }
+  if (r->sock < 0)
+    return 0;
+  if (r->connecting && relay_connected(r) < 0)
+    return 0;
+  if (read(r->readyfd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+    return -1;
+
+  for (;;) {
+    size_t start, length;
+    int ret = relay_parse(r, &start, &length);
+    if (ret < 0) {
+      relay_retry(r, "sent an invalid stream");
+      return 0;
+    }
+    if (ret > 0 && relay_hand_out(r, start, length, buffer) > 0) {
+      r->backoff_ms = RELAY_BACKOFF_MIN_MS;
+      relay_arm(r, RELAY_STALL_MS);
+      // the rest may hold the next frame already
+      if (r->used > 0 && write(r->readyfd, &(uint64_t){1}, sizeof(n)) < 0)
+        return -1;
+      return 1;
+    }
+    if (ret > 0)
+      continue;
+
+    if (relay_make_room(r) < 0) {
+      relay_retry(r, "sent a frame too large");
+      return 0;
+    }
+    struct relay_buffer *b = &r->buffers[r->cur];
+    ssize_t got = read(r->sock, b->data + r->used, RELAY_READ_SIZE);
+    if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return 0;
+    if (got <= 0) {
+      relay_retry(r, got == 0 ? "closed" : strerror(errno));
+      return 0;
+    }
+    r->used += got;
+  }
+}
+
+static int relay_requeue(source_t *source, int index) {
+  struct relay *r = source->priv;
+  __atomic_store_n(&r->buffers[index].busy, 0, __ATOMIC_RELEASE);
+  __atomic_add_fetch(&r->free, 1, __ATOMIC_ACQ_REL);
+  return 1;
+}
+
+static int relay_queued(source_t *source) {
+  struct relay *r = source->priv;
+  return __atomic_load_n(&r->free, __ATOMIC_ACQUIRE);
+}
+
+static int relay_stream(source_t *source, int on) {
+  struct relay *r = source->priv;
+  if (on && r->sock < 0) {
+    r->backoff_ms = RELAY_BACKOFF_MIN_MS;
+    relay_connect(r);
+  } else if (!on) {
+    relay_disconnect(r);
+  }
+  return 1;
+}
+
+static void relay_close(source_t *source) {
+  struct relay *r = source->priv;
+  if (r == NULL)
+    return;
+  if (r->sock >= 0)
+    close(r->sock);
+  if (r->timerfd >= 0)
+    close(r->timerfd);
+  if (r->readyfd >= 0)
+    close(r->readyfd);
+  for (int i = 0; i < RELAY_BUFFERS; ++i)
+    free(r->buffers[i].data);
+  free(r);
+  if (source->fd >= 0)
+    close(source->fd);
+  source->fd = -1;
+  source->priv = NULL;
+}
+
+// http://host[:port]/path?token
+static int relay_split_url(struct relay *r, const char *url) {
+  const char *host = url + 7, *path = strchr(host, '/');
+  if (path == NULL)
+    path = "/";
+  int len = path > host ? path - host : (int)strlen(host);
+  const char *colon = memchr(host, ':', len);
+  int hostlen = colon != NULL ? colon - host : len;
+  if (hostlen == 0 || hostlen >= (int)sizeof(r->host))
+    return -1;
+  snprintf(r->host, sizeof(r->host), "%.*s", hostlen, host);
+  if (colon != NULL)
+    snprintf(r->port, sizeof(r->port), "%.*s", len - hostlen - 1, colon + 1);
+  else
+    snprintf(r->port, sizeof(r->port), "80");
+  int n = snprintf(r->request, sizeof(r->request),
+                   "GET %s HTTP/1.0\r\nHost: %.*s\r\n\r\n", path, len, host);
+  return n < (int)sizeof(r->request) ? 1 : -1;
+}
+
+// blocking, so done at open rather than on each reconnect of the capture
+// thread: the first address of the upstream is the one retried
+static int relay_resolve(struct relay *r) {
+  struct addrinfo hints, *ai;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  int ret = getaddrinfo(r->host, r->port, &hints, &ai);
+  if (ret != 0) {
+    fprintf(stderr, "relay %s:%s %s\n", r->host, r->port, gai_strerror(ret));
+    return -1;
+  }
+  memcpy(&r->addr, ai->ai_addr, ai->ai_addrlen);
+  r->addrlen = ai->ai_addrlen;
+  freeaddrinfo(ai);
+  return 1;
+}
+
+static int relay_open(source_t *source, const char *location, int width,
+                      int height, int rate) {
+  struct relay *r = calloc(1, sizeof(struct relay));
+  if (r == NULL)
+    return -1;
+  source->priv = r;
+  r->sock = r->timerfd = r->readyfd = -1;
+  r->backoff_ms = RELAY_BACKOFF_MIN_MS;
+  source->fd = epoll_create1(EPOLL_CLOEXEC);
+  if (relay_split_url(r, location) < 0) {
+    fprintf(stderr, "%s: not a valid url\n", location);
+    goto errorOnOpen;
+  }
+  if (relay_resolve(r) < 0)
+    goto errorOnOpen;
+
+  r->epfd = source->fd;
+  r->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  r->readyfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (source->fd < 0 || r->timerfd < 0 || r->readyfd < 0) {
+    perror("relay");
+    goto errorOnOpen;
+  }
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.fd = r->timerfd;
+  if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->timerfd, &ev) < 0)
+    goto errorOnOpen;
+  ev.data.fd = r->readyfd;
+  if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->readyfd, &ev) < 0)
+    goto errorOnOpen;
+
+  for (int i = 0; i < RELAY_BUFFERS; ++i) {
+    r->buffers[i].size = RELAY_BUFFER_SIZE;
+    if ((r->buffers[i].data = malloc(RELAY_BUFFER_SIZE)) == NULL)
+      goto errorOnOpen;
+  }
+  r->cur = 0;
+  r->buffers[0].busy = 1;
+  r->free = RELAY_BUFFERS - 1;
+
+  fprintf(stderr, "relay %s:%s %.*s\n", r->host, r->port,
+          (int)strcspn(r->request, "\r"), r->request);
+  return 1;
+
+errorOnOpen:
+  relay_close(source);
+  return -1;
+}
+
+const struct source_ops relay_source_ops = {
+    .name = "relay",
+    .open = relay_open,
+    .close = relay_close,
+    .dequeue = relay_dequeue,
+    .requeue = relay_requeue,
+    .queued = relay_queued,
+    .stream = relay_stream,
+};
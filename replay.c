@@ -0,0 +1,311 @@
+/**
+ *  mjpeg2http
+ *
+ *  Copyright (c) 2022 Antonino Nolano. Licensed under the MIT license, as
+ * follows:
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "source.h"
+
+/*
+ * replay source: JPEG files of a directory (e.g. written by dump2file) or
+ * a concatenated MJPEG file (or FIFO, read until its writer closes it) are
+ * loaded in memory and emitted in a loop at
+ * a fixed rate driven by a timerfd, or as fast as possible
+ */
+
+struct mapping {
+  void *addr;
+  size_t length;
+  int heap; // read from a FIFO instead of mapped
+};
+
+struct replay_frame {
+  uint8_t *start;
+  uint32_t length;
+};
+
+struct replay {
+  struct mapping *maps;
+  int nmaps;
+  struct replay_frame *frames;
+  int nframes;
+  int next;
+  int fps;
+  uint32_t sequence;
+};
+
+static int add_frame(struct replay *r, uint8_t *start, uint32_t length) {
+  if ((r->nframes & 63) == 0) {
+    void *frames =
+        realloc(r->frames, (r->nframes + 64) * sizeof(struct replay_frame));
+    if (frames == NULL)
+      return -1;
+    r->frames = frames;
+  }
+  r->frames[r->nframes].start = start;
+  r->frames[r->nframes].length = length;
+  ++r->nframes;
+  return 1;
+}
+
+// a FIFO cannot be mapped, it is read up to the writer's end
+static void *read_fifo(int fd, size_t *length) {
+  size_t size = 1 << 20, used = 0;
+  uint8_t *data = malloc(size);
+  while (data != NULL) {
+    ssize_t n = read(fd, data + used, size - used);
+    if (n <= 0) {
+      if (n < 0)
+        perror("read");
+      break;
+    }
+    used += n;
+    if (used == size) {
+      uint8_t *bigger = realloc(data, size * 2);
+      if (bigger == NULL)
+        break;
+      data = bigger;
+      size *= 2;
+    }
+  }
+  *length = used;
+  return data;
+}
+
+static void *map_file(struct replay *r, const char *path, size_t *length) {
+  struct stat st;
+  void *addr;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    perror(path);
+    return NULL;
+  }
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    return NULL;
+  }
+  int heap = S_ISFIFO(st.st_mode);
+  if (heap) {
+    addr = read_fifo(fd, length);
+    close(fd);
+    if (addr == NULL || *length == 0) {
+      free(addr);
+      return NULL;
+    }
+  } else {
+    *length = st.st_size;
+    addr = *length == 0 ? MAP_FAILED
+                        : mmap(NULL, *length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+      perror(path);
+      return NULL;
+    }
+  }
+
+  void *maps = realloc(r->maps, (r->nmaps + 1) * sizeof(struct mapping));
+  if (maps == NULL) {
+    if (heap)
+      free(addr);
+    else
+      munmap(addr, *length);
+    return NULL;
+  }
+  r->maps = maps;
+  r->maps[r->nmaps].addr = addr;
+  r->maps[r->nmaps].length = *length;
+  r->maps[r->nmaps].heap = heap;
+  ++r->nmaps;
+  return addr;
+}
+
+// every frame goes from SOI to an EOI followed by the next SOI or the end
+static int split_mjpeg(struct replay *r, uint8_t *data, size_t length) {
+  size_t pos = 0;
+  for (;;) {
+    uint8_t *soi = memmem(data + pos, length - pos, "\xff\xd8\xff", 3);
+    if (soi == NULL)
+      return 1;
+    size_t start = soi - data, end = start + 3;
+    for (;;) {
+      uint8_t *eoi = memmem(data + end, length - end, "\xff\xd9", 2);
+      if (eoi == NULL)
+        return 1; // truncated frame
+      end = eoi - data + 2;
+      if (end == length || (end + 1 < length && data[end] == 0xff &&
+                            data[end + 1] == 0xd8))
+        break;
+    }
+    if (add_frame(r, data + start, end - start) < 0)
+      return -1;
+    pos = end;
+  }
+}
+
+static int is_jpeg(const struct dirent *entry) {
+  const char *dot = strrchr(entry->d_name, '.');
+  return dot != NULL &&
+         (strcasecmp(dot, ".jpeg") == 0 || strcasecmp(dot, ".jpg") == 0);
+}
+
+static int load_directory(struct replay *r, const char *path) {
+  struct dirent **names;
+  char file[PATH_MAX];
+  int n = scandir(path, &names, is_jpeg, versionsort);
+  if (n < 0) {
+    perror(path);
+    return -1;
+  }
+  int ret = 1;
+  for (int i = 0; i < n; ++i) {
+    size_t length;
+    if (snprintf(file, sizeof(file), "%s/%s", path, names[i]->d_name) <
+        (int)sizeof(file)) {
+      uint8_t *data = map_file(r, file, &length);
+      if (data != NULL && add_frame(r, data, length) < 0)
+        ret = -1;
+    }
+    free(names[i]);
+  }
+  free(names);
+  return ret;
+}
+
+static void replay_close(source_t *source) {
+  struct replay *r = source->priv;
+  if (r == NULL)
+    return;
+  for (int i = 0; i < r->nmaps; ++i) {
+    if (r->maps[i].heap)
+      free(r->maps[i].addr);
+    else
+      munmap(r->maps[i].addr, r->maps[i].length);
+  }
+  free(r->maps);
+  free(r->frames);
+  free(r);
+  if (source->fd >= 0)
+    close(source->fd);
+  source->priv = NULL;
+}
+
+static int replay_open(source_t *source, const char *location, int width,
+                       int height, int rate) {
+  char path[PATH_MAX];
+  struct stat st;
+  int fps = source_split_rate(location, path, sizeof(path));
+
+  struct replay *r = calloc(1, sizeof(struct replay));
+  if (r == NULL)
+    return -1;
+  r->fps = fps >= 0 ? fps : rate;
+  source->priv = r;
+  source->fd = -1;
+
+  if (stat(path, &st) < 0) {
+    perror(path);
+    goto errorOnLoad;
+  }
+  if (S_ISDIR(st.st_mode)) {
+    if (load_directory(r, path) < 0)
+      goto errorOnLoad;
+  } else {
+    size_t length;
+    uint8_t *data = map_file(r, path, &length);
+    if (data == NULL || split_mjpeg(r, data, length) < 0)
+      goto errorOnLoad;
+  }
+  if (r->nframes == 0) {
+    fprintf(stderr, "%s: no jpeg frames found\n", path);
+    goto errorOnLoad;
+  }
+
+  if (r->fps > 0) {
+    source->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    struct itimerspec its;
+    its.it_interval.tv_sec = 0;
+    its.it_interval.tv_nsec = 1000000000 / r->fps;
+    if (r->fps == 1) {
+      its.it_interval.tv_sec = 1;
+      its.it_interval.tv_nsec = 0;
+    }
+    its.it_value = its.it_interval;
+    if (source->fd < 0 || timerfd_settime(source->fd, 0, &its, NULL) < 0) {
+      perror("timerfd");
+      goto errorOnLoad;
+    }
+  } else {
+    // never read, so it stays readable
+    source->fd = eventfd(1, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (source->fd < 0) {
+      perror("eventfd");
+      goto errorOnLoad;
+    }
+  }
+
+  fprintf(stderr, "replay %s: %d frames at %d fps%s\n", path, r->nframes,
+          r->fps, r->fps == 0 ? " (as fast as possible)" : "");
+  return 1;
+
+errorOnLoad:
+  replay_close(source);
+  return -1;
+}
+
+static int replay_dequeue(source_t *source, struct source_buffer *buffer) {
+  struct replay *r = source->priv;
+  if (r->fps > 0) {
+    uint64_t expirations;
+    if (read(source->fd, &expirations, sizeof(uint64_t)) < 0)
+      return 0;
+  }
+  struct replay_frame *f = &r->frames[r->next];
+  r->next = (r->next + 1) % r->nframes;
+  buffer->index = 0;
+  buffer->start = f->start;
+  buffer->bytesused = f->length;
+  buffer->sequence = r->sequence++;
+  buffer->timestamp = 0; // captured now
+  return 1;
+}
+
+const struct source_ops replay_source_ops = {
+    .name = "replay",
+    .open = replay_open,
+    .close = replay_close,
+    .dequeue = replay_dequeue,
+    .requeue = NULL,
+    .queued = NULL,
+};
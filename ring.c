@@ -0,0 +1,99 @@
+/**
+ *  mjpeg2http
+ *
+ *  Copyright (c) 2022 Antonino Nolano. Licensed under the MIT license, as
+ * follows:
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "ring.h"
+
+int ring_init(ring_t *ring, int readers) {
+  if (readers <= 0 || readers > RING_MAX_READERS)
+    return -1;
+  memset(ring, 0, sizeof(ring_t));
+  ring->readers = readers;
+  for (int i = 0; i < readers; ++i) {
+    ring->reader[i].notify_fd = eventfd(0, EFD_NONBLOCK);
+    if (ring->reader[i].notify_fd == -1) {
+      perror("ring eventfd");
+      while (--i >= 0)
+        close(ring->reader[i].notify_fd);
+      return -1;
+    }
+  }
+  return 1;
+}
+
+void ring_destroy(ring_t *ring) {
+  for (int i = 0; i < RING_SIZE; ++i) {
+    if (ring->slots[i] != NULL)
+      frame_unref(ring->slots[i]);
+    ring->slots[i] = NULL;
+  }
+  for (int i = 0; i < ring->readers; ++i)
+    close(ring->reader[i].notify_fd);
+  ring->readers = 0;
+}
+
+// returns 0 when the frame is dropped because a reader is a full ring behind
+int ring_publish(ring_t *ring, frame_t *frame) {
+  uint64_t head = ring->head;
+  int i;
+
+  for (i = 0; i < ring->readers; ++i) {
+    if (head - __atomic_load_n(&ring->reader[i].seq, __ATOMIC_ACQUIRE) >=
+        RING_SIZE)
+      return 0;
+  }
+
+  // the last reader of the previous frame in the slot has emptied it
+  ring->slots[head % RING_SIZE] = frame_ref(frame);
+  ring->pending[head % RING_SIZE] = ring->readers;
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+  uint64_t beep = 1;
+  for (i = 0; i < ring->readers; ++i) {
+    if (write(ring->reader[i].notify_fd, &beep, sizeof(uint64_t)) < 0)
+      perror("ring notify");
+  }
+  return 1;
+}
+
+// next frame for the reader with a new reference, NULL if it is up to date
+frame_t *ring_read(ring_t *ring, int reader) {
+  uint64_t seq = ring->reader[reader].seq;
+  if (seq == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE))
+    return NULL;
+  frame_t **slot = &ring->slots[seq % RING_SIZE];
+  frame_t *frame = frame_ref(*slot);
+  if (__atomic_sub_fetch(&ring->pending[seq % RING_SIZE], 1,
+                         __ATOMIC_ACQ_REL) == 0) {
+    *slot = NULL;
+    frame_unref(frame);
+  }
+  __atomic_store_n(&ring->reader[reader].seq, seq + 1, __ATOMIC_RELEASE);
+  return frame;
+}
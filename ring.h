@@ -0,0 +1,62 @@
+/**
+ *  mjpeg2http
+ *
+ *  Copyright (c) 2022 Antonino Nolano. Licensed under the MIT license, as
+ * follows:
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef RING_H
+#define RING_H
+
+#include <stdint.h>
+
+#include "frame.h"
+
+#define RING_SIZE 16
+#define RING_MAX_READERS 66 /* MAX_WORKERS, the rtp and shm outputs */
+#define CACHE_LINE 64
+
+/*
+ * single producer / multiple consumers frame ring: every reader has its own
+ * cursor and eventfd, the producer never overwrites a slot that a reader has
+ * not consumed yet, so readers can take their reference without locks. The
+ * last reader of a slot drops the reference of the ring, so a frame (and the
+ * source buffer behind it) is not pinned once every reader has it
+ */
+typedef struct {
+  uint64_t seq;
+  int notify_fd;
+} __attribute__((aligned(CACHE_LINE))) ring_reader_t;
+
+typedef struct {
+  frame_t *slots[RING_SIZE];
+  uint32_t pending[RING_SIZE]; /* readers that have not read the slot yet */
+  uint64_t head __attribute__((aligned(CACHE_LINE)));
+  int readers;
+  ring_reader_t reader[RING_MAX_READERS];
+} ring_t;
+
+int ring_init(ring_t *ring, int readers);
+void ring_destroy(ring_t *ring);
+int ring_publish(ring_t *ring, frame_t *frame);
+frame_t *ring_read(ring_t *ring, int reader);
+
+#endif
@@ -0,0 +1,430 @@
+/**
+ *  mjpeg2http
+ *
+ *  Copyright (c) 2022 Antonino Nolano. Licensed under the MIT license, as
+ * follows:
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "constants.h"
+#include "metrics.h"
+#include "rtp.h"
+
+#define RTP_PAYLOAD_JPEG 26
+#define RTP_CLOCK_HZ 90000
+#define RTP_HEADER_MAX 288 /* rtp, jpeg, restart and two 16 bit qtables */
+
+// SOI, tables and SOF0 up to SOS: everything after SOS is the scan
+int rtp_parse_jpeg(const uint8_t *data, uint32_t len, struct rtp_jpeg *jpeg) {
+  const uint8_t *tables[4] = {NULL, NULL, NULL, NULL};
+  int precision[4] = {0, 0, 0, 0}, sampling[3] = {0, 0, 0};
+  int tq[3] = {0, 0, 0}, sof = 0;
+  uint32_t pos = 2;
+
+  memset(jpeg, 0, sizeof(struct rtp_jpeg));
+  if (len < 4 || data[0] != 0xFF || data[1] != 0xD8)
+    return -1;
+
+  while (jpeg->scan == NULL) {
+    if (pos + 4 > len || data[pos] != 0xFF)
+      return -1;
+    uint8_t marker = data[pos + 1];
+    if (marker == 0xFF) { // fill byte
+      ++pos;
+      continue;
+    }
+    uint32_t n = data[pos + 2] << 8 | data[pos + 3];
+    const uint8_t *seg = data + pos + 4;
+    if (n < 2 || pos + 2 + n > len)
+      return -1;
+    n -= 2;
+
+    switch (marker) {
+    case 0xDB: // DQT, several tables per segment
+      for (uint32_t i = 0; i < n;) {
+        int pq = seg[i] >> 4, size = pq ? 128 : 64;
+        if (i + 1 + size > n)
+          return -1;
+        tables[seg[i] & 3] = seg + i + 1;
+        precision[seg[i] & 3] = pq;
+        i += 1 + size;
+      }
+      break;
+    case 0xC0: // baseline, three components
+      if (n < 15 || seg[0] != 8 || seg[5] != 3)
+        return -1;
+      jpeg->height = seg[1] << 8 | seg[2];
+      jpeg->width = seg[3] << 8 | seg[4];
+      for (int c = 0; c < 3; ++c) {
+        sampling[c] = seg[7 + 3 * c];
+        tq[c] = seg[8 + 3 * c] & 3;
+      }
+      sof = 1;
+      break;
+    case 0xC1 ... 0xC3:
+    case 0xC5 ... 0xC7:
+    case 0xC9 ... 0xCB:
+    case 0xCD ... 0xCF:
+      return -1;
+    case 0xDD: // DRI
+      if (n < 2)
+        return -1;
+      jpeg->dri = seg[0] << 8 | seg[1];
+      break;
+    case 0xDA: // SOS, the scan runs up to EOI
+      jpeg->scan = seg + n;
+      jpeg->scan_len = data + len - jpeg->scan;
+      while (jpeg->scan_len >= 2 &&
+             !(jpeg->scan[jpeg->scan_len - 2] == 0xFF &&
+               jpeg->scan[jpeg->scan_len - 1] == 0xD9) &&
+             jpeg->scan[jpeg->scan_len - 1] == 0)
+        --jpeg->scan_len; // padding after EOI
+      if (jpeg->scan_len >= 2 && jpeg->scan[jpeg->scan_len - 2] == 0xFF &&
+          jpeg->scan[jpeg->scan_len - 1] == 0xD9)
+        jpeg->scan_len -= 2;
+      break;
+    default: // APPn, COM, DHT: the receiver uses the standard tables
+      break;
+    }
+    pos += 4 + n;
+  }
+
+  // RFC 2435 types: 0 is 4:2:2 (Y 2x1), 1 is 4:2:0 (Y 2x2)
+  if (!sof || sampling[1] != 0x11 || sampling[2] != 0x11 || tq[1] != tq[2])
+    return -1;
+  if (sampling[0] == 0x21)
+    jpeg->type = 0;
+  else if (sampling[0] == 0x22)
+    jpeg->type = 1;
+  else
+    return -1;
+  if (jpeg->dri > 0)
+    jpeg->type += 64;
+  if (tables[tq[0]] == NULL || tables[tq[1]] == NULL)
+    return -1;
+  jpeg->qtable[0] = tables[tq[0]];
+  jpeg->qtable[1] = tables[tq[1]];
+  jpeg->precision = precision[tq[0]] | precision[tq[1]] << 1;
+  if (jpeg->width == 0 || jpeg->height == 0 || jpeg->width > 2040 ||
+      jpeg->height > 2040 || jpeg->scan_len == 0)
+    return -1;
+  return 1;
+}
+
+// fixed, JPEG, restart and (first packet only) quantization table headers
+static int rtp_header(rtp_t *rtp, uint8_t *h, const struct rtp_jpeg *jpeg,
+                      uint32_t offset, uint32_t timestamp) {
+  int n = 0;
+  h[n++] = 0x80; // version 2
+  h[n++] = RTP_PAYLOAD_JPEG;
+  h[n++] = rtp->seq >> 8;
+  h[n++] = rtp->seq;
+  ++rtp->seq;
+  for (int shift = 24; shift >= 0; shift -= 8)
+    h[n++] = timestamp >> shift;
+  for (int shift = 24; shift >= 0; shift -= 8)
+    h[n++] = rtp->ssrc >> shift;
+
+  h[n++] = 0; // type specific
+  h[n++] = offset >> 16;
+  h[n++] = offset >> 8;
+  h[n++] = offset;
+  h[n++] = jpeg->type;
+  h[n++] = 255; // tables in band
+  h[n++] = (jpeg->width + 7) / 8;
+  h[n++] = (jpeg->height + 7) / 8;
+
+  if (jpeg->dri > 0) {
+    // F = L = 1 and count 0x3fff: the packet need not hold whole intervals
+    h[n++] = jpeg->dri >> 8;
+    h[n++] = jpeg->dri;
+    h[n++] = 0xFF;
+    h[n++] = 0xFF;
+  }
+
+  if (offset == 0) {
+    int luma = jpeg->precision & 1 ? 128 : 64;
+    int chroma = jpeg->precision & 2 ? 128 : 64;
+    h[n++] = 0;
+    h[n++] = jpeg->precision;
+    h[n++] = (luma + chroma) >> 8;
+    h[n++] = luma + chroma;
+    memcpy(h + n, jpeg->qtable[0], luma);
+    n += luma;
+    memcpy(h + n, jpeg->qtable[1], chroma);
+    n += chroma;
+  }
+  return n;
+}
+
+// the messages point into the arrays, so they are grown before the first one
+static int rtp_grow(rtp_t *rtp, uint32_t needed) {
+  uint32_t packets = rtp->packets > 0 ? rtp->packets : 64;
+  while (packets < needed)
+    packets *= 2;
+  if (packets == rtp->packets)
+    return 1;
+  struct mmsghdr *msgs = realloc(rtp->msgs, packets * sizeof(*msgs));
+  if (msgs != NULL)
+    rtp->msgs = msgs;
+  struct iovec *iov = realloc(rtp->iov, 2 * packets * sizeof(*iov));
+  if (iov != NULL)
+    rtp->iov = iov;
+  uint8_t *headers = realloc(rtp->headers, packets * RTP_HEADER_MAX);
+  if (headers != NULL)
+    rtp->headers = headers;
+  if (msgs == NULL || iov == NULL || headers == NULL)
+    return -1;
+  rtp->packets = packets;
+  return 1;
+}
+
+// a refused unicast datagram reports ECONNREFUSED on the next send once
+static int rtp_sendmmsg(rtp_t *rtp, struct mmsghdr *msgs, uint32_t n) {
+  while (n > 0) {
+    int sent = sendmmsg(rtp->fd, msgs, n, 0);
+    if (sent < 0) {
+      if (errno == EINTR || errno == ECONNREFUSED)
+        continue;
+      return -1;
+    }
+    msgs += sent;
+    n -= sent;
+  }
+  return 1;
+}
+
+static void rtp_sleep_until(uint64_t usec) {
+  struct timespec ts = {usec / 1000000, (usec % 1000000) * 1000};
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+    ;
+}
+
+int rtp_send_frame(rtp_t *rtp, frame_t *frame) {
+  struct rtp_jpeg jpeg;
+  if (rtp_parse_jpeg(frame->iov[1].iov_base, frame->iov[1].iov_len, &jpeg) <
+      0)
+    return 0;
+
+  uint32_t timestamp = frame->timestamp * (RTP_CLOCK_HZ / 1000) / 1000;
+  // every packet carries at least this much of the scan
+  uint32_t min_chunk = RTP_PACKET_SIZE - RTP_HEADER_MAX;
+  if (rtp_grow(rtp, (jpeg.scan_len + min_chunk - 1) / min_chunk) < 0)
+    return -1;
+
+  uint32_t n = 0, offset = 0, bytes = 0;
+  while (offset < jpeg.scan_len) {
+    uint8_t *h = rtp->headers + n * RTP_HEADER_MAX;
+    int hlen = rtp_header(rtp, h, &jpeg, offset, timestamp);
+    uint32_t chunk = RTP_PACKET_SIZE - hlen;
+    if (chunk > jpeg.scan_len - offset)
+      chunk = jpeg.scan_len - offset;
+
+    struct iovec *iov = &rtp->iov[2 * n];
+    iov[0].iov_base = h;
+    iov[0].iov_len = hlen;
+    iov[1].iov_base = (uint8_t *)jpeg.scan + offset;
+    iov[1].iov_len = chunk;
+    memset(&rtp->msgs[n], 0, sizeof(struct mmsghdr));
+    rtp->msgs[n].msg_hdr.msg_name = &rtp->destination;
+    rtp->msgs[n].msg_hdr.msg_namelen = sizeof(rtp->destination);
+    rtp->msgs[n].msg_hdr.msg_iov = iov;
+    rtp->msgs[n].msg_hdr.msg_iovlen = 2;
+    offset += chunk;
+    bytes += hlen + chunk;
+    ++n;
+  }
+  rtp->headers[(n - 1) * RTP_HEADER_MAX + 1] |= 0x80; // marker: last packet
+
+  // the frame is spread over half the interval to the previous one (or
+  // over its size at rate), burst by burst
+  uint64_t span = 0;
+  if (rtp->rate > 0)
+    span = (uint64_t)bytes * 1000000 / rtp->rate;
+  else if (rtp->last > 0 && frame->timestamp > rtp->last)
+    span = (frame->timestamp - rtp->last) / 2;
+  if (span > RTP_PACE_MAX_MS * 1000)
+    span = RTP_PACE_MAX_MS * 1000;
+  rtp->last = frame->timestamp;
+
+  uint32_t burst = span > 0 ? RTP_BURST : n;
+  uint64_t start = metrics_usec();
+  for (uint32_t i = 0; i < n; i += burst) {
+    if (i > 0)
+      rtp_sleep_until(start + span * i / n);
+    if (rtp_sendmmsg(rtp, &rtp->msgs[i], n - i < burst ? n - i : burst) < 0)
+      return -1;
+  }
+  metrics_add(rtp_frames, 1);
+  metrics_add(rtp_packets, n);
+  metrics_add(rtp_bytes, bytes);
+  return 1;
+}
+
+static void *rtp_loop(void *arg) {
+  rtp_t *rtp = (rtp_t *)arg;
+  struct pollfd fds[2] = {
+      {rtp->ring->reader[rtp->reader].notify_fd, POLLIN, 0},
+      {rtp->exit_fd, POLLIN, 0},
+  };
+  uint64_t beep;
+
+  metrics_register(rtp->metrics, METRICS_RTP, 0);
+  printf("libmjpeg2http rtp camera=%d -> %s:%d\n", rtp->camera,
+         inet_ntoa(rtp->destination.sin_addr),
+         ntohs(rtp->destination.sin_port));
+  fflush(stdout);
+
+  for (;;) {
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("rtp poll");
+      break;
+    }
+    if (fds[1].revents != 0)
+      break;
+    if (read(fds[0].fd, &beep, sizeof(beep)) < 0 && errno != EAGAIN)
+      perror("rtp ring");
+
+    // a late sender skips to the freshest frame of its camera
+    frame_t *frame, *latest = NULL;
+    while ((frame = ring_read(rtp->ring, rtp->reader)) != NULL) {
+      if (frame->camera != rtp->camera) {
+        frame_unref(frame);
+        continue;
+      }
+      if (latest != NULL)
+        frame_unref(latest);
+      latest = frame;
+    }
+    if (latest == NULL)
+      continue;
+
+    int ret = rtp_send_frame(rtp, latest);
+    if (ret == 0 && rtp->invalid++ == 0) {
+      printf("rtp: frame is not a baseline 4:2:2/4:2:0 jpeg -> skip\n");
+      fflush(stdout);
+    } else if (ret < 0) {
+      perror("rtp send");
+    }
+    frame_unref(latest);
+  }
+
+  printf("libmjpeg2http rtp exit\n");
+  fflush(stdout);
+  return NULL;
+}
+
+int rtp_open(rtp_t *rtp, const char *destination, const char *interface,
+             int ttl, uint32_t rate) {
+  char host[64];
+  const char *colon = strrchr(destination, ':');
+
+  memset(rtp, 0, sizeof(rtp_t));
+  rtp->fd = -1;
+  rtp->rate = rate;
+  rtp->destination.sin_family = AF_INET;
+  if (colon == NULL || colon - destination >= (int)sizeof(host) ||
+      atoi(colon + 1) <= 0 || atoi(colon + 1) > 65535) {
+    printf("rtp: %s is not address:port\n", destination);
+    return -1;
+  }
+  snprintf(host, sizeof(host), "%.*s", (int)(colon - destination),
+           destination);
+  rtp->destination.sin_port = htons(atoi(colon + 1));
+  if (inet_pton(AF_INET, host, &rtp->destination.sin_addr) != 1) {
+    printf("rtp: %s is not an ipv4 address\n", host);
+    return -1;
+  }
+
+  rtp->fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (rtp->fd < 0) {
+    perror("rtp socket");
+    return -1;
+  }
+  if (IN_MULTICAST(ntohl(rtp->destination.sin_addr.s_addr))) {
+    unsigned char hops = ttl > 255 ? 255 : ttl, loop = 1;
+    struct in_addr ifaddr;
+    if (setsockopt(rtp->fd, IPPROTO_IP, IP_MULTICAST_TTL, &hops,
+                   sizeof(hops)) < 0 ||
+        setsockopt(rtp->fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop,
+                   sizeof(loop)) < 0) {
+      perror("rtp multicast");
+      goto errorOnOpen;
+    }
+    if (interface != NULL && interface[0] != 0 &&
+        (inet_pton(AF_INET, interface, &ifaddr) != 1 ||
+         setsockopt(rtp->fd, IPPROTO_IP, IP_MULTICAST_IF, &ifaddr,
+                    sizeof(ifaddr)) < 0)) {
+      printf("rtp: cannot send through interface %s\n", interface);
+      goto errorOnOpen;
+    }
+  }
+  // fq paces within a burst too, without it the bursts are what is paced
+  if (rate > 0 && setsockopt(rtp->fd, SOL_SOCKET, SO_MAX_PACING_RATE, &rate,
+                             sizeof(rate)) < 0)
+    perror("rtp: SO_MAX_PACING_RATE");
+
+  if (getrandom(&rtp->ssrc, sizeof(rtp->ssrc), 0) < 0 ||
+      getrandom(&rtp->seq, sizeof(rtp->seq), 0) < 0)
+    rtp->ssrc = getpid();
+  if (rtp_grow(rtp, 0) < 0)
+    goto errorOnOpen;
+  return 1;
+
+errorOnOpen:
+  rtp_close(rtp);
+  return -1;
+}
+
+void rtp_close(rtp_t *rtp) {
+  if (rtp->fd >= 0)
+    close(rtp->fd);
+  rtp->fd = -1;
+  free(rtp->msgs);
+  free(rtp->iov);
+  free(rtp->headers);
+  rtp->msgs = NULL;
+  rtp->iov = NULL;
+  rtp->headers = NULL;
+  rtp->packets = 0;
+}
+
+int rtp_start(rtp_t *rtp) {
+  if (pthread_create(&rtp->thread, NULL, rtp_loop, rtp) != 0) {
+    perror("pthread_create");
+    return -1;
+  }
+  return 1;
+}
+
+void rtp_join(rtp_t *rtp) { pthread_join(rtp->thread, NULL); }
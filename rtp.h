@@ -0,0 +1,87 @@
+/**
+ *  mjpeg2http
+ *
+ *  Copyright (c) 2022 Antonino Nolano. Licensed under the MIT license, as
+ * follows:
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef RTP_H
+#define RTP_H
+
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "frame.h"
+#include "metrics.h"
+#include "ring.h"
+
+/* what RFC 2435 needs from a baseline JPEG */
+struct rtp_jpeg {
+  int type;   /* 0: 4:2:2, 1: 4:2:0, +64 with restart markers */
+  int width;  /* pixels, at most 2040 */
+  int height; /* pixels, at most 2040 */
+  int dri;    /* restart interval, 0 without DRI */
+  const uint8_t *qtable[2]; /* luma and chroma */
+  int precision;            /* bit 0 luma, bit 1 chroma: 16 bit entries */
+  const uint8_t *scan;      /* entropy coded data, EOI excluded */
+  uint32_t scan_len;
+};
+
+/*
+ * RTP/JPEG output: a ring reader of its own that packetizes the frames of
+ * one camera and sends every frame with sendmmsg to a unicast address or a
+ * multicast group. The packets of a frame are paced in bursts over half the
+ * frame interval, or at rate bytes/s when set
+ */
+typedef struct rtp {
+  int camera;
+  int reader; /* ring reader index */
+  ring_t *ring;
+  int exit_fd;
+  metrics_set_t *metrics;
+  pthread_t thread;
+  int fd;
+  struct sockaddr_in destination;
+  uint32_t rate; /* bytes/s, 0: half the frame interval */
+  uint32_t ssrc;
+  uint16_t seq;
+  uint64_t last;        /* capture time of the previous frame */
+  int invalid;          /* frames that could not be packetized */
+  uint32_t packets;     /* capacity of the arrays below */
+  struct mmsghdr *msgs; /* one per packet */
+  struct iovec *iov;    /* header and payload of every packet */
+  uint8_t *headers;     /* RTP_HEADER_MAX bytes per packet */
+} rtp_t;
+
+// destination "a.b.c.d:port", multicast groups leave through interface
+// (an ipv4 address, NULL or "" for the default route) with ttl
+int rtp_open(rtp_t *rtp, const char *destination, const char *interface,
+             int ttl, uint32_t rate);
+void rtp_close(rtp_t *rtp);
+int rtp_parse_jpeg(const uint8_t *data, uint32_t len, struct rtp_jpeg *jpeg);
+// 1 when sent, 0 if the frame is not a JPEG that RFC 2435 can carry
+int rtp_send_frame(rtp_t *rtp, frame_t *frame);
+int rtp_start(rtp_t *rtp);
+void rtp_join(rtp_t *rtp);
+
+#endif
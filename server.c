@@ -38,19 +38,11 @@
 #include "constants.h"
 #include "server.h"
 
-int server_new_peer(int sfd, struct remotepeer *rpeer) {
-  // accept
-  struct sockaddr_storage remote;
-  uint32_t addrlen = sizeof(struct sockaddr_storage);
-  rpeer->fd = accept(sfd, (struct sockaddr *)&remote, &addrlen);
-  if (rpeer->fd < 0) {
-    if (EAGAIN == errno || EWOULDBLOCK == errno)
-      return 0;
-    return -1;
-  }
+static int server_setup_peer(int fd, struct sockaddr_storage *remote,
+                             struct remotepeer *rpeer) {
+  rpeer->fd = fd;
 
-  // set non block and tcp_nodelay
-  fcntl(rpeer->fd, F_SETFL, O_NONBLOCK);
+  // set tcp_nodelay
   int on = 1;
   if (0 != setsockopt(rpeer->fd, IPPROTO_TCP, TCP_NODELAY, (char *)&on,
                       sizeof(int))) {
@@ -59,8 +51,8 @@ int server_new_peer(int sfd, struct remotepeer *rpeer) {
   }
 
   // get hostname and port
-  rpeer->port = ntohs(((struct sockaddr_in *)&remote)->sin_port);
-  if (NULL == inet_ntop(AF_INET, &((struct sockaddr_in *)&remote)->sin_addr,
+  rpeer->port = ntohs(((struct sockaddr_in *)remote)->sin_port);
+  if (NULL == inet_ntop(AF_INET, &((struct sockaddr_in *)remote)->sin_addr,
                         rpeer->hostname, SERVER_MAX)) {
     perror("error address");
     return -1;
@@ -68,7 +60,33 @@ int server_new_peer(int sfd, struct remotepeer *rpeer) {
   return 1;
 }
 
-int server_create(char *hostname, int port) {
+int server_new_peer(int sfd, struct remotepeer *rpeer) {
+  // accept
+  struct sockaddr_storage remote;
+  uint32_t addrlen = sizeof(struct sockaddr_storage);
+  int fd = accept(sfd, (struct sockaddr *)&remote, &addrlen);
+  if (fd < 0) {
+    if (EAGAIN == errno || EWOULDBLOCK == errno)
+      return 0;
+    return -1;
+  }
+
+  // set non block
+  fcntl(fd, F_SETFL, O_NONBLOCK);
+  return server_setup_peer(fd, &remote, rpeer);
+}
+
+int server_peer(int fd, struct remotepeer *rpeer) {
+  struct sockaddr_storage remote;
+  socklen_t addrlen = sizeof(struct sockaddr_storage);
+  if (getpeername(fd, (struct sockaddr *)&remote, &addrlen) != 0) {
+    perror("error getpeername");
+    return -1;
+  }
+  return server_setup_peer(fd, &remote, rpeer);
+}
+
+int server_create(char *hostname, int port, int backlog) {
   // create fd
   int error = 0;
   int socket_fd = socket(PF_INET, SOCK_STREAM, 0);
@@ -113,7 +131,7 @@ int server_create(char *hostname, int port) {
   }
 
   // listening and backlog
-  if (listen(socket_fd, SERVER_LISTEN_BACKLOG) < 0) {
+  if (listen(socket_fd, backlog) < 0) {
     perror("listen error");
     close(socket_fd);
     return -1;
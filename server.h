@@ -34,7 +34,9 @@ struct remotepeer {
   int fd;
 };
 
-int server_create(char *hostname, int port);
+int server_create(char *hostname, int port, int backlog);
 int server_new_peer(int fd, struct remotepeer *rpeer);
+// peer already accepted (e.g. by io_uring), fd must be non blocking
+int server_peer(int fd, struct remotepeer *rpeer);
 
 #endif
@@ -0,0 +1,69 @@
+/**
+ *  mjpeg2http
+ *
+ *  Copyright (c) 2022 Antonino Nolano. Licensed under the MIT license, as
+ * follows:
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "shaper.h"
+
+void shaper_init(shaper_t *shaper, uint64_t rate, uint64_t burst) {
+  shaper->rate = rate;
+  shaper->burst = burst;
+  shaper->tat = 0;
+}
+
+static uint64_t shaper_cost(const shaper_t *shaper, uint32_t bytes) {
+  return (uint64_t)bytes * 1000000 / shaper->rate;
+}
+
+int shaper_ready(const shaper_t *shaper, uint64_t now) {
+  return shaper->rate == 0 || shaper->tat <= now + shaper->burst;
+}
+
+void shaper_charge(shaper_t *shaper, uint64_t now, uint32_t bytes) {
+  if (shaper->rate == 0)
+    return;
+  // credit does not pile up while idle
+  shaper->tat = (shaper->tat > now ? shaper->tat : now) +
+                shaper_cost(shaper, bytes);
+}
+
+int shaper_admit(shaper_t *shaper, uint64_t now, uint32_t bytes) {
+  if (shaper->rate == 0)
+    return 1;
+  uint64_t cost = shaper_cost(shaper, bytes);
+  uint64_t tat = __atomic_load_n(&shaper->tat, __ATOMIC_RELAXED), next;
+  do {
+    if (tat > now + shaper->burst)
+      return 0;
+    next = (tat > now ? tat : now) + cost;
+  } while (!__atomic_compare_exchange_n(&shaper->tat, &tat, next, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  return 1;
+}
+
+void shaper_refund(shaper_t *shaper, uint32_t bytes) {
+  if (shaper->rate == 0)
+    return;
+  __atomic_sub_fetch(&shaper->tat, shaper_cost(shaper, bytes),
+                     __ATOMIC_RELAXED);
+}
@@ -0,0 +1,52 @@
+/**
+ *  mjpeg2http
+ *
+ *  Copyright (c) 2022 Antonino Nolano. Licensed under the MIT license, as
+ * follows:
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef SHAPER_H
+#define SHAPER_H
+
+#include <stdint.h>
+
+/*
+ * token bucket kept as the time its debt is paid back (GCRA): a frame may
+ * go while the bucket is less than burst usec in debt, then it is charged
+ * size / rate. One 64 bit word, so a bucket shared by the workers is taken
+ * with a compare and swap
+ */
+typedef struct shaper {
+  uint64_t rate;  /* bytes per second, 0: unlimited */
+  uint64_t burst; /* usec of debt allowed */
+  uint64_t tat;   /* debt paid back, CLOCK_MONOTONIC usec */
+} shaper_t;
+
+void shaper_init(shaper_t *shaper, uint64_t rate, uint64_t burst);
+// bucket of a single thread: test first, charge once the frame is taken
+int shaper_ready(const shaper_t *shaper, uint64_t now);
+void shaper_charge(shaper_t *shaper, uint64_t now, uint32_t bytes);
+// shared bucket: test and charge in one step, 0 if over budget
+int shaper_admit(shaper_t *shaper, uint64_t now, uint32_t bytes);
+// either kind: a charged frame was dropped before it was sent
+void shaper_refund(shaper_t *shaper, uint32_t bytes);
+
+#endif
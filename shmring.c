@@ -0,0 +1,420 @@
+/**
+ *  mjpeg2http
+ *
+ *  Copyright (c) 2022 Antonino Nolano. Licensed under the MIT license, as
+ * follows:
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libmjpeg2http.h"
+#include "metrics.h"
+#include "shmring.h"
+
+static long futex(uint32_t *word, int op, uint32_t value,
+                  const struct timespec *timeout) {
+  return syscall(SYS_futex, word, op, value, timeout, NULL, 0);
+}
+
+static struct shm_slot *slot_of(struct shm_header *header, uint64_t n) {
+  return (struct shm_slot *)((uint8_t *)header + header->slot_size *
+                                                     (1 + n % header->slots));
+}
+
+int shmring_publish(shmring_t *shm, frame_t *frame) {
+  struct shm_header *header = shm->header;
+  uint32_t len = frame->iov[1].iov_len;
+  if (len > header->slot_size - SHM_SLOT_HEADER)
+    return 0;
+
+  uint64_t n = header->head + 1;
+  struct shm_slot *slot = slot_of(header, n);
+  __atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy((uint8_t *)slot + SHM_SLOT_HEADER, frame->iov[1].iov_base, len);
+  slot->len = len;
+  slot->sequence = frame->sequence;
+  slot->timestamp = frame->timestamp;
+  __atomic_store_n(&slot->seq, n, __ATOMIC_RELEASE);
+  __atomic_store_n(&header->head, n, __ATOMIC_RELEASE);
+
+  __atomic_add_fetch(&header->futex, 1, __ATOMIC_RELEASE);
+  futex(&header->futex, FUTEX_WAKE, INT32_MAX, NULL);
+  return 1;
+}
+
+// the memfd goes out read only: the consumer cannot write the frames
+static int send_memfd(shmring_t *shm, int fd) {
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/self/fd/%d", shm->memfd);
+  int rofd = open(path, O_RDONLY | O_CLOEXEC);
+
+  char byte = 0;
+  struct iovec iov = {&byte, 1};
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } control;
+  struct msghdr msg = {0};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), rofd >= 0 ? &rofd : &shm->memfd, sizeof(int));
+  int ret = sendmsg(fd, &msg, MSG_NOSIGNAL) == 1 ? 1 : -1;
+  if (rofd >= 0)
+    close(rofd);
+  return ret;
+}
+
+static void add_consumer(shmring_t *shm) {
+  int fd = accept4(shm->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+  if (fd < 0)
+    return;
+  if (shm->numConsumers == SHM_MAX_CONSUMERS || send_memfd(shm, fd) < 0) {
+    printf("shm: consumer rejected\n");
+    fflush(stdout);
+    close(fd);
+    return;
+  }
+  shm->consumers[shm->numConsumers++] = fd;
+  metrics_add(shm_consumers, 1);
+  if (shm->numConsumers == 1)
+    shm->camera_join(shm->ctx, shm->camera);
+}
+
+static void remove_consumer(shmring_t *shm, int i) {
+  close(shm->consumers[i]);
+  shm->consumers[i] = shm->consumers[--shm->numConsumers];
+  metrics_add(shm_consumers, -1);
+  if (shm->numConsumers == 0)
+    shm->camera_leave(shm->ctx, shm->camera);
+}
+
+static void *shmring_loop(void *arg) {
+  shmring_t *shm = (shmring_t *)arg;
+  struct pollfd fds[3 + SHM_MAX_CONSUMERS];
+  uint64_t beep;
+
+  metrics_register(shm->metrics, METRICS_SHM, 0);
+  printf("libmjpeg2http shm camera=%d -> %s\n", shm->camera, shm->path);
+  fflush(stdout);
+
+  for (;;) {
+    fds[0] = (struct pollfd){shm->ring->reader[shm->reader].notify_fd, POLLIN};
+    fds[1] = (struct pollfd){shm->exit_fd, POLLIN};
+    fds[2] = (struct pollfd){shm->listen_fd, POLLIN};
+    for (int i = 0; i < shm->numConsumers; ++i)
+      fds[3 + i] = (struct pollfd){shm->consumers[i], POLLIN};
+    if (poll(fds, 3 + shm->numConsumers, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("shm poll");
+      break;
+    }
+    if (fds[1].revents != 0)
+      break;
+
+    // consumers only talk by hanging up
+    for (int i = shm->numConsumers - 1; i >= 0; --i) {
+      char byte;
+      if (fds[3 + i].revents != 0 &&
+          recv(shm->consumers[i], &byte, 1, MSG_DONTWAIT) <= 0)
+        remove_consumer(shm, i);
+    }
+    if (fds[2].revents & POLLIN)
+      add_consumer(shm);
+
+    if (fds[0].revents == 0)
+      continue;
+    if (read(fds[0].fd, &beep, sizeof(beep)) < 0 && errno != EAGAIN)
+      perror("shm ring");
+    frame_t *frame;
+    while ((frame = ring_read(shm->ring, shm->reader)) != NULL) {
+      if (frame->camera == shm->camera && shm->numConsumers > 0) {
+        if (shmring_publish(shm, frame))
+          metrics_add(shm_frames, 1);
+        else if (shm->too_large++ == 0) {
+          printf("shm: frame of %zu bytes above shm_slot_size -> skip\n",
+                 frame->iov[1].iov_len);
+          fflush(stdout);
+        }
+      }
+      frame_unref(frame);
+    }
+  }
+
+  while (shm->numConsumers > 0)
+    remove_consumer(shm, shm->numConsumers - 1);
+  printf("libmjpeg2http shm exit\n");
+  fflush(stdout);
+  return NULL;
+}
+
+int shmring_open(shmring_t *shm, const char *path, int slots,
+                 int slot_size) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+
+  memset(shm, 0, sizeof(shmring_t));
+  shm->memfd = shm->listen_fd = -1;
+  if (slots < 2 || slot_size <= SHM_SLOT_HEADER ||
+      strlen(path) >= sizeof(addr.sun_path)) {
+    printf("shm: invalid ring %s %d x %d\n", path, slots, slot_size);
+    return -1;
+  }
+  snprintf(shm->path, sizeof(shm->path), "%s", path);
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+
+  // slots are page aligned, the header takes the first one
+  long page = sysconf(_SC_PAGESIZE);
+  slot_size = (slot_size + page - 1) / page * page;
+  shm->size = (size_t)slot_size * (1 + slots);
+  shm->memfd = memfd_create("mjpeg2http", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (shm->memfd < 0 || ftruncate(shm->memfd, shm->size) < 0) {
+    perror("shm memfd");
+    goto errorOnOpen;
+  }
+  fcntl(shm->memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+  shm->header = mmap(NULL, shm->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     shm->memfd, 0);
+  if (shm->header == MAP_FAILED) {
+    shm->header = NULL;
+    perror("shm mmap");
+    goto errorOnOpen;
+  }
+  shm->header->magic = SHM_MAGIC;
+  shm->header->version = SHM_VERSION;
+  shm->header->slots = slots;
+  shm->header->slot_size = slot_size;
+
+  shm->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  unlink(path);
+  if (shm->listen_fd < 0 ||
+      bind(shm->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(shm->listen_fd, SHM_MAX_CONSUMERS) < 0) {
+    perror(path);
+    goto errorOnOpen;
+  }
+  return 1;
+
+errorOnOpen:
+  shmring_close(shm);
+  return -1;
+}
+
+void shmring_close(shmring_t *shm) {
+  if (shm->listen_fd >= 0) {
+    close(shm->listen_fd);
+    unlink(shm->path);
+  }
+  if (shm->header != NULL) {
+    // consumers still mapping it see the end
+    __atomic_store_n(&shm->header->closed, 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&shm->header->futex, 1, __ATOMIC_RELEASE);
+    futex(&shm->header->futex, FUTEX_WAKE, INT32_MAX, NULL);
+    munmap(shm->header, shm->size);
+  }
+  if (shm->memfd >= 0)
+    close(shm->memfd);
+  shm->listen_fd = shm->memfd = -1;
+  shm->header = NULL;
+}
+
+int shmring_start(shmring_t *shm) {
+  if (pthread_create(&shm->thread, NULL, shmring_loop, shm) != 0) {
+    perror("pthread_create");
+    return -1;
+  }
+  return 1;
+}
+
+void shmring_join(shmring_t *shm) { pthread_join(shm->thread, NULL); }
+
+/* consumer side */
+
+struct mjpeg2http_shm {
+  int sock; /* kept open: the producer streams while it is connected */
+  struct shm_header *header;
+  size_t size;
+};
+
+mjpeg2http_shm_t *mjpeg2http_shm_attach(const char *path) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  mjpeg2http_shm_t *shm = calloc(1, sizeof(mjpeg2http_shm_t));
+  int memfd = -1;
+  if (shm == NULL || strlen(path) >= sizeof(addr.sun_path)) {
+    free(shm);
+    return NULL;
+  }
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+
+  shm->sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (shm->sock < 0 ||
+      connect(shm->sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    goto errorOnAttach;
+
+  char byte;
+  struct iovec iov = {&byte, 1};
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } control;
+  struct msghdr msg = {0};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+  struct cmsghdr *cmsg;
+  if (recvmsg(shm->sock, &msg, MSG_CMSG_CLOEXEC) != 1 ||
+      (cmsg = CMSG_FIRSTHDR(&msg)) == NULL || cmsg->cmsg_type != SCM_RIGHTS)
+    goto errorOnAttach;
+  memcpy(&memfd, CMSG_DATA(cmsg), sizeof(int));
+
+  struct stat st;
+  if (fstat(memfd, &st) < 0 || st.st_size < (off_t)sizeof(struct shm_header))
+    goto errorOnAttach;
+  shm->size = st.st_size;
+  shm->header = mmap(NULL, shm->size, PROT_READ, MAP_SHARED, memfd, 0);
+  close(memfd);
+  memfd = -1;
+  if (shm->header == MAP_FAILED) {
+    shm->header = NULL;
+    goto errorOnAttach;
+  }
+  if (shm->header->magic != SHM_MAGIC ||
+      shm->header->version != SHM_VERSION ||
+      (size_t)shm->header->slot_size * (1 + shm->header->slots) > shm->size)
+    goto errorOnAttach;
+  return shm;
+
+errorOnAttach:
+  if (memfd >= 0)
+    close(memfd);
+  mjpeg2http_shm_detach(shm);
+  return NULL;
+}
+
+void mjpeg2http_shm_detach(mjpeg2http_shm_t *shm) {
+  if (shm->header != NULL)
+    munmap(shm->header, shm->size);
+  if (shm->sock >= 0)
+    close(shm->sock);
+  free(shm);
+}
+
+// frame n, 0 if it is being written or already overwritten
+static int read_slot(mjpeg2http_shm_t *shm, uint64_t n,
+                     mjpeg2http_shm_frame_t *frame) {
+  struct shm_slot *slot = slot_of(shm->header, n);
+  if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != n)
+    return 0;
+  frame->seq = n;
+  frame->data = (const uint8_t *)slot + SHM_SLOT_HEADER;
+  frame->len = slot->len;
+  frame->sequence = slot->sequence;
+  frame->timestamp = slot->timestamp;
+  return mjpeg2http_shm_valid(shm, frame);
+}
+
+int mjpeg2http_shm_valid(mjpeg2http_shm_t *shm,
+                         const mjpeg2http_shm_frame_t *frame) {
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(&slot_of(shm->header, frame->seq)->seq,
+                         __ATOMIC_RELAXED) == frame->seq;
+}
+
+int mjpeg2http_shm_latest(mjpeg2http_shm_t *shm,
+                          mjpeg2http_shm_frame_t *frame) {
+  for (;;) {
+    uint64_t head = __atomic_load_n(&shm->header->head, __ATOMIC_ACQUIRE);
+    if (head == 0)
+      return 0;
+    if (read_slot(shm, head, frame))
+      return 1;
+  }
+}
+
+int mjpeg2http_shm_next(mjpeg2http_shm_t *shm, mjpeg2http_shm_frame_t *frame,
+                        int timeout_ms) {
+  struct shm_header *header = shm->header;
+  uint64_t after = frame->seq > 0
+                       ? frame->seq
+                       : __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+  struct timespec end, now, left;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  end.tv_sec += timeout_ms / 1000;
+  end.tv_nsec += (timeout_ms % 1000) * 1000000L;
+  if (end.tv_nsec >= 1000000000L) {
+    ++end.tv_sec;
+    end.tv_nsec -= 1000000000L;
+  }
+
+  for (;;) {
+    uint32_t beep = __atomic_load_n(&header->futex, __ATOMIC_ACQUIRE);
+    uint64_t head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+    uint64_t want = after + 1;
+    // lapped: the frames in between are gone or about to be
+    if (want + header->slots - 1 <= head)
+      want = head;
+    if (want <= head) {
+      if (read_slot(shm, want, frame))
+        return 1;
+      continue;
+    }
+    if (__atomic_load_n(&header->closed, __ATOMIC_ACQUIRE))
+      return -1;
+
+    const struct timespec *timeout = NULL;
+    if (timeout_ms >= 0) {
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      left.tv_sec = end.tv_sec - now.tv_sec;
+      left.tv_nsec = end.tv_nsec - now.tv_nsec;
+      if (left.tv_nsec < 0) {
+        --left.tv_sec;
+        left.tv_nsec += 1000000000L;
+      }
+      if (left.tv_sec < 0)
+        return 0;
+      timeout = &left;
+    }
+    if (futex(&header->futex, FUTEX_WAIT, beep, timeout) < 0 &&
+        errno == ETIMEDOUT)
+      return 0;
+  }
+}
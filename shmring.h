@@ -0,0 +1,101 @@
+/**
+ *  mjpeg2http
+ *
+ *  Copyright (c) 2022 Antonino Nolano. Licensed under the MIT license, as
+ * follows:
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "constants.h"
+#include "frame.h"
+#include "metrics.h"
+#include "ring.h"
+
+#define SHM_MAGIC 0x6d6a7067 /* "mjpg" */
+#define SHM_VERSION 1
+#define SHM_SLOT_HEADER 64
+
+/*
+ * layout of the memfd shared with local consumers: this header, then slots
+ * of slot_size bytes (SHM_SLOT_HEADER of struct shm_slot and the jpeg).
+ * Frame n (from 1) lives in slot n % slots, the slot seq is 0 while the
+ * frame is being written (seqlock), so a reader that is lapped notices it
+ */
+struct shm_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t slots;
+  uint32_t slot_size;
+  uint64_t head;   /* last published frame, 0: none yet */
+  uint32_t futex;  /* bumped on every frame, consumers wait on it */
+  uint32_t closed; /* the producer is gone */
+};
+
+struct shm_slot {
+  uint64_t seq;
+  uint32_t len;
+  uint32_t sequence;  /* of the source */
+  uint64_t timestamp; /* capture, CLOCK_MONOTONIC usec */
+};
+
+/*
+ * shared memory output: a ring reader of its own that copies the frames of
+ * one camera into the memfd. The memfd is handed out (read only, with
+ * SCM_RIGHTS) to every process connecting to a unix socket; the camera is
+ * subscribed while at least one of them stays connected. Consumers are
+ * never waited for: a slow one is overwritten
+ */
+typedef struct shmring {
+  int camera;
+  int reader; /* ring reader index */
+  ring_t *ring;
+  int exit_fd;
+  metrics_set_t *metrics;
+  pthread_t thread;
+  int memfd;
+  int listen_fd;
+  char path[108];
+  struct shm_header *header;
+  size_t size;
+  int consumers[SHM_MAX_CONSUMERS];
+  int numConsumers;
+  int too_large; /* frames above slot_size */
+
+  /* library callbacks, called from the shm thread with ctx */
+  void *ctx;
+  void (*camera_join)(void *ctx, int camera);
+  void (*camera_leave)(void *ctx, int camera);
+} shmring_t;
+
+int shmring_open(shmring_t *shm, const char *path, int slots, int slot_size);
+void shmring_close(shmring_t *shm);
+// 1 when published, 0 if the frame does not fit into a slot
+int shmring_publish(shmring_t *shm, frame_t *frame);
+int shmring_start(shmring_t *shm);
+void shmring_join(shmring_t *shm);
+
+#endif
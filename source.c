@@ -0,0 +1,127 @@
+/**
+ *  mjpeg2http
+ *
+ *  Copyright (c) 2022 Antonino Nolano. Licensed under the MIT license, as
+ * follows:
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "source.h"
+#include "video.h"
+
+static int v4l2_open(source_t *source, const char *device, int width,
+                     int height, int rate) {
+  video_t *video = malloc(sizeof(video_t));
+  if (video == NULL)
+    return -1;
+  source->fd = video_init(video, device, width, height, rate);
+  if (source->fd < 0) {
+    free(video);
+    return -1;
+  }
+  source->priv = video;
+  return 1;
+}
+
+static void v4l2_close(source_t *source) {
+  video_deinit(source->priv);
+  free(source->priv);
+  source->priv = NULL;
+}
+
+static int v4l2_dequeue(source_t *source, struct source_buffer *buffer) {
+  struct video_buffer vb;
+  int r = video_dequeue(source->priv, &vb);
+  if (r > 0) {
+    buffer->index = vb.index;
+    buffer->start = vb.start;
+    buffer->bytesused = vb.bytesused;
+    buffer->sequence = vb.sequence;
+    buffer->timestamp = vb.timestamp;
+  }
+  return r;
+}
+
+static int v4l2_requeue(source_t *source, int index) {
+  return video_requeue(source->priv, index);
+}
+
+static int v4l2_queued(source_t *source) { return video_queued(source->priv); }
+
+const struct source_ops v4l2_source_ops = {
+    .name = "v4l2",
+    .open = v4l2_open,
+    .close = v4l2_close,
+    .dequeue = v4l2_dequeue,
+    .requeue = v4l2_requeue,
+    .queued = v4l2_queued,
+};
+
+// strips a trailing @fps, returns the rate or -1 if there is none
+int source_split_rate(const char *location, char *path, int size) {
+  snprintf(path, size, "%s", location);
+  char *at = strrchr(path, '@');
+  if (at == NULL || at[1] == 0 ||
+      strspn(at + 1, "0123456789") != strlen(at + 1))
+    return -1;
+  *at = 0;
+  return atoi(at + 1);
+}
+
+int source_open(source_t *source, const char *location, int width, int height,
+                int rate) {
+  char path[PATH_MAX];
+  struct stat st;
+
+  source->ops = &v4l2_source_ops;
+  source->fd = -1;
+  source->priv = NULL;
+
+  source_split_rate(location, path, sizeof(path));
+  if (strncmp(location, "http://", 7) == 0) {
+    source->ops = &relay_source_ops;
+  } else if (strcmp(location, "app:") == 0) {
+    source->ops = &app_source_ops;
+  } else if (strncmp(location, "unix:", 5) == 0) {
+    source->ops = &push_source_ops;
+  } else if (strncmp(location, "replay:", 7) == 0) {
+    source->ops = &replay_source_ops;
+    location += 7;
+  } else if (stat(path, &st) == 0 && !S_ISCHR(st.st_mode)) {
+    source->ops = &replay_source_ops;
+  }
+
+  return source->ops->open(source, location, width, height, rate);
+}
+
+int source_stream(source_t *source, int on) {
+  return source->ops->stream != NULL ? source->ops->stream(source, on) : 1;
+}
+
+void source_close(source_t *source) {
+  source->ops->close(source);
+  source->fd = -1;
+}
@@ -0,0 +1,88 @@
+/**
+ *  mjpeg2http
+ *
+ *  Copyright (c) 2022 Antonino Nolano. Licensed under the MIT license, as
+ * follows:
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef SOURCE_H
+#define SOURCE_H
+
+#include <stdint.h>
+
+/* frame owned by the library until it is given back with requeue */
+struct source_buffer {
+  int index;
+  uint8_t *start;
+  uint32_t bytesused;
+  uint32_t sequence;
+  uint64_t timestamp; /* capture time, CLOCK_MONOTONIC usec, 0 if unknown */
+};
+
+typedef struct source source_t;
+
+struct source_ops {
+  const char *name;
+  int (*open)(source_t *source, const char *location, int width, int height,
+              int rate);
+  void (*close)(source_t *source);
+  // 1 when a frame is returned, 0 when there is none, -1 on error
+  int (*dequeue)(source_t *source, struct source_buffer *buffer);
+  // NULL when buffers stay valid until close
+  int (*requeue)(source_t *source, int index);
+  // buffers still owned by the producer, NULL when there is no such limit
+  int (*queued)(source_t *source);
+  // camera turned on or off, NULL when the source runs all the time
+  int (*stream)(source_t *source, int on);
+};
+
+struct source {
+  const struct source_ops *ops;
+  int fd; /* readable when a frame can be dequeued */
+  void *priv;
+};
+
+extern const struct source_ops v4l2_source_ops;
+extern const struct source_ops replay_source_ops;
+extern const struct source_ops relay_source_ops;
+extern const struct source_ops push_source_ops;
+extern const struct source_ops app_source_ops;
+
+/*
+ * location is a V4L2 device (/dev/video0), a directory of JPEG files or a
+ * concatenated MJPEG file; "replay:" forces the replay source and a
+ * trailing "@fps" sets its rate, @0 meaning as fast as possible. An
+ * http:// url relays an upstream MJPEG stream, unix:/path takes the frames
+ * pushed by a local producer and app: those of the application
+ */
+int source_open(source_t *source, const char *location, int width, int height,
+                int rate);
+int source_stream(source_t *source, int on);
+// app: source, 1 when queued, 0 when dropped (camera off, no free buffer
+// or no memory for the copy), data is copied unless release is given, then
+// it is called once the frame is no longer used
+int app_source_push(source_t *source, const uint8_t *data, uint32_t len,
+                    uint64_t timestamp, void (*release)(void *),
+                    void *opaque);
+void source_close(source_t *source);
+int source_split_rate(const char *location, char *path, int size);
+
+#endif
@@ -23,106 +23,1077 @@
  * IN THE SOFTWARE.
  */
 
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <netinet/in.h>
 #include <malloc.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
 
+#include "client.h"
 #include "libmjpeg2http.h"
+#include "rtp.h"
+#include "shaper.h"
+#include "shmring.h"
+#include "source.h"
 
-size_t allocated = 0, freed = 0;
-
-void *my_malloc_hook(size_t, const void *);
-void my_free_hook(void *, const void *);
-void *my_realloc_hook(void *ptr, size_t size, const void *caller);
-
-void *(*old_malloc_hook)(size_t, const void *);
-void (*old_free_hook)(void *, const void *);
-void (*old_realloc_hook)(void *ptr, size_t size, const void *caller);
-
-void my_init(void) {
-  old_malloc_hook = __malloc_hook;
-  old_free_hook = __free_hook;
-  old_realloc_hook = __realloc_hook;
-  __malloc_hook = my_malloc_hook;
-  __free_hook = my_free_hook;
-  __realloc_hook = my_realloc_hook;
-}
-
-void *my_realloc_hook(void *ptr, size_t size, const void *caller) {
-  ++allocated;
-  void *result;
-  /* Restore all old hooks */
-  __malloc_hook = old_malloc_hook;
-  __free_hook = old_free_hook;
-  __realloc_hook = old_realloc_hook;
-  /* Call recursively */
-  result = realloc(ptr, size);
-  /* Save underlying hooks */
-  old_malloc_hook = __malloc_hook;
-  old_free_hook = __free_hook;
-  old_realloc_hook = __realloc_hook;
-  /* Restore our own hooks */
-  __malloc_hook = my_malloc_hook;
-  __free_hook = my_free_hook;
-  __realloc_hook = my_realloc_hook;
+size_t allocated = 0, freed = 0, live = 0;
+
+// glibc dropped __malloc_hook, so wrap the allocator instead
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static void count_alloc(void *ptr) {
+  if (ptr != NULL) {
+    __atomic_add_fetch(&allocated, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&live, malloc_usable_size(ptr), __ATOMIC_RELAXED);
+  }
+}
+
+static void count_free(void *ptr) {
+  if (ptr != NULL) {
+    __atomic_add_fetch(&freed, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&live, malloc_usable_size(ptr), __ATOMIC_RELAXED);
+  }
+}
+
+void *malloc(size_t size) {
+  void *result = __libc_malloc(size);
+  count_alloc(result);
+  return result;
+}
+
+void *calloc(size_t nmemb, size_t size) {
+  void *result = __libc_calloc(nmemb, size);
+  count_alloc(result);
   return result;
 }
 
-void *my_malloc_hook(size_t size, const void *caller) {
-  ++allocated;
-  void *result;
-  /* Restore all old hooks */
-  __malloc_hook = old_malloc_hook;
-  __free_hook = old_free_hook;
-  __realloc_hook = old_realloc_hook;
-  /* Call recursively */
-  result = malloc(size);
-  /* Save underlying hooks */
-  old_malloc_hook = __malloc_hook;
-  old_free_hook = __free_hook;
-  old_realloc_hook = __realloc_hook;
-  /* Restore our own hooks */
-  __malloc_hook = my_malloc_hook;
-  __free_hook = my_free_hook;
-  __realloc_hook = my_realloc_hook;
+void *realloc(void *ptr, size_t size) {
+  count_free(ptr);
+  void *result = __libc_realloc(ptr, size);
+  count_alloc(result);
   return result;
 }
 
-void my_free_hook(void *ptr, const void *caller) {
-  ++freed;
-  /* Restore all old hooks */
-  __malloc_hook = old_malloc_hook;
-  __free_hook = old_free_hook;
-  __realloc_hook = old_realloc_hook;
-  /* Call recursively */
-  free(ptr);
-  /* Save underlying hooks */
-  old_malloc_hook = __malloc_hook;
-  old_free_hook = __free_hook;
-  old_realloc_hook = __realloc_hook;
-  /* Restore our own hooks */
-  __malloc_hook = my_malloc_hook;
-  __free_hook = my_free_hook;
-  __realloc_hook = my_realloc_hook;
-}
-
-void stop(void *p) {
+void free(void *ptr) {
+  count_free(ptr);
+  __libc_free(ptr);
+}
+
+#define TEST_TOKEN "mytoken"
+#define TEST_FRAME_SIZE 1000000
+
+// heap used by n connections going through probe, request, auth and a
+// pending partial write of one large frame
+static int test_clients(int n) {
+  int(*peers)[2] = calloc(n, sizeof(*peers));
+  client_t **clients = calloc(n, sizeof(client_t *));
+  uint8_t *jpeg = calloc(1, TEST_FRAME_SIZE);
+  const char *request_start = "GET /path?";
+  const char *request_end = TEST_TOKEN " HTTP/1.1\r\n\r\n";
+  int i, failed = 0;
+
+  // warm up stdio and the rx pool so that they are not charged to clients
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, peers[0]) < 0) {
+    perror("socketpair");
+    return 1;
+  }
+  clients[0] = client_init("127.0.0.1", 10000, peers[0][0]);
+  client_parse_request(clients[0]);
+  client_free(clients[0]);
+  close(peers[0][1]);
+
+  size_t base = live;
+  for (i = 0; i < n; ++i) {
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, peers[i]) < 0) {
+      perror("socketpair");
+      return 1;
+    }
+    clients[i] = client_init("127.0.0.1", 10000 + i, peers[i][0]);
+  }
+  size_t connected = live;
+
+  for (i = 0; i < n; ++i) {
+    if (write(peers[i][1], request_start, strlen(request_start)) < 0 ||
+        client_parse_request(clients[i]) != 0)
+      failed = 1;
+  }
+  size_t parsing = live;
+
+  for (i = 0; i < n; ++i) {
+    if (write(peers[i][1], request_end, strlen(request_end)) < 0 ||
+        client_parse_request(clients[i]) != 1)
+      failed = 1;
+    client_release_request(clients[i]);
+    clients[i]->is_auth = 1;
+  }
+  size_t authenticated = live;
+
+  frame_t *frame = frame_create("header", 6, jpeg, TEST_FRAME_SIZE, "end", 3);
+  size_t with_frame = live;
+  for (i = 0; i < n; ++i) {
+    client_enqueue_frame(clients[i], frame);
+    if (clients[i]->tx_frame != frame)
+      failed = 1; // partial write expected
+  }
+  frame_unref(frame);
+  size_t streaming = live;
+
+  for (i = 0; i < n; ++i) {
+    client_free(clients[i]);
+    close(peers[i][1]);
+  }
+  size_t closed = live;
+
+  printf("sizeof(client_t)=%zu bytes\n", sizeof(client_t));
+  printf("per connection: connected=%zu request=%zu authenticated=%zu "
+         "streaming=%zu bytes\n",
+         (connected - base) / n, (parsing - base) / n,
+         (authenticated - base) / n, (streaming - with_frame) / n);
+  printf("leaked=%zd bytes\n", (ssize_t)(closed - base));
+
+  if (closed != base) {
+    printf("FAIL: memory leak\n");
+    failed = 1;
+  }
+  if ((authenticated - base) / n > sizeof(client_t) + 16) {
+    printf("FAIL: idle connection is larger than client_t\n");
+    failed = 1;
+  }
+  if (streaming != with_frame) {
+    printf("FAIL: pending write copies the frame\n");
+    failed = 1;
+  }
+
+  free(jpeg);
+  free(clients);
+  free(peers);
+  printf("%s\n", failed ? "FAIL" : "OK");
+  return failed;
+}
+
+#define TEST_CONFIG_PATH "/tmp/test_mjpeg2http.conf"
+
+// a config file with an invalid line changes nothing, out of range values
+// are rejected
+static int test_config() {
+  libmjpeg2http_config_t config, defaults;
+  char cpus[MJPEG2HTTP_MAX_CPUS * 3 + 8] = "0";
+  int failed = 0;
+
+  libmjpeg2http_defaultConfig(&defaults);
+  config = defaults;
+  FILE *file = fopen(TEST_CONFIG_PATH, "w");
+  if (file == NULL)
+    return 1;
+  fprintf(file, "fps = 10 # comment\nworkers = 2\nbogus = 1\n");
+  fclose(file);
+  if (libmjpeg2http_loadConfig(&config, TEST_CONFIG_PATH) >= 0 ||
+      memcmp(&config, &defaults, sizeof(config)) != 0) {
+    printf("FAIL: invalid file applied\n");
+    failed = 1;
+  }
+
+  file = fopen(TEST_CONFIG_PATH, "w");
+  fprintf(file, "fps = 10 # comment\nworkers = 2\n");
+  fclose(file);
+  if (libmjpeg2http_loadConfig(&config, TEST_CONFIG_PATH) < 0 ||
+      config.fps != 10 || config.workers != 2) {
+    printf("FAIL: valid file not applied\n");
+    failed = 1;
+  }
+  unlink(TEST_CONFIG_PATH);
+
+  if (libmjpeg2http_setConfig(&config, "fps", "0") >= 0) {
+    printf("FAIL: fps 0 accepted\n");
+    failed = 1;
+  }
+  for (int i = 1; i <= MJPEG2HTTP_MAX_CPUS; ++i)
+    snprintf(cpus + strlen(cpus), sizeof(cpus) - strlen(cpus), ",%d", i);
+  if (libmjpeg2http_setConfig(&config, "cpus", cpus) >= 0) {
+    printf("FAIL: %d cpus accepted\n", MJPEG2HTTP_MAX_CPUS + 1);
+    failed = 1;
+  }
+  *strrchr(cpus, ',') = 0;
+  if (libmjpeg2http_setConfig(&config, "cpus", cpus) < 0 ||
+      config.ncpus != MJPEG2HTTP_MAX_CPUS ||
+      config.cpus[MJPEG2HTTP_MAX_CPUS - 1] != MJPEG2HTTP_MAX_CPUS - 1) {
+    printf("FAIL: %d cpus not applied\n", MJPEG2HTTP_MAX_CPUS);
+    failed = 1;
+  }
+  printf("%s\n", failed ? "FAIL" : "OK");
+  return failed;
+}
+
+#define TEST_RTP_GROUP "239.255.42.42"
+#define TEST_RTP_PORT 15004
+#define TEST_RTP_SCAN 50000
+#define TEST_RTP_LARGE_SCAN 200000 /* more packets than the initial arrays */
+
+// baseline 4:2:0 jpeg with restart markers, the scan is random bytes
+static uint32_t test_jpeg(uint8_t *jpeg, uint32_t scan_len) {
+  static const uint8_t sof[] = {0xFF, 0xC0, 0, 17, 8, 0x01, 0xE0, 0x02, 0x80,
+                                3,    1,    0x22, 0, 2, 0x11, 1, 3, 0x11, 1};
+  static const uint8_t dri[] = {0xFF, 0xDD, 0, 4, 0, 40};
+  static const uint8_t sos[] = {0xFF, 0xDA, 0, 12, 3, 1, 0x00, 2,
+                                0x11, 3,    0x11, 0, 63, 0};
+  uint32_t n = 0;
+  jpeg[n++] = 0xFF;
+  jpeg[n++] = 0xD8;
+  for (int t = 0; t < 2; ++t) {
+    jpeg[n++] = 0xFF;
+    jpeg[n++] = 0xDB;
+    jpeg[n++] = 0;
+    jpeg[n++] = 67;
+    jpeg[n++] = t;
+    for (int i = 0; i < 64; ++i)
+      jpeg[n++] = 1 + t + i;
+  }
+  memcpy(jpeg + n, sof, sizeof(sof));
+  n += sizeof(sof);
+  memcpy(jpeg + n, dri, sizeof(dri));
+  n += sizeof(dri);
+  memcpy(jpeg + n, sos, sizeof(sos));
+  n += sizeof(sos);
+  for (uint32_t i = 0; i < scan_len; ++i)
+    jpeg[n++] = rand() % 255;
+  jpeg[n++] = 0xFF;
+  jpeg[n++] = 0xD9;
+  return n;
+}
+
+// one frame sent to a multicast group on loopback and put together again
+static int test_rtp_frame(rtp_t *rtp, int fd, uint32_t scan_len) {
+  uint8_t *jpeg = malloc(scan_len + 1024), packet[2048];
+  uint8_t *scan = calloc(1, scan_len);
+  uint32_t len = test_jpeg(jpeg, scan_len), received = 0;
+  int failed = 0, packets = 0, marker = 0, seq = -1;
+
+  frame_t *frame = frame_create("header", 6, jpeg, len, "end", 3);
+  frame->timestamp = 1000000;
+  if (rtp_send_frame(rtp, frame) != 1) {
+    printf("FAIL: frame not sent\n");
+    failed = 1;
+  }
+
+  while (!marker && !failed) {
+    ssize_t n = recv(fd, packet, sizeof(packet), 0);
+    if (n < 24) {
+      printf("FAIL: %s\n", n < 0 ? "packet lost" : "short packet");
+      failed = 1;
+      break;
+    }
+    int pt = packet[1] & 0x7F, s = packet[2] << 8 | packet[3];
+    uint32_t offset = packet[13] << 16 | packet[14] << 8 | packet[15];
+    int hlen = 12 + 8 + 4; // type 65: restart header
+    marker = packet[1] >> 7;
+    if (offset == 0)
+      hlen += 4 + 128;
+    if (pt != 26 || packet[16] != 65 || packet[17] != 255 ||
+        packet[18] != 80 || packet[19] != 60 || (seq >= 0 && s != seq + 1) ||
+        offset != received || offset + n - hlen > scan_len ||
+        n > RTP_PACKET_SIZE ||
+        (offset == 0 && (packet[24 + 3] != 128 || packet[28] != 1 ||
+                         packet[28 + 64] != 2))) {
+      printf("FAIL: packet %d not valid\n", packets);
+      failed = 1;
+    }
+    memcpy(scan + offset, packet + hlen, n - hlen);
+    received += n - hlen;
+    seq = s;
+    ++packets;
+  }
+  if (!failed && (received != scan_len ||
+                  memcmp(scan, jpeg + len - 2 - scan_len, received))) {
+    printf("FAIL: scan not reassembled\n");
+    failed = 1;
+  }
+  printf("rtp: %d packets, %u bytes of scan\n", packets, received);
+
+  frame_unref(frame);
+  free(scan);
+  free(jpeg);
+  return failed;
+}
+
+static int test_rtp() {
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  struct sockaddr_in addr = {.sin_family = AF_INET,
+                             .sin_port = htons(TEST_RTP_PORT)};
+  struct ip_mreq mreq;
+  inet_pton(AF_INET, TEST_RTP_GROUP, &addr.sin_addr);
+  inet_pton(AF_INET, TEST_RTP_GROUP, &mreq.imr_multiaddr);
+  inet_pton(AF_INET, "127.0.0.1", &mreq.imr_interface);
+  struct timeval tv = {1, 0};
+  int rcvbuf = 1 << 20; // the large frame is sent before it is read
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) <
+          0) {
+    perror("rtp receiver");
+    return 1;
+  }
+
+  rtp_t rtp;
+  if (rtp_open(&rtp, TEST_RTP_GROUP ":15004", "127.0.0.1", 0, 0) < 0)
+    return 1;
+  int failed = test_rtp_frame(&rtp, fd, TEST_RTP_SCAN) ||
+               test_rtp_frame(&rtp, fd, TEST_RTP_LARGE_SCAN);
+
+  rtp_close(&rtp);
+  close(fd);
+  printf("%s\n", failed ? "FAIL" : "OK");
+  return failed;
+}
+
+static int g_ring_released = 0;
+static void test_ring_release(frame_t *frame) {
+  ++g_ring_released;
+  free(frame);
+}
+
+// a frame is given back as soon as both readers have dropped theirs, not
+// when its slot is reused
+static int test_ring() {
+  static uint8_t jpeg[1000];
+  ring_t ring;
+  int failed = 0;
+
+  if (ring_init(&ring, 2) < 0)
+    return 1;
+  for (int n = 0; n < 2 * RING_SIZE && !failed; ++n) {
+    frame_t *frame = frame_wrap("header", 6, jpeg, sizeof(jpeg), "end", 3,
+                                test_ring_release, NULL);
+    ring_publish(&ring, frame);
+    frame_unref(frame);
+    frame_unref(ring_read(&ring, 0));
+    if (g_ring_released != n) {
+      printf("FAIL: frame %d released before the second reader\n", n);
+      failed = 1;
+    }
+    frame_unref(ring_read(&ring, 1));
+    if (g_ring_released != n + 1) {
+      printf("FAIL: frame %d still held by the ring\n", n);
+      failed = 1;
+    }
+  }
+  ring_destroy(&ring);
+  printf("%s\n", failed ? "FAIL" : "OK");
+  return failed;
+}
+
+#define TEST_SHM_PATH "/tmp/test_mjpeg2http_shm"
+
+static int g_joined = 0;
+static void test_join(void *ctx, int camera) {
+  __atomic_add_fetch(&g_joined, 1, 0);
+}
+static void test_leave(void *ctx, int camera) {
+  __atomic_sub_fetch(&g_joined, 1, 0);
+}
+
+static void test_publish(ring_t *ring, int n) {
+  uint8_t jpeg[1000];
+  memset(jpeg, n, sizeof(jpeg));
+  frame_t *frame = frame_create("header", 6, jpeg, sizeof(jpeg), "end", 3);
+  frame->sequence = n;
+  ring_publish(ring, frame);
+  frame_unref(frame);
+}
+
+// freshest frame once the shm thread has copied frame n
+static int test_latest(mjpeg2http_shm_t *shm, mjpeg2http_shm_frame_t *frame,
+                       int n) {
+  for (int i = 0; i < 1000; ++i) {
+    if (mjpeg2http_shm_latest(shm, frame) && frame->sequence == (uint32_t)n)
+      return 1;
+    usleep(1000);
+  }
+  return 0;
+}
+
+// frames published on the ring read in place by a consumer of the memfd
+static int test_shm() {
+  ring_t ring;
+  shmring_t shm;
+  mjpeg2http_shm_frame_t frame = {0}, first;
+  int failed = 0;
+
+  if (ring_init(&ring, 1) < 0 ||
+      shmring_open(&shm, TEST_SHM_PATH, 4, 4096) < 0)
+    return 1;
+  shm.ring = &ring;
+  shm.exit_fd = eventfd(0, 0);
+  shm.camera_join = test_join;
+  shm.camera_leave = test_leave;
+  if (shmring_start(&shm) < 0)
+    return 1;
+
+  mjpeg2http_shm_t *consumer = mjpeg2http_shm_attach(TEST_SHM_PATH);
+  if (consumer == NULL || mjpeg2http_shm_latest(consumer, &frame) != 0) {
+    printf("FAIL: attach\n");
+    return 1;
+  }
+  for (int i = 0; i < 1000 && __atomic_load_n(&g_joined, 0) == 0; ++i)
+    usleep(1000);
+  if (g_joined != 1) {
+    printf("FAIL: camera not subscribed\n");
+    failed = 1;
+  }
+
+  test_publish(&ring, 1);
+  if (!test_latest(consumer, &frame, 1) || frame.len != 1000 ||
+      frame.data[0] != 1 || frame.data[999] != 1) {
+    printf("FAIL: latest frame\n");
+    failed = 1;
+  }
+  first = frame;
+  if (mjpeg2http_shm_next(consumer, &frame, 50) != 0) {
+    printf("FAIL: next without a new frame\n");
+    failed = 1;
+  }
+  test_publish(&ring, 2);
+  if (mjpeg2http_shm_next(consumer, &frame, 1000) != 1 ||
+      frame.sequence != 2 || frame.seq != first.seq + 1 ||
+      frame.data[0] != 2 || !mjpeg2http_shm_valid(consumer, &first)) {
+    printf("FAIL: next frame\n");
+    failed = 1;
+  }
+
+  // a consumer lapped by the producer skips to the freshest frame
+  for (int n = 3; n <= 10; ++n)
+    test_publish(&ring, n);
+  test_latest(consumer, &frame, 10);
+  frame = first;
+  if (mjpeg2http_shm_valid(consumer, &first) ||
+      mjpeg2http_shm_next(consumer, &frame, 1000) != 1 ||
+      frame.sequence != 10 || frame.data[0] != 10) {
+    printf("FAIL: lapped consumer\n");
+    failed = 1;
+  }
+
+  mjpeg2http_shm_detach(consumer);
+  for (int i = 0; i < 1000 && __atomic_load_n(&g_joined, 0) != 0; ++i)
+    usleep(1000);
+  if (g_joined != 0) {
+    printf("FAIL: camera still subscribed\n");
+    failed = 1;
+  }
+
+  if (write(shm.exit_fd, &(uint64_t){1}, sizeof(uint64_t)) < 0)
+    failed = 1;
+  shmring_join(&shm);
+  shmring_close(&shm);
+  ring_destroy(&ring);
+  close(shm.exit_fd);
+  printf("%s\n", failed ? "FAIL" : "OK");
+  return failed;
+}
+
+#define TEST_PUSH_PATH "/tmp/test_mjpeg2http_push"
+#define TEST_PUSH_SIZE 100000
+#define TEST_PUSH_FILE "/tmp/test_mjpeg2http_push.jpg"
+
+// control message the producer gets from the source
+static uint32_t test_control(int fd) {
+  mjpeg2http_push_t msg = {0, 0, 0};
+  struct pollfd pfd = {fd, POLLIN, 0};
+  if (poll(&pfd, 1, 1000) != 1 || recv(fd, &msg, sizeof(msg), 0) < 0)
+    return 0;
+  return msg.type;
+}
+
+static int test_dequeue(source_t *source, struct source_buffer *buffer) {
+  struct pollfd pfd = {source->fd, POLLIN, 0};
+  for (int i = 0; i < 10 && poll(&pfd, 1, 1000) == 1; ++i) {
+    if (source->ops->dequeue(source, buffer) == 1)
+      return 1;
+  }
+  return 0;
+}
+
+// header of a frame held by memfd
+static int test_send_fd(int fd, mjpeg2http_push_t *msg, int memfd) {
+  struct iovec iov = {msg, sizeof(*msg)};
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } control;
+  struct msghdr mh = {.msg_iov = &iov, .msg_iovlen = 1};
+  mh.msg_control = control.buf;
+  mh.msg_controllen = sizeof(control.buf);
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &memfd, sizeof(int));
+  return sendmsg(fd, &mh, 0) < 0 ? -1 : 1;
+}
+
+// a producer pushing one frame inline and the others in a sealed memfd, an
+// unsealed one and a plain file
+static int test_push() {
+  source_t source;
+  struct source_buffer buffer;
+  struct sockaddr_un addr = {.sun_family = AF_UNIX, .sun_path = TEST_PUSH_PATH};
+  uint8_t *jpeg = malloc(TEST_PUSH_SIZE);
+  int failed = 0;
+
+  for (int i = 0; i < TEST_PUSH_SIZE; ++i)
+    jpeg[i] = i;
+  if (source_open(&source, "unix:" TEST_PUSH_PATH, 0, 0, 0) < 0)
+    return 1;
+  int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    perror("connect");
+    return 1;
+  }
+
+  // the camera is off until the library turns it on
+  source.ops->dequeue(&source, &buffer);
+  if (test_control(fd) != MJPEG2HTTP_PUSH_STOP ||
+      source_stream(&source, 1) < 0 ||
+      test_control(fd) != MJPEG2HTTP_PUSH_START) {
+    printf("FAIL: start not signalled\n");
+    failed = 1;
+  }
+
+  mjpeg2http_push_t msg = {MJPEG2HTTP_PUSH_FRAME, TEST_PUSH_SIZE, 1234};
+  struct iovec iov[2] = {{&msg, sizeof(msg)}, {jpeg, TEST_PUSH_SIZE}};
+  struct msghdr mh = {.msg_iov = iov, .msg_iovlen = 2};
+  if (sendmsg(fd, &mh, 0) < 0 || !test_dequeue(&source, &buffer) ||
+      buffer.bytesused != TEST_PUSH_SIZE || buffer.timestamp != 1234 ||
+      memcmp(buffer.start, jpeg, TEST_PUSH_SIZE) != 0) {
+    printf("FAIL: inline frame\n");
+    failed = 1;
+  }
+  int first = buffer.index;
+
+  // a sealed memfd is mapped by the source
+  int sealed = memfd_create("frame", MFD_ALLOW_SEALING);
+  if (write(sealed, jpeg, TEST_PUSH_SIZE) != TEST_PUSH_SIZE ||
+      fcntl(sealed, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE) <
+          0)
+    failed = 1;
+  msg.timestamp = 0;
+  if (test_send_fd(fd, &msg, sealed) < 0 || !test_dequeue(&source, &buffer) ||
+      buffer.bytesused != TEST_PUSH_SIZE || buffer.index == first ||
+      memcmp(buffer.start, jpeg, TEST_PUSH_SIZE) != 0) {
+    printf("FAIL: memfd frame\n");
+    failed = 1;
+  }
+  int second = buffer.index;
+  close(sealed);
+
+  // one that the producer can still truncate is copied, not mapped
+  int unsealed = memfd_create("frame", 0);
+  if (write(unsealed, jpeg, TEST_PUSH_SIZE) != TEST_PUSH_SIZE)
+    failed = 1;
+  if (test_send_fd(fd, &msg, unsealed) < 0 ||
+      !test_dequeue(&source, &buffer) || buffer.bytesused != TEST_PUSH_SIZE ||
+      ftruncate(unsealed, 0) < 0 ||
+      memcmp(buffer.start, jpeg, TEST_PUSH_SIZE) != 0) {
+    printf("FAIL: unsealed memfd frame\n");
+    failed = 1;
+  }
+  close(unsealed);
+  source.ops->requeue(&source, buffer.index);
+
+  // so is a plain file, which has no seals at all
+  int plain = open(TEST_PUSH_FILE, O_RDWR | O_CREAT | O_TRUNC, 0600);
+  unlink(TEST_PUSH_FILE);
+  if (write(plain, jpeg, TEST_PUSH_SIZE) != TEST_PUSH_SIZE)
+    failed = 1;
+  if (test_send_fd(fd, &msg, plain) < 0 || !test_dequeue(&source, &buffer) ||
+      buffer.bytesused != TEST_PUSH_SIZE || ftruncate(plain, 0) < 0 ||
+      memcmp(buffer.start, jpeg, TEST_PUSH_SIZE) != 0) {
+    printf("FAIL: plain file frame\n");
+    failed = 1;
+  }
+  close(plain);
+  if (source.ops->queued(&source) != PUSH_BUFFERS - 3)
+    failed = 1;
+  source.ops->requeue(&source, first);
+  source.ops->requeue(&source, second);
+  source.ops->requeue(&source, buffer.index);
+
+  if (source_stream(&source, 0) < 0 ||
+      test_control(fd) != MJPEG2HTTP_PUSH_STOP) {
+    printf("FAIL: stop not signalled\n");
+    failed = 1;
+  }
+
+  close(fd);
+  source_close(&source);
+  free(jpeg);
+  printf("%s\n", failed ? "FAIL" : "OK");
+  return failed;
+}
+
+#define TEST_SERVER_PORT 18081
+#define TEST_SERVER_SIZE 10000
+
+static void *test_run(void *server) {
+  mjpeg2http_server_run(server);
+  return NULL;
+}
+
+static int g_released = 0;
+static void test_release(void *opaque) {
+  __atomic_add_fetch(&g_released, 1, __ATOMIC_RELAXED);
+}
+
+// viewer of server i, with the request sent
+static int test_viewer(int i) {
+  struct sockaddr_in addr = {.sin_family = AF_INET,
+                             .sin_port = htons(TEST_SERVER_PORT + i),
+                             .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+  const char *request = "GET /path?" TEST_TOKEN " HTTP/1.1\r\n\r\n";
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  for (int tries = 0; tries < 100; ++tries) {
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+      return write(fd, request, strlen(request)) > 0 ? fd : -1;
+    usleep(10000);
+  }
+  close(fd);
+  return -1;
+}
+
+// two servers in one process, each fed by its own pushes
+static int test_server() {
+  mjpeg2http_server_t *servers[2];
+  pthread_t threads[2];
+  uint8_t *jpeg[2], *rx = malloc(4 * TEST_SERVER_SIZE);
+  int fds[2], accepted[2] = {0, 0}, nocopy = 0, failed = 0;
+
+  for (int i = 0; i < 2; ++i) {
+    jpeg[i] = malloc(TEST_SERVER_SIZE);
+    memset(jpeg[i], 'A' + i, TEST_SERVER_SIZE);
+    servers[i] = mjpeg2http_server_create(NULL, "127.0.0.1",
+                                          TEST_SERVER_PORT + i, NULL,
+                                          TEST_TOKEN, NULL);
+    if (servers[i] == NULL)
+      return 1;
+    pthread_create(&threads[i], NULL, test_run, servers[i]);
+  }
+  for (int i = 0; i < 2; ++i) {
+    fds[i] = test_viewer(i);
+    if (fds[i] < 0) {
+      printf("FAIL: cannot connect to server %d\n", i);
+      return 1;
+    }
+  }
+
+  // frames are dropped until the viewer has turned the camera on
+  for (int n = 0; n < 200 && (accepted[0] < 5 || accepted[1] < 5); ++n) {
+    for (int i = 0; i < 2; ++i) {
+      int ret = n % 2 == 0 ? mjpeg2http_push_frame(servers[i], jpeg[i],
+                                                   TEST_SERVER_SIZE, 0)
+                           : mjpeg2http_push_frame_nocopy(
+                                 servers[i], jpeg[i], TEST_SERVER_SIZE, 0,
+                                 test_release, NULL);
+      if (ret < 0)
+        failed = 1;
+      accepted[i] += ret > 0;
+      nocopy += ret > 0 && n % 2 == 1;
+    }
+    usleep(10000);
+  }
+  printf("accepted %d and %d frames\n", accepted[0], accepted[1]);
+
+  // each viewer sees the frames of its own server only
+  for (int i = 0; i < 2; ++i) {
+    int len = 0, r;
+    struct pollfd pfd = {fds[i], POLLIN, 0};
+    while (len < 4 * TEST_SERVER_SIZE && poll(&pfd, 1, 200) == 1 &&
+           (r = read(fds[i], rx + len, 4 * TEST_SERVER_SIZE - len)) > 0)
+      len += r;
+    if (memmem(rx, len, jpeg[i], TEST_SERVER_SIZE) == NULL ||
+        memmem(rx, len, jpeg[1 - i], 100) != NULL) {
+      printf("FAIL: wrong frames from server %d\n", i);
+      failed = 1;
+    }
+    close(fds[i]);
+  }
+
+  for (int i = 0; i < 2; ++i) {
+    mjpeg2http_server_stop(servers[i]);
+    pthread_join(threads[i], NULL);
+    mjpeg2http_server_destroy(servers[i]);
+    free(jpeg[i]);
+  }
+  if (accepted[0] < 5 || accepted[1] < 5 ||
+      __atomic_load_n(&g_released, __ATOMIC_RELAXED) != nocopy) {
+    printf("FAIL: accepted=%d,%d released=%d of %d\n", accepted[0],
+           accepted[1], g_released, nocopy);
+    failed = 1;
+  }
+  free(rx);
+  printf("%s\n", failed ? "FAIL" : "OK");
+  return failed;
+}
+
+#define TEST_ZEROCOPY_FRAMES 100
+#define TEST_METRICS_TOKEN "metricstoken"
+
+// counter of /metrics, -1 if it is missing
+static long test_metric(int port, const char *name) {
+  struct sockaddr_in addr = {.sin_family = AF_INET,
+                             .sin_port = htons(port),
+                             .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+  const char *request = "GET /metrics?" TEST_METRICS_TOKEN " HTTP/1.1\r\n\r\n";
+  char body[32768];
+  int fd = socket(AF_INET, SOCK_STREAM, 0), len = 0, r;
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      write(fd, request, strlen(request)) < 0) {
+    close(fd);
+    return -1;
+  }
+  struct pollfd pfd = {fd, POLLIN, 0};
+  while (len < (int)sizeof(body) - 1 && poll(&pfd, 1, 200) == 1 &&
+         (r = read(fd, body + len, sizeof(body) - 1 - len)) > 0)
+    len += r;
+  close(fd);
+  body[len] = 0;
+  for (char *line = strstr(body, name); line != NULL;
+       line = strstr(line + 1, name)) {
+    if (line[-1] == '\n' && line[strlen(name)] == ' ')
+      return atol(line + strlen(name) + 1);
+  }
+  return -1;
+}
+
+// frames of a viewer that keeps up are sent from the source buffers, the
+// ring and the worker must not hold on to them
+static int test_zerocopy() {
+  libmjpeg2http_config_t config;
+  pthread_t thread;
+  uint8_t *jpeg = malloc(TEST_SERVER_SIZE), rx[65536];
+  int accepted = 0, failed = 0;
+
+  libmjpeg2http_defaultConfig(&config);
+  snprintf(config.metrics_token, MJPEG2HTTP_TOKEN_SIZE, TEST_METRICS_TOKEN);
+  memset(jpeg, 'Z', TEST_SERVER_SIZE);
+  mjpeg2http_server_t *server = mjpeg2http_server_create(
+      &config, "127.0.0.1", TEST_SERVER_PORT + 2, NULL, TEST_TOKEN, NULL);
+  if (server == NULL)
+    return 1;
+  pthread_create(&thread, NULL, test_run, server);
+  int fd = test_viewer(2);
+  if (fd < 0) {
+    printf("FAIL: cannot connect\n");
+    return 1;
+  }
+
+  // the viewer reads everything between two pushes
+  for (int n = 0; n < 10 * TEST_ZEROCOPY_FRAMES &&
+                  accepted < TEST_ZEROCOPY_FRAMES;
+       ++n) {
+    int ret = mjpeg2http_push_frame(server, jpeg, TEST_SERVER_SIZE, 0);
+    if (ret < 0)
+      failed = 1;
+    accepted += ret > 0;
+    struct pollfd pfd = {fd, POLLIN, 0};
+    while (poll(&pfd, 1, 10) == 1 && read(fd, rx, sizeof(rx)) > 0)
+      ;
+  }
+  long captured = test_metric(TEST_SERVER_PORT + 2,
+                              "mjpeg2http_frames_captured_total");
+  long copied = test_metric(TEST_SERVER_PORT + 2,
+                            "mjpeg2http_frames_copied_total");
+  printf("captured %ld frames, %ld copied\n", captured, copied);
+  if (accepted < TEST_ZEROCOPY_FRAMES || captured < accepted / 2 ||
+      copied < 0 || copied > captured / 10) {
+    printf("FAIL: capture buffers not sent in place\n");
+    failed = 1;
+  }
+
+  close(fd);
+  mjpeg2http_server_stop(server);
+  pthread_join(thread, NULL);
+  mjpeg2http_server_destroy(server);
+  free(jpeg);
+  printf("%s\n", failed ? "FAIL" : "OK");
+  return failed;
+}
+
+#define TEST_SNAPSHOT_PORT (TEST_SERVER_PORT + 4)
+
+// pushes until the frame is queued, the camera may still be off
+static int test_push_until(mjpeg2http_server_t *server, uint8_t *jpeg,
+                           uint64_t timestamp) {
+  for (int i = 0; i < 200; ++i) {
+    if (mjpeg2http_push_frame(server, jpeg, TEST_SERVER_SIZE, timestamp) > 0)
+      return 1;
+    usleep(10000);
+  }
+  return 0;
+}
+
+// a snapshot of a cold camera is not answered with a frame captured before
+// it was turned off
+static int test_snapshot() {
+  struct sockaddr_in addr = {.sin_family = AF_INET,
+                             .sin_port = htons(TEST_SNAPSHOT_PORT),
+                             .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+  const char *request = "GET /snapshot?" TEST_TOKEN " HTTP/1.1\r\n\r\n";
+  uint8_t stale[TEST_SERVER_SIZE], fresh[TEST_SERVER_SIZE];
+  uint8_t *rx = malloc(2 * TEST_SERVER_SIZE);
+  pthread_t thread;
+  int failed = 0, len = 0, r;
+
+  memset(stale, 'S', sizeof(stale));
+  memset(fresh, 'F', sizeof(fresh));
+  mjpeg2http_server_t *server = mjpeg2http_server_create(
+      NULL, "127.0.0.1", TEST_SNAPSHOT_PORT, NULL, TEST_TOKEN, NULL);
+  if (server == NULL)
+    return 1;
+  pthread_create(&thread, NULL, test_run, server);
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  for (int tries = 0; tries < 100; ++tries) {
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+      break;
+    usleep(10000);
+  }
+  if (write(fd, request, strlen(request)) < 0 ||
+      !test_push_until(server, stale,
+                       metrics_usec() - 5 * SNAPSHOT_MAX_AGE_MS * 1000ULL) ||
+      !test_push_until(server, fresh, 0)) {
+    printf("FAIL: frames not pushed\n");
+    failed = 1;
+  }
+
+  struct pollfd pfd = {fd, POLLIN, 0};
+  while (len < 2 * TEST_SERVER_SIZE && poll(&pfd, 1, 500) == 1 &&
+         (r = read(fd, rx + len, 2 * TEST_SERVER_SIZE - len)) > 0)
+    len += r;
+  if (memmem(rx, len, fresh, TEST_SERVER_SIZE) == NULL ||
+      memmem(rx, len, stale, 100) != NULL) {
+    printf("FAIL: snapshot not taken from the fresh frame\n");
+    failed = 1;
+  }
+
+  close(fd);
+  mjpeg2http_server_stop(server);
+  pthread_join(thread, NULL);
+  mjpeg2http_server_destroy(server);
+  free(rx);
+  printf("%s\n", failed ? "FAIL" : "OK");
+  return failed;
+}
+
+#define TEST_RELAY_PORT (TEST_SERVER_PORT + 3)
+#define TEST_RELAY_URL "http://127.0.0.1:18084/path?" TEST_TOKEN
+
+static int g_pushing = 1, g_pushed = 0;
+
+// 100 fps into the upstream, accepted only while it has a viewer
+static void *test_pusher(void *server) {
+  uint8_t jpeg[TEST_SERVER_SIZE];
+  memset(jpeg, 'R', sizeof(jpeg));
+  while (__atomic_load_n(&g_pushing, __ATOMIC_ACQUIRE)) {
+    if (mjpeg2http_push_frame(*(mjpeg2http_server_t **)server, jpeg,
+                              sizeof(jpeg), 0) > 0)
+      __atomic_add_fetch(&g_pushed, 1, __ATOMIC_RELAXED);
+    usleep(10000);
+  }
+  return NULL;
+}
+
+// next frame of the relay within timeout_ms, given back right away
+static int test_relay_frame(source_t *source, int timeout_ms) {
+  struct source_buffer buffer;
+  struct pollfd pfd = {source->fd, POLLIN, 0};
+  uint8_t jpeg[TEST_SERVER_SIZE];
+  memset(jpeg, 'R', sizeof(jpeg));
+  uint64_t end = metrics_usec() + timeout_ms * 1000ULL;
+  while (metrics_usec() < end) {
+    if (poll(&pfd, 1, 100) != 1 || source->ops->dequeue(source, &buffer) != 1)
+      continue;
+    int ok = buffer.bytesused == TEST_SERVER_SIZE &&
+             memcmp(buffer.start, jpeg, TEST_SERVER_SIZE) == 0;
+    source->ops->requeue(source, buffer.index);
+    return ok;
+  }
+  return 0;
+}
+
+// frames pushed while nobody watches, a dequeue loop of the relay for
+// the given time
+static int test_relay_idle(source_t *source, int ms) {
+  struct source_buffer buffer;
+  struct pollfd pfd = {source->fd, POLLIN, 0};
+  int before = __atomic_load_n(&g_pushed, __ATOMIC_RELAXED);
+  uint64_t end = metrics_usec() + ms * 1000ULL;
+  while (metrics_usec() < end) {
+    if (poll(&pfd, 1, 100) == 1 &&
+        source->ops->dequeue(source, &buffer) == 1)
+      source->ops->requeue(source, buffer.index);
+  }
+  return __atomic_load_n(&g_pushed, __ATOMIC_RELAXED) - before;
+}
+
+// a second server as the upstream of a relay source: connected only while
+// the camera is on, reconnected after the upstream restarts
+static int test_relay() {
+  mjpeg2http_server_t *upstream;
+  pthread_t thread, pusher;
+  source_t source;
+  int failed = 0;
+
+  upstream = mjpeg2http_server_create(NULL, "127.0.0.1", TEST_RELAY_PORT,
+                                      NULL, TEST_TOKEN, NULL);
+  if (upstream == NULL || source_open(&source, TEST_RELAY_URL, 0, 0, 0) < 0)
+    return 1;
+  pthread_create(&thread, NULL, test_run, upstream);
+  pthread_create(&pusher, NULL, test_pusher, &upstream);
+
+  if (test_relay_idle(&source, 500) != 0) {
+    printf("FAIL: upstream watched before the camera is on\n");
+    failed = 1;
+  }
+  if (source_stream(&source, 1) < 0 || !test_relay_frame(&source, 3000)) {
+    printf("FAIL: no frame relayed\n");
+    failed = 1;
+  }
+
+  // the relay sees the connection drop and tries again with a backoff
+  mjpeg2http_server_stop(upstream);
+  pthread_join(thread, NULL);
+  test_relay_idle(&source, 500);
+  pthread_create(&thread, NULL, test_run, upstream);
+  if (!test_relay_frame(&source, 5000)) {
+    printf("FAIL: no frame after the upstream restarted\n");
+    failed = 1;
+  }
+
+  // once off the upstream loses its viewer and turns its camera off
+  if (source_stream(&source, 0) < 0) {
+    printf("FAIL: relay not stopped\n");
+    failed = 1;
+  }
+  test_relay_idle(&source, 500);
+  if (test_relay_idle(&source, 500) != 0) {
+    printf("FAIL: upstream still watched\n");
+    failed = 1;
+  }
+
+  __atomic_store_n(&g_pushing, 0, __ATOMIC_RELEASE);
+  pthread_join(pusher, NULL);
+  mjpeg2http_server_stop(upstream);
+  pthread_join(thread, NULL);
+  mjpeg2http_server_destroy(upstream);
+  source_close(&source);
+  printf("%s\n", failed ? "FAIL" : "OK");
+  return failed;
+}
+
+#define TEST_SHAPER_RATE 100000
+#define TEST_SHAPER_FRAME 10000
+
+// 25 fps of 10 kB through a 100 kB/s budget for 10 s: 10 frames/s evenly
+// spaced, the burst only at the start
+static int test_shaper() {
+  shaper_t client, egress;
+  uint64_t sent[2] = {0, 0}, last = 0, gap = 0;
+  int failed = 0;
+
+  shaper_init(&client, TEST_SHAPER_RATE, SHAPER_BURST_MS * 1000ULL);
+  shaper_init(&egress, TEST_SHAPER_RATE, SHAPER_BURST_MS * 1000ULL);
+  for (uint64_t now = 1000000; now < 11000000; now += 40000) {
+    if (shaper_ready(&client, now)) {
+      shaper_charge(&client, now, TEST_SHAPER_FRAME);
+      sent[0] += TEST_SHAPER_FRAME;
+      if (last != 0 && now - last > gap)
+        gap = now - last;
+      last = now;
+    }
+    if (shaper_admit(&egress, now, TEST_SHAPER_FRAME))
+      sent[1] += TEST_SHAPER_FRAME;
+  }
+  printf("sent %" PRIu64 " and %" PRIu64 " bytes, largest gap %" PRIu64
+         " usec\n",
+         sent[0], sent[1], gap);
+  for (int i = 0; i < 2; ++i) {
+    if (sent[i] < 10 * TEST_SHAPER_RATE ||
+        sent[i] > 10 * TEST_SHAPER_RATE + 3 * TEST_SHAPER_FRAME) {
+      printf("FAIL: budget not kept\n");
+      failed = 1;
+    }
+  }
+  if (gap > 120000) {
+    printf("FAIL: frames are not evenly spaced\n");
+    failed = 1;
+  }
+
+  // a frame charged and then dropped gives its budget back
+  shaper_init(&client, TEST_SHAPER_RATE, 0);
+  shaper_init(&egress, TEST_SHAPER_RATE, 0);
+  shaper_charge(&client, 1000000, TEST_SHAPER_FRAME);
+  shaper_refund(&client, TEST_SHAPER_FRAME);
+  shaper_admit(&egress, 1000000, TEST_SHAPER_FRAME);
+  shaper_refund(&egress, TEST_SHAPER_FRAME);
+  if (!shaper_ready(&client, 1000000) ||
+      !shaper_admit(&egress, 1000000, TEST_SHAPER_FRAME)) {
+    printf("FAIL: refund not credited\n");
+    failed = 1;
+  }
+  printf("%s\n", failed ? "FAIL" : "OK");
+  return failed;
+}
+
+void *stop(void *p) {
   int seconds = *((int *)p);
   printf("call endloop sleep for %d seconds\n", seconds);
   sleep(seconds);
   fflush(stdout);
   libmjpeg2http_endLoop();
+  return NULL;
 }
 
 int main(int argc, char **argv) {
+  if (argc == 3 && strcmp(argv[1], "--clients") == 0)
+    return test_clients(atoi(argv[2]));
+  if (argc == 2 && strcmp(argv[1], "--config") == 0)
+    return test_config();
+  if (argc == 2 && strcmp(argv[1], "--rtp") == 0)
+    return test_rtp();
+  if (argc == 2 && strcmp(argv[1], "--ring") == 0)
+    return test_ring();
+  if (argc == 2 && strcmp(argv[1], "--shm") == 0)
+    return test_shm();
+  if (argc == 2 && strcmp(argv[1], "--push") == 0)
+    return test_push();
+  if (argc == 2 && strcmp(argv[1], "--server") == 0)
+    return test_server();
+  if (argc == 2 && strcmp(argv[1], "--snapshot") == 0)
+    return test_snapshot();
+  if (argc == 2 && strcmp(argv[1], "--relay") == 0)
+    return test_relay();
+  if (argc == 2 && strcmp(argv[1], "--zerocopy") == 0)
+    return test_zerocopy();
+  if (argc == 2 && strcmp(argv[1], "--shaper") == 0)
+    return test_shaper();
+
   if (argc < 5) {
     printf("usage example: ./mjpeg2http 192.168.2.1 8080 /dev/video0 "
            "this_is_token [/tmp/mjpeg2http_onetimetoken]\n");
     return 1;
   }
-  my_init();
-
   char *tokenpipe = NULL;
 
   if (argc == 6) {
@@ -135,7 +1106,7 @@ int main(int argc, char **argv) {
     pthread_create(&stopper, NULL, stop, &t1);
     pthread_detach(stopper);
     libmjpeg2http_loop(argv[1], atoi(argv[2]), argv[3], argv[4], tokenpipe);
-    printf("mem allocated=%u freed=%u\n", allocated, freed);
+    printf("mem allocated=%zu freed=%zu\n", allocated, freed);
   }
 
   return 0;
@@ -0,0 +1,67 @@
+/**
+ *  mjpeg2http
+ *
+ *  Copyright (c) 2022 Antonino Nolano. Licensed under the MIT license, as
+ * follows:
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef TXRING_H
+#define TXRING_H
+
+#include <stdint.h>
+
+#include "constants.h"
+#include "frame.h"
+
+/*
+ * tx queue of a client: fixed capacity fifo of frame references kept inline,
+ * head and tail run freely so the depth is their difference
+ */
+struct tx_ring {
+  frame_t *frames[TX_RING_SIZE];
+  uint32_t head; /* next frame out */
+  uint32_t tail; /* next free slot */
+};
+
+static inline void tx_ring_init(struct tx_ring *ring) {
+  ring->head = ring->tail = 0;
+}
+
+static inline uint32_t tx_ring_depth(const struct tx_ring *ring) {
+  return ring->tail - ring->head;
+}
+
+// 0 if full, the reference is taken over otherwise
+static inline int tx_ring_push(struct tx_ring *ring, frame_t *frame) {
+  if (tx_ring_depth(ring) == TX_RING_SIZE)
+    return 0;
+  ring->frames[ring->tail++ & (TX_RING_SIZE - 1)] = frame;
+  return 1;
+}
+
+// oldest frame, NULL if empty
+static inline frame_t *tx_ring_pop(struct tx_ring *ring) {
+  if (ring->head == ring->tail)
+    return NULL;
+  return ring->frames[ring->head++ & (TX_RING_SIZE - 1)];
+}
+
+#endif
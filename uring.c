@@ -0,0 +1,138 @@
+/**
+ *  mjpeg2http
+ *
+ *  Copyright (c) 2022 Antonino Nolano. Licensed under the MIT license, as
+ * follows:
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "metrics.h"
+#include "uring.h"
+
+#define ptr(base, offset) ((unsigned *)((char *)(base) + (offset)))
+
+int uring_init(uring_t *u, unsigned entries, unsigned cq_entries) {
+  struct io_uring_params p;
+  memset(u, 0, sizeof(uring_t));
+  memset(&p, 0, sizeof(p));
+  p.flags = IORING_SETUP_CQSIZE;
+  p.cq_entries = cq_entries;
+  u->fd = syscall(__NR_io_uring_setup, entries, &p);
+  if (u->fd < 0) {
+    perror("io_uring_setup");
+    return -1;
+  }
+
+  u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  u->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+  if (u->sq_ring == MAP_FAILED)
+    goto errorOnSqRing;
+  u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+  if (u->cq_ring == MAP_FAILED)
+    goto errorOnCqRing;
+  u->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                 PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd,
+                 IORING_OFF_SQES);
+  if (u->sqes == MAP_FAILED)
+    goto errorOnSqes;
+
+  u->sq_entries = p.sq_entries;
+  u->sq_head = ptr(u->sq_ring, p.sq_off.head);
+  u->sq_tail = ptr(u->sq_ring, p.sq_off.tail);
+  u->sq_mask = ptr(u->sq_ring, p.sq_off.ring_mask);
+  u->sq_array = ptr(u->sq_ring, p.sq_off.array);
+  u->cq_head = ptr(u->cq_ring, p.cq_off.head);
+  u->cq_tail = ptr(u->cq_ring, p.cq_off.tail);
+  u->cq_mask = ptr(u->cq_ring, p.cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe *)((char *)u->cq_ring + p.cq_off.cqes);
+  return 1;
+
+errorOnSqes:
+  munmap(u->cq_ring, u->cq_ring_size);
+
+errorOnCqRing:
+  munmap(u->sq_ring, u->sq_ring_size);
+
+errorOnSqRing:
+  perror("io_uring mmap");
+  close(u->fd);
+  return -1;
+}
+
+void uring_free(uring_t *u) {
+  munmap(u->sqes, u->sq_entries * sizeof(struct io_uring_sqe));
+  munmap(u->cq_ring, u->cq_ring_size);
+  munmap(u->sq_ring, u->sq_ring_size);
+  close(u->fd);
+}
+
+struct io_uring_sqe *uring_get_sqe(uring_t *u) {
+  unsigned tail = *u->sq_tail;
+  if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) == u->sq_entries) {
+    if (uring_submit(u, 0) <= 0)
+      return NULL;
+  }
+  unsigned index = tail & *u->sq_mask;
+  struct io_uring_sqe *sqe = &u->sqes[index];
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  u->sq_array[index] = index;
+  // the kernel sees the sqe only after the tail moves
+  __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ++u->queued;
+  return sqe;
+}
+
+int uring_submit(uring_t *u, unsigned wait) {
+  if (u->queued == 0 && wait == 0)
+    return 0;
+  metrics_add(syscalls, 1);
+  int r = syscall(__NR_io_uring_enter, u->fd, u->queued, wait,
+                  wait > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+  if (r < 0) {
+    // completion queue busy or interrupted: retried on the next call
+    if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+      return 0;
+    perror("io_uring_enter");
+    return -1;
+  }
+  u->queued -= r;
+  return r;
+}
+
+struct io_uring_cqe *uring_peek_cqe(uring_t *u) {
+  unsigned head = *u->cq_head;
+  if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+    return NULL;
+  return &u->cqes[head & *u->cq_mask];
+}
+
+void uring_cqe_seen(uring_t *u) {
+  __atomic_store_n(u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,59 @@
+/**
+ *  mjpeg2http
+ *
+ *  Copyright (c) 2022 Antonino Nolano. Licensed under the MIT license, as
+ * follows:
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+
+/*
+ * minimal io_uring on raw syscalls: sqes are queued in the shared ring
+ * without syscalls and submitted together by one io_uring_enter,
+ * completions are read from the shared ring
+ */
+typedef struct uring {
+  int fd;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  struct io_uring_sqe *sqes;
+  unsigned sq_entries;
+  unsigned queued; /* sqes not submitted yet */
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;
+  void *sq_ring, *cq_ring;
+  size_t sq_ring_size, cq_ring_size;
+} uring_t;
+
+int uring_init(uring_t *uring, unsigned entries, unsigned cq_entries);
+void uring_free(uring_t *uring);
+// zeroed sqe, queued sqes are submitted first if the ring is full
+struct io_uring_sqe *uring_get_sqe(uring_t *uring);
+// submits the queued sqes and waits for wait completions
+int uring_submit(uring_t *uring, unsigned wait);
+// oldest completion or NULL, released by uring_cqe_seen
+struct io_uring_cqe *uring_peek_cqe(uring_t *uring);
+void uring_cqe_seen(uring_t *uring);
+
+#endif
@@ -27,33 +27,29 @@
  */
 #include <errno.h>
 #include <fcntl.h>
+#include <linux/dma-buf.h>
 #include <linux/videodev2.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "video.h"
+
 #define CLEAR(x) memset(&(x), 0, sizeof(x))
 
-struct buffer {
+struct video_mapping {
   void *start;
   size_t length;
+  int dmabuf_fd; /* exported buffer, -1 if not available */
 };
 
-static char *dev_name;
-static int fd = -1;
-struct buffer *buffers;
-static unsigned int n_buffers;
-static int req_num = 30;
-static int req_den = 1;
-static int g_width = 640;
-static int g_height = 480;
-
 static int xioctl(int fh, int request, void *arg) {
   int r;
 
@@ -64,16 +60,44 @@ static int xioctl(int fh, int request, void *arg) {
   return r;
 }
 
-int video_read_jpeg(void (*cb)(uint8_t *, uint32_t len), int maxsize) {
+static uint32_t memory_type(video_t *v) {
+  return v->io == IO_METHOD_MMAP ? V4L2_MEMORY_MMAP : V4L2_MEMORY_USERPTR;
+}
+
+static void sync_buffer(struct video_mapping *b, uint64_t flags) {
+  if (b->dmabuf_fd >= 0) {
+    struct dma_buf_sync sync = {flags | DMA_BUF_SYNC_READ};
+    xioctl(b->dmabuf_fd, DMA_BUF_IOCTL_SYNC, &sync);
+  }
+}
+
+static int queue_buffer(video_t *v, unsigned int i) {
+  struct v4l2_buffer buf;
+
+  CLEAR(buf);
+  buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  buf.memory = memory_type(v);
+  buf.index = i;
+  if (v->io == IO_METHOD_USERPTR) {
+    buf.m.userptr = (unsigned long)v->buffers[i].start;
+    buf.length = v->buffers[i].length;
+  }
+
+  if (-1 == xioctl(v->fd, VIDIOC_QBUF, &buf))
+    return -1;
+  __atomic_add_fetch(&v->n_queued, 1, __ATOMIC_ACQ_REL);
+  return 1;
+}
+
+int video_dequeue(video_t *v, struct video_buffer *vb) {
   struct v4l2_buffer buf;
-  unsigned int i;
 
   CLEAR(buf);
 
   buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-  buf.memory = V4L2_MEMORY_USERPTR;
+  buf.memory = memory_type(v);
 
-  if (-1 == xioctl(fd, VIDIOC_DQBUF, &buf)) {
+  if (-1 == xioctl(v->fd, VIDIOC_DQBUF, &buf)) {
     switch (errno) {
     case EAGAIN:
       return 0;
@@ -88,133 +112,254 @@ int video_read_jpeg(void (*cb)(uint8_t *, uint32_t len), int maxsize) {
     }
   }
 
-  for (i = 0; i < n_buffers; ++i)
-    if (buf.m.userptr == (unsigned long)buffers[i].start &&
-        buf.length == buffers[i].length)
-      break;
-
-  if (i >= n_buffers) {
-    fprintf(stderr, "invalid buffer index\\n");
-    return -1;
-  }
-  if (buf.bytesused >= maxsize) {
-    fprintf(stderr, "image too large\\n");
+  if (buf.index >= v->n_buffers) {
+    fprintf(stderr, "invalid buffer index\n");
     return -1;
   }
+  __atomic_sub_fetch(&v->n_queued, 1, __ATOMIC_ACQ_REL);
+
+  sync_buffer(&v->buffers[buf.index], DMA_BUF_SYNC_START);
+  vb->index = buf.index;
+  vb->start = v->buffers[buf.index].start;
+  vb->bytesused = buf.bytesused;
+  vb->sequence = buf.sequence;
+  // drivers stamp the first byte with the monotonic clock (uvc does)
+  if ((buf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) ==
+      V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC)
+    vb->timestamp =
+        (uint64_t)buf.timestamp.tv_sec * 1000000 + buf.timestamp.tv_usec;
+  else
+    vb->timestamp = 0;
+  return 1;
+}
+
+int video_requeue(video_t *v, int index) {
+  sync_buffer(&v->buffers[index], DMA_BUF_SYNC_END);
+  return queue_buffer(v, index);
+}
 
-  cb((uint8_t *)buf.m.userptr, buf.bytesused);
+int video_queued(video_t *v) {
+  return __atomic_load_n(&v->n_queued, __ATOMIC_ACQUIRE);
+}
 
-  if (-1 == xioctl(fd, VIDIOC_QBUF, &buf))
-    return -1;
+int video_read_jpeg(video_t *v, void (*cb)(uint8_t *, uint32_t len),
+                    uint32_t maxsize) {
+  struct video_buffer vb;
+  int r = video_dequeue(v, &vb);
+  if (r <= 0)
+    return r;
+
+  // one big keyframe must not stop the capture
+  if (vb.bytesused > (maxsize > 0 ? maxsize : v->sizeimage)) {
+    fprintf(stderr, "image too large: %u bytes\n", vb.bytesused);
+    return video_requeue(v, vb.index) < 0 ? -1 : 0;
+  }
 
-  return 1;
+  cb(vb.start, vb.bytesused);
+
+  return video_requeue(v, vb.index);
 }
 
-static int stop_capturing(void) {
+static int stop_capturing(video_t *v) {
   enum v4l2_buf_type type;
 
   type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-  if (-1 == xioctl(fd, VIDIOC_STREAMOFF, &type))
+  if (-1 == xioctl(v->fd, VIDIOC_STREAMOFF, &type))
     return -1;
   return 1;
 }
 
-static int start_capturing(void) {
+static int start_capturing(video_t *v) {
   unsigned int i;
   enum v4l2_buf_type type;
 
-  for (i = 0; i < n_buffers; ++i) {
-    struct v4l2_buffer buf;
-
-    CLEAR(buf);
-    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    buf.memory = V4L2_MEMORY_USERPTR;
-    buf.index = i;
-    buf.m.userptr = (unsigned long)buffers[i].start;
-    buf.length = buffers[i].length;
-
-    if (-1 == xioctl(fd, VIDIOC_QBUF, &buf))
+  v->n_queued = 0;
+  for (i = 0; i < v->n_buffers; ++i) {
+    if (queue_buffer(v, i) < 0)
       return -1;
   }
   type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-  if (-1 == xioctl(fd, VIDIOC_STREAMON, &type))
+  if (-1 == xioctl(v->fd, VIDIOC_STREAMON, &type))
     return -1;
   return 1;
 }
 
-static void uninit_device(void) {
+static void release_buffers(video_t *v) {
+  struct v4l2_requestbuffers req;
   unsigned int i;
 
-  for (i = 0; i < n_buffers; ++i)
-    free(buffers[i].start);
+  for (i = 0; i < v->n_buffers; ++i) {
+    if (v->io == IO_METHOD_USERPTR) {
+      free(v->buffers[i].start);
+      continue;
+    }
+    if (v->buffers[i].start != MAP_FAILED)
+      munmap(v->buffers[i].start, v->buffers[i].length);
+    if (v->buffers[i].dmabuf_fd >= 0)
+      close(v->buffers[i].dmabuf_fd);
+  }
+  free(v->buffers);
+  v->buffers = NULL;
+  v->n_buffers = 0;
 
-  free(buffers);
+  CLEAR(req);
+  req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  req.memory = memory_type(v);
+  xioctl(v->fd, VIDIOC_REQBUFS, &req);
+}
+
+static void uninit_device(video_t *v) { release_buffers(v); }
+
+static int export_buffer(video_t *v, unsigned int i) {
+  struct v4l2_exportbuffer expbuf;
+
+  CLEAR(expbuf);
+  expbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  expbuf.index = i;
+  expbuf.flags = O_RDONLY | O_CLOEXEC;
+  if (-1 == xioctl(v->fd, VIDIOC_EXPBUF, &expbuf))
+    return -1;
+  return expbuf.fd;
 }
 
-static int init_userp(unsigned int buffer_size) {
+static int init_mmap(video_t *v) {
   struct v4l2_requestbuffers req;
 
   CLEAR(req);
 
-  req.count = 4;
+  req.count = VIDEO_BUFFERS;
+  req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  req.memory = V4L2_MEMORY_MMAP;
+
+  if (-1 == xioctl(v->fd, VIDIOC_REQBUFS, &req)) {
+    if (EINVAL == errno)
+      fprintf(stderr, "%s does not support memory mapping\n", v->dev_name);
+    return -1;
+  }
+
+  if (req.count < 2) {
+    fprintf(stderr, "Insufficient buffer memory on %s\n", v->dev_name);
+    return -1;
+  }
+
+  v->buffers = calloc(req.count, sizeof(*v->buffers));
+
+  if (!v->buffers) {
+    fprintf(stderr, "Out of memory\n");
+    return -1;
+  }
+
+  int exported = 0;
+  for (v->n_buffers = 0; v->n_buffers < req.count; ++v->n_buffers) {
+    struct v4l2_buffer buf;
+    struct video_mapping *b = &v->buffers[v->n_buffers];
+
+    CLEAR(buf);
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = V4L2_MEMORY_MMAP;
+    buf.index = v->n_buffers;
+
+    b->start = MAP_FAILED;
+    b->dmabuf_fd = -1;
+    if (-1 == xioctl(v->fd, VIDIOC_QUERYBUF, &buf))
+      goto errorOnBuffer;
+    b->length = buf.length;
+
+    // map through the exported dmabuf where the driver allows it, cpu
+    // access is then bracketed with DMA_BUF_IOCTL_SYNC
+    b->dmabuf_fd = export_buffer(v, v->n_buffers);
+    if (b->dmabuf_fd >= 0) {
+      b->start = mmap(NULL, buf.length, PROT_READ, MAP_SHARED, b->dmabuf_fd, 0);
+      if (b->start == MAP_FAILED) {
+        close(b->dmabuf_fd);
+        b->dmabuf_fd = -1;
+      } else {
+        ++exported;
+      }
+    }
+    if (b->start == MAP_FAILED)
+      b->start = mmap(NULL, buf.length, PROT_READ | PROT_WRITE, MAP_SHARED,
+                      v->fd, buf.m.offset);
+    if (b->start == MAP_FAILED)
+      goto errorOnBuffer;
+  }
+
+  fprintf(stderr, "%s: %d mmap buffers, %d exported as dmabuf\n", v->dev_name,
+          v->n_buffers, exported);
+  return 1;
+
+errorOnBuffer:
+  ++v->n_buffers; // release the one being set up as well
+  release_buffers(v);
+  return -1;
+}
+
+static int init_userp(video_t *v, unsigned int buffer_size) {
+  struct v4l2_requestbuffers req;
+
+  CLEAR(req);
+
+  req.count = VIDEO_BUFFERS;
   req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
   req.memory = V4L2_MEMORY_USERPTR;
 
-  if (-1 == xioctl(fd, VIDIOC_REQBUFS, &req)) {
+  if (-1 == xioctl(v->fd, VIDIOC_REQBUFS, &req)) {
     if (EINVAL == errno) {
       fprintf(stderr,
               "%s does not support "
-              "user pointer i/on",
-              dev_name);
+              "user pointer i/o\n",
+              v->dev_name);
       return -1;
     } else {
       return -1;
     }
   }
 
-  buffers = calloc(4, sizeof(*buffers));
+  v->buffers = calloc(VIDEO_BUFFERS, sizeof(*v->buffers));
 
-  if (!buffers) {
-    fprintf(stderr, "Out of memory\\n");
+  if (!v->buffers) {
+    fprintf(stderr, "Out of memory\n");
     return -1;
   }
 
-  for (n_buffers = 0; n_buffers < 4; ++n_buffers) {
-    buffers[n_buffers].length = buffer_size;
-    buffers[n_buffers].start = malloc(buffer_size);
+  for (v->n_buffers = 0; v->n_buffers < VIDEO_BUFFERS; ++v->n_buffers) {
+    v->buffers[v->n_buffers].length = buffer_size;
+    v->buffers[v->n_buffers].dmabuf_fd = -1;
+    v->buffers[v->n_buffers].start = malloc(buffer_size);
 
-    if (!buffers[n_buffers].start) {
-      fprintf(stderr, "Out of memory\\n");
-      for (int j = n_buffers - 1; j >= 0; --j)
-        free(buffers[j].start);
-      free(buffers);
+    if (!v->buffers[v->n_buffers].start) {
+      fprintf(stderr, "Out of memory\n");
+      for (int j = v->n_buffers - 1; j >= 0; --j)
+        free(v->buffers[j].start);
+      free(v->buffers);
       return -1;
     }
   }
   return 1;
 }
 
-static int setup_framerate() {
+static int setup_framerate(video_t *v) {
 
   struct v4l2_streamparm streamparm;
   streamparm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 
-  if (-1 == xioctl(fd, VIDIOC_G_PARM, &streamparm))
+  if (-1 == xioctl(v->fd, VIDIOC_G_PARM, &streamparm))
     return -1;
 
   if (streamparm.parm.capture.capability & V4L2_CAP_TIMEPERFRAME) {
-    streamparm.parm.capture.timeperframe.numerator = req_den;
-    streamparm.parm.capture.timeperframe.denominator = req_num;
+    streamparm.parm.capture.timeperframe.numerator = v->req_den;
+    streamparm.parm.capture.timeperframe.denominator = v->req_num;
 
-    if (-1 == xioctl(fd, VIDIOC_S_PARM, &streamparm))
+    if (-1 == xioctl(v->fd, VIDIOC_S_PARM, &streamparm))
       return -1;
 
-    if (streamparm.parm.capture.timeperframe.numerator != req_den ||
-        streamparm.parm.capture.timeperframe.denominator != req_num) {
+    if (streamparm.parm.capture.timeperframe.numerator != v->req_den ||
+        streamparm.parm.capture.timeperframe.denominator != v->req_num) {
       fprintf(stderr,
               "the driver changed the time per frame from "
               "%d/%d to %d/%d\n",
-              req_den, req_num, streamparm.parm.capture.timeperframe.numerator,
+              v->req_den, v->req_num,
+              streamparm.parm.capture.timeperframe.numerator,
               streamparm.parm.capture.timeperframe.denominator);
     }
   } else {
@@ -224,16 +369,16 @@ static int setup_framerate() {
   return 1;
 }
 
-static int init_device(void) {
+static int init_device(video_t *v) {
   struct v4l2_capability cap;
   struct v4l2_cropcap cropcap;
   struct v4l2_crop crop;
   struct v4l2_format fmt;
   unsigned int min;
 
-  if (-1 == xioctl(fd, VIDIOC_QUERYCAP, &cap)) {
+  if (-1 == xioctl(v->fd, VIDIOC_QUERYCAP, &cap)) {
     if (EINVAL == errno) {
-      fprintf(stderr, "%s is no V4L2 device\\n", dev_name);
+      fprintf(stderr, "%s is no V4L2 device\n", v->dev_name);
       return -1;
     } else {
       return -1;
@@ -241,12 +386,12 @@ static int init_device(void) {
   }
 
   if (!(cap.capabilities & V4L2_CAP_VIDEO_CAPTURE)) {
-    fprintf(stderr, "%s is no video capture device\\n", dev_name);
+    fprintf(stderr, "%s is no video capture device\n", v->dev_name);
     return -1;
   }
 
   if (!(cap.capabilities & V4L2_CAP_STREAMING)) {
-    fprintf(stderr, "%s does not support streaming i/o\\n", dev_name);
+    fprintf(stderr, "%s does not support streaming i/o\n", v->dev_name);
     return -1;
   }
 
@@ -254,11 +399,11 @@ static int init_device(void) {
 
   cropcap.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 
-  if (0 == xioctl(fd, VIDIOC_CROPCAP, &cropcap)) {
+  if (0 == xioctl(v->fd, VIDIOC_CROPCAP, &cropcap)) {
     crop.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     crop.c = cropcap.defrect; /* reset to default */
 
-    if (-1 == xioctl(fd, VIDIOC_S_CROP, &crop)) {
+    if (-1 == xioctl(v->fd, VIDIOC_S_CROP, &crop)) {
       switch (errno) {
       case EINVAL:
         /* Cropping not supported. */
@@ -270,18 +415,18 @@ static int init_device(void) {
     }
   }
 
-  if (setup_framerate() < 0)
+  if (setup_framerate(v) < 0)
     return -1;
 
   CLEAR(fmt);
 
   fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-  fmt.fmt.pix.width = g_width;
-  fmt.fmt.pix.height = g_height;
+  fmt.fmt.pix.width = v->width;
+  fmt.fmt.pix.height = v->height;
   fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_JPEG;
   fmt.fmt.pix.field = V4L2_FIELD_ANY;
 
-  if (-1 == xioctl(fd, VIDIOC_S_FMT, &fmt))
+  if (-1 == xioctl(v->fd, VIDIOC_S_FMT, &fmt))
     return -1;
 
   /* Buggy driver paranoia. */
@@ -291,65 +436,80 @@ static int init_device(void) {
   min = fmt.fmt.pix.bytesperline * fmt.fmt.pix.height;
   if (fmt.fmt.pix.sizeimage < min)
     fmt.fmt.pix.sizeimage = min;
-
-  return init_userp(fmt.fmt.pix.sizeimage);
+  v->width = fmt.fmt.pix.width;
+  v->height = fmt.fmt.pix.height;
+  v->sizeimage = fmt.fmt.pix.sizeimage;
+  fprintf(stderr, "%s: %dx%d, frames up to %u bytes\n", v->dev_name, v->width,
+          v->height, v->sizeimage);
+
+  // prefer driver v->buffers, user pointers often mean a bounce copy
+  v->io = IO_METHOD_MMAP;
+  if (init_mmap(v) > 0)
+    return 1;
+  fprintf(stderr, "%s: fall back to user pointer i/o\n", v->dev_name);
+  v->io = IO_METHOD_USERPTR;
+  return init_userp(v, fmt.fmt.pix.sizeimage);
 }
 
-static void close_device(void) {
-  close(fd);
-  fd = -1;
+static void close_device(video_t *v) {
+  close(v->fd);
+  v->fd = -1;
 }
 
-static int open_device(void) {
+static int open_device(video_t *v) {
   struct stat st;
 
-  if (-1 == stat(dev_name, &st)) {
-    fprintf(stderr, "Cannot identify '%s': %d, %s\\n", dev_name, errno,
+  if (-1 == stat(v->dev_name, &st)) {
+    fprintf(stderr, "Cannot identify '%s': %d, %s\n", v->dev_name, errno,
             strerror(errno));
     return -1;
   }
 
   if (!S_ISCHR(st.st_mode)) {
-    fprintf(stderr, "%s is no devicen", dev_name);
+    fprintf(stderr, "%s is no device\n", v->dev_name);
     return -1;
   }
 
-  fd = open(dev_name, O_RDWR /* required */ | O_NONBLOCK, 0);
+  v->fd = open(v->dev_name, O_RDWR /* required */ | O_NONBLOCK, 0);
 
-  if (-1 == fd) {
-    fprintf(stderr, "Cannot open '%s': %d, %s\\n", dev_name, errno,
+  if (-1 == v->fd) {
+    fprintf(stderr, "Cannot open '%s': %d, %s\n", v->dev_name, errno,
             strerror(errno));
     return -1;
   }
-  return fd;
+  return v->fd;
 }
 
-int video_init(const char *dev, int width, int height, int rate) {
-  dev_name = strdup(dev);
-  g_width = width;
-  g_height = height;
-  req_num = rate;
-  if (open_device() < 0)
+int video_init(video_t *v, const char *dev, int width, int height, int rate) {
+  memset(v, 0, sizeof(video_t));
+  v->dev_name = strdup(dev);
+  v->fd = -1;
+  v->io = IO_METHOD_MMAP;
+  v->width = width;
+  v->height = height;
+  v->req_num = rate;
+  v->req_den = 1;
+  if (open_device(v) < 0)
     goto errorOnOpen;
-  if (init_device() < 0)
+  if (init_device(v) < 0)
     goto errorOnInit;
-  if (start_capturing() < 0)
+  if (start_capturing(v) < 0)
     goto errorOnStart;
-  return fd;
+  return v->fd;
 
 errorOnStart:
-  uninit_device();
+  uninit_device(v);
 errorOnInit:
-  close(fd);
+  close(v->fd);
 errorOnOpen:
-  free(dev_name);
-  fprintf(stderr, "error %d, %s\\n", errno, strerror(errno));
+  free(v->dev_name);
+  fprintf(stderr, "error %d, %s\n", errno, strerror(errno));
   return -1;
 }
 
-void video_deinit() {
-  stop_capturing();
-  uninit_device();
-  close_device();
-  free(dev_name);
+void video_deinit(video_t *v) {
+  stop_capturing(v);
+  uninit_device(v);
+  close_device(v);
+  free(v->dev_name);
 }
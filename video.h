@@ -28,8 +28,44 @@
 
 #include <stdint.h>
 
-int video_init(const char *device, int width, int height, int rate);
-void video_deinit();
-int video_read_jpeg(void (*cb)(uint8_t *, uint32_t len), int maxsize);
+#define VIDEO_BUFFERS 6
+
+/* buffer owned by the application until video_requeue */
+struct video_buffer {
+  int index;
+  uint8_t *start;
+  uint32_t bytesused;
+  uint32_t sequence;
+  uint64_t timestamp; /* capture time, CLOCK_MONOTONIC usec, 0 if unknown */
+};
+
+enum io_method { IO_METHOD_MMAP, IO_METHOD_USERPTR };
+
+/* one capture device, several may be open at the same time */
+typedef struct {
+  char *dev_name;
+  int fd;
+  enum io_method io;
+  struct video_mapping *buffers;
+  unsigned int n_buffers;
+  int n_queued;
+  int req_num;
+  int req_den;
+  int width;
+  int height;
+  uint32_t sizeimage; /* largest frame, negotiated with the driver */
+} video_t;
+
+int video_init(video_t *video, const char *device, int width, int height,
+               int rate);
+void video_deinit(video_t *video);
+// frames above maxsize (0: sizeimage) are skipped
+int video_read_jpeg(video_t *video, void (*cb)(uint8_t *, uint32_t len),
+                    uint32_t maxsize);
+
+// zero copy capture: video_requeue may be called from any thread
+int video_dequeue(video_t *video, struct video_buffer *vb);
+int video_requeue(video_t *video, int index);
+int video_queued(video_t *video);
 
 #endif
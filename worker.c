@@ -0,0 +1,790 @@
+/**
+ *  mjpeg2http
+ *
+ *  Copyright (c) 2022 Antonino Nolano. Licensed under the MIT license, as
+ * follows:
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "client.h"
+#include "constants.h"
+#include "frame.h"
+#include "metrics.h"
+#include "protocol.h"
+#include "server.h"
+#include "uring.h"
+#include "worker.h"
+
+// ZOMBIE: removed client whose send is still in flight
+enum type { SERVER, CLIENT, RING, EXITFD, URING, ZOMBIE };
+
+union observed_data {
+  client_t *client;
+  int fd;
+};
+
+struct observed {
+  struct dlist node;
+  enum type t;
+  union observed_data data;
+};
+
+static frame_t g_welcome;
+static frame_t g_welcome_ko;
+static frame_t g_snapshot_ko[2]; /* indexed by keep_alive */
+static frame_t g_not_found[2];
+static pthread_once_t g_welcome_once = PTHREAD_ONCE_INIT;
+
+static void init_welcome() {
+  frame_init_static(&g_welcome, welcome, welcome_len);
+  frame_init_static(&g_welcome_ko, welcome_ko, welcome_ko_len);
+  frame_init_static(&g_snapshot_ko[0], snapshot_ko, snapshot_ko_len);
+  frame_init_static(&g_snapshot_ko[1], snapshot_ko_keep_alive,
+                    snapshot_ko_keep_alive_len);
+  frame_init_static(&g_not_found[0], not_found, not_found_len);
+  frame_init_static(&g_not_found[1], not_found_keep_alive,
+                    not_found_keep_alive_len);
+}
+
+static int add_client(worker_t *w, struct remotepeer *peer) {
+  struct epoll_event ev;
+  if (!w->client_join(w->ctx)) {
+    printf("reject new connection => increase max clients\n");
+    fflush(stdout);
+    close(peer->fd);
+    return 1;
+  }
+
+  struct observed *oc = malloc(sizeof(struct observed));
+  oc->data.client = client_init(peer->hostname, peer->port, peer->fd);
+  oc->data.client->policy = w->latency ? TX_LATEST : w->policy;
+  oc->data.client->tx_queue_max = w->tx_queue_max;
+  oc->data.client->egress = w->egress;
+  if (w->client_rate > 0) {
+    // the kernel spreads the bytes (TCP pacing or fq), the bucket skips the
+    // frames that do not fit, alone if the kernel has no pacing
+    shaper_init(&oc->data.client->shaper, w->client_rate,
+                SHAPER_BURST_MS * 1000ULL);
+    unsigned int rate = w->client_rate;
+    if (setsockopt(peer->fd, SOL_SOCKET, SO_MAX_PACING_RATE, &rate,
+                   sizeof(rate)) < 0)
+      perror("SO_MAX_PACING_RATE");
+  }
+  oc->data.client->uring = w->uring;
+  oc->data.client->uring_tag = oc;
+  int one = 1;
+  if (w->zerocopy > 0 &&
+      setsockopt(peer->fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0)
+    oc->data.client->zerocopy = w->zerocopy;
+  if (w->latency) {
+    oc->data.client->latency = 1;
+    oc->data.client->epfd = w->epfd;
+  }
+  oc->t = CLIENT;
+  // the request is expected within the idle timeout
+  oc->data.client->deadline = metrics_usec() + IDLE_TIMEOUT_MS * 1000ULL;
+  list_add_left(&oc->node, &w->clients);
+  ++w->numClients;
+  metrics_add(clients, 1);
+  // with io_uring the kernel waits for the socket to be writable, in
+  // latency mode the client asks for EPOLLOUT when it needs it
+  ev.events = EPOLLIN | EPOLLET | EPOLLRDHUP | EPOLLERR | EPOLLHUP |
+              (w->uring == NULL && !w->latency ? EPOLLOUT : 0);
+  ev.data.ptr = oc;
+  if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, peer->fd, &ev) == -1) {
+    perror("epoll_ctl: add clients");
+    return -1;
+  }
+  return 1;
+}
+
+static int add_clients(worker_t *w) {
+  int ret;
+  struct remotepeer peer;
+  do {
+    ret = server_new_peer(w->server_fd, &peer);
+    if (ret == 0)
+      break; // no more connections to accept
+    else if (ret == -1) {
+      perror("server_new_peer error");
+      return -1;
+    }
+    if (add_client(w, &peer) < 0)
+      return -1;
+  } while (ret > 0);
+  return 1;
+}
+
+// multishot accept: one sqe, a completion per new connection
+static int arm_accept(worker_t *w) {
+  struct io_uring_sqe *sqe = uring_get_sqe(w->uring);
+  if (sqe == NULL)
+    return -1;
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = w->server_fd;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_NONBLOCK;
+  sqe->user_data = (uintptr_t)&w->watched[0];
+  return 1;
+}
+
+static int remove_client(worker_t *w, struct observed *oc) {
+  printf("remove client %s %d fd=%d worker=%d\n", oc->data.client->hostname,
+         oc->data.client->port, oc->data.client->fd, w->id);
+  fflush(stdout);
+  if (epoll_ctl(w->epfd, EPOLL_CTL_DEL, oc->data.client->fd, NULL) == -1) {
+    perror("epoll_ctl: remove clients");
+    return -1;
+  }
+  metrics_add(clients, -1);
+  if (oc->data.client->is_auth)
+    metrics_add(clients_auth, -1);
+  if (oc->data.client->camera >= 0)
+    w->camera_leave(w->ctx, oc->data.client->camera);
+  list_del(&oc->node);
+  --w->numClients;
+  w->client_leave(w->ctx);
+  if (oc->data.client->inflight) {
+    // the kernel still reads the frame: freed on completion
+    shutdown(oc->data.client->fd, SHUT_RDWR);
+    oc->t = ZOMBIE;
+    list_add_left(&oc->node, &w->zombies);
+    return 1;
+  }
+  client_free(oc->data.client);
+  free(oc);
+  return 1;
+}
+
+// move the client to a list, the camera is subscribed for streams and
+// pending snapshots
+static void subscribe(worker_t *w, struct observed *oev, int camera,
+                      struct dlist *list) {
+  oev->data.client->camera = camera;
+  w->camera_join(w->ctx, camera);
+  list_del(&oev->node);
+  list_add_left(&oev->node, list);
+}
+
+// response to a single request, the connection is closed once it is sent
+// unless the client asked to keep it
+static void send_response(worker_t *w, struct observed *oev, frame_t *frame) {
+  client_t *c = oev->data.client;
+  if (c->camera >= 0) {
+    // answered snapshot: no more frames needed
+    w->camera_leave(w->ctx, c->camera);
+    c->camera = -1;
+    list_del(&oev->node);
+    list_add_left(&oev->node, &w->clients);
+  }
+  c->closing = !c->keep_alive;
+  c->deadline = 0;
+  client_enqueue_frame(c, frame);
+}
+
+static void release_snapshot(frame_t *frame) {
+  frame_unref(frame->priv);
+  free(frame);
+}
+
+// the part header of the stream frame follows the HTTP status, the JPEG is
+// not copied
+static void send_snapshot(worker_t *w, struct observed *oev, frame_t *frame) {
+  char header[FRAME_HEADER_SIZE];
+  int len = snprintf(header, sizeof(header), snapshot_header,
+                     connection_header[oev->data.client->keep_alive]);
+  len += snprintf(header + len, sizeof(header) - len, "%.*s",
+                  (int)frame->iov[0].iov_len, (char *)frame->iov[0].iov_base);
+  frame_t *snapshot =
+      frame_wrap(header, len, frame->iov[1].iov_base, frame->iov[1].iov_len,
+                 NULL, 0, release_snapshot, frame);
+  if (snapshot == NULL) {
+    oev->data.client->keep_alive = 0;
+    send_response(w, oev, &g_snapshot_ko[0]);
+    return;
+  }
+  frame_ref(frame);
+  send_response(w, oev, snapshot);
+  frame_unref(snapshot);
+}
+
+// frames left in the driver queue since the camera was last on are stale
+static int is_fresh(frame_t *frame, uint64_t now) {
+  return now - frame->timestamp < SNAPSHOT_MAX_AGE_MS * 1000ULL;
+}
+
+static void handle_snapshot(worker_t *w, struct observed *oev, int camera) {
+  uint64_t now = metrics_usec();
+  frame_t *latest = w->latest[camera];
+  if (latest != NULL && is_fresh(latest, now))
+    return send_snapshot(w, oev, latest);
+
+  // camera is cold: turn it on and wait for a capture
+  oev->data.client->deadline = now + SNAPSHOT_TIMEOUT_MS * 1000ULL;
+  subscribe(w, oev, camera, &w->snapshots);
+}
+
+static int is_path(client_t *c, const char *path) {
+  int len = strlen(path);
+  return c->end_path - c->start_path == len &&
+         memcmp(c->rxbuf + c->start_path, path, len) == 0;
+}
+
+// <camera path>/snapshot, the suffix is removed from the request path
+static int is_snapshot(client_t *c) {
+  int len = sizeof("/snapshot") - 1;
+  if (c->end_path - c->start_path < len ||
+      memcmp(c->rxbuf + c->end_path - len, "/snapshot", len) != 0)
+    return 0;
+  c->end_path -= len;
+  return 1;
+}
+
+static void send_metrics(worker_t *w, struct observed *oev) {
+  char header[FRAME_HEADER_SIZE];
+  char body[METRICS_BUFFER_SIZE];
+  frame_t *frame = NULL;
+  int len = metrics_format(w->metrics, body, sizeof(body));
+  if (len < 0) {
+    printf("metrics do not fit in %d bytes\n", METRICS_BUFFER_SIZE);
+    fflush(stdout);
+  } else {
+    int hlen = snprintf(header, sizeof(header), metrics_header,
+                        connection_header[oev->data.client->keep_alive], len);
+    frame = frame_create(header, hlen, (uint8_t *)body, len, NULL, 0);
+  }
+  if (frame == NULL) {
+    oev->data.client->closing = 1;
+    return;
+  }
+  send_response(w, oev, frame);
+  frame_unref(frame);
+}
+
+static void handle_request(worker_t *w, struct observed *oev) {
+  client_t *c = oev->data.client;
+  // /metrics has its own token
+  int metrics = is_path(c, "/metrics");
+  int snapshot = !metrics && is_snapshot(c);
+  int camera = metrics ? -1
+                       : w->find_camera(w->ctx, c->rxbuf + c->start_path,
+                                        c->end_path - c->start_path);
+  int (*check)(void *, uint8_t *, int) =
+      metrics ? w->check_metrics_token : w->check_token;
+  int auth = check(w->ctx, c->rxbuf + c->start_token,
+                   c->end_token - c->start_token);
+  client_release_request(c);
+  if (auth && metrics) {
+    send_metrics(w, oev);
+  } else if (auth && camera < 0) {
+    send_response(w, oev, &g_not_found[c->keep_alive]);
+  } else if (auth && snapshot) {
+    handle_snapshot(w, oev, camera);
+  } else if (auth) {
+    printf("client auth OK %s %d camera=%d\n", c->hostname, c->port, camera);
+    fflush(stdout);
+    c->is_auth = 1;
+    c->deadline = 0;
+    metrics_add(clients_auth, 1);
+    subscribe(w, oev, camera, &w->viewers[camera]);
+    client_enqueue_frame(c, &g_welcome);
+  } else {
+    printf("client auth KO %s %d\n", c->hostname, c->port);
+    fflush(stdout);
+    c->keep_alive = 0;
+    send_response(w, oev, &g_welcome_ko);
+  }
+}
+
+// requests are answered in order: the next one is parsed once the previous
+// response is sent, pipelined requests already in the rx buffer are parsed
+// without reading the socket again
+static int serve_requests(worker_t *w, struct observed *oev) {
+  client_t *c = oev->data.client;
+  while (c->tx_frame == NULL && c->camera < 0 && !c->closing) {
+    int done = client_parse_request(c);
+    if (done < 0)
+      return remove_client(w, oev);
+    if (done == 0)
+      break;
+    handle_request(w, oev);
+  }
+
+  // streaming, waiting for a capture or still sending
+  if (c->camera >= 0 || c->tx_frame != NULL)
+    return 1;
+  if (c->closing)
+    return remove_client(w, oev);
+  if (c->deadline == 0) {
+    // idle persistent connection, the list is kept in deadline order
+    c->deadline = metrics_usec() + IDLE_TIMEOUT_MS * 1000ULL;
+    list_del(&oev->node);
+    list_add_left(&oev->node, &w->clients);
+  }
+  return 1;
+}
+
+// pending snapshots and idle connections are kept in deadline order, so the
+// first ones expire first
+static int expire_clients(worker_t *w) {
+  struct dlist *itr, *save;
+  uint64_t now = metrics_usec();
+  list_iterate_safe(itr, save, &w->snapshots) {
+    struct observed *oc = list_get_entry(itr, struct observed, node);
+    if (oc->data.client->deadline > now)
+      break;
+    send_response(w, oc, &g_snapshot_ko[oc->data.client->keep_alive]);
+    if (serve_requests(w, oc) < 0)
+      return -1;
+  }
+  list_iterate_safe(itr, save, &w->clients) {
+    struct observed *oc = list_get_entry(itr, struct observed, node);
+    if (oc->data.client->deadline == 0)
+      continue; // sending a response
+    if (oc->data.client->deadline > now)
+      break;
+    printf("idle timeout fd=%d\n", oc->data.client->fd);
+    fflush(stdout);
+    if (remove_client(w, oc) < 0)
+      return -1;
+  }
+  return 1;
+}
+
+static uint64_t first_deadline(struct dlist *list, uint64_t deadline) {
+  struct dlist *itr;
+  list_iterate(itr, list) {
+    struct observed *oc = list_get_entry(itr, struct observed, node);
+    if (oc->data.client->deadline != 0)
+      return oc->data.client->deadline < deadline ? oc->data.client->deadline
+                                                  : deadline;
+  }
+  return deadline;
+}
+
+// epoll timeout in ms until the next deadline, -1 if none
+static int next_timeout(worker_t *w) {
+  uint64_t deadline = first_deadline(&w->snapshots, UINT64_MAX);
+  deadline = first_deadline(&w->clients, deadline);
+  if (deadline == UINT64_MAX)
+    return -1;
+  uint64_t now = metrics_usec();
+  return deadline > now ? (deadline - now + 999) / 1000 : 0;
+}
+
+static int handle_new_frames(worker_t *w, int fd) {
+  uint64_t beep;
+  metrics_add(syscalls, 1);
+  if (read(fd, &beep, sizeof(uint64_t)) < 0 && errno != EAGAIN) {
+    perror("read ring notification");
+    return -1;
+  }
+
+  // every viewer of the camera holds a reference to the same frame
+  frame_t *frame;
+  while ((frame = ring_read(w->ring, w->id)) != NULL) {
+    struct dlist *itr, *save;
+    list_iterate(itr, &w->viewers[frame->camera]) {
+      struct observed *oc = list_get_entry(itr, struct observed, node);
+      client_enqueue_frame(oc->data.client, frame);
+    }
+    // the server budget runs out on the last viewers: rotate the order
+    if (w->egress != NULL && !list_empty(&w->viewers[frame->camera])) {
+      struct dlist *first = list_get_first(&w->viewers[frame->camera]);
+      list_del(first);
+      list_add_left(first, &w->viewers[frame->camera]);
+    }
+    // cached for /snapshot
+    if (w->latest[frame->camera] != NULL)
+      frame_unref(w->latest[frame->camera]);
+    w->latest[frame->camera] = frame;
+    if (!is_fresh(frame, metrics_usec()))
+      continue;
+    list_iterate_safe(itr, save, &w->snapshots) {
+      struct observed *oc = list_get_entry(itr, struct observed, node);
+      if (oc->data.client->camera != frame->camera)
+        continue;
+      send_snapshot(w, oc, frame);
+      if (serve_requests(w, oc) < 0)
+        return -1;
+    }
+  }
+  return 1;
+}
+
+static int handle_accept(worker_t *w, int res, uint32_t flags) {
+  struct remotepeer peer;
+  if (res < 0) {
+    printf("io_uring accept error %s\n", strerror(-res));
+    fflush(stdout);
+    return -1;
+  }
+  if (server_peer(res, &peer) < 0)
+    close(res);
+  else if (add_client(w, &peer) < 0)
+    return -1;
+  return flags & IORING_CQE_F_MORE ? 1 : arm_accept(w);
+}
+
+// completions are read from the shared ring, no syscall
+static int handle_completions(worker_t *w) {
+  struct io_uring_cqe *cqe;
+  while ((cqe = uring_peek_cqe(w->uring)) != NULL) {
+    struct observed *oev = (struct observed *)(uintptr_t)cqe->user_data;
+    int res = cqe->res;
+    uint32_t flags = cqe->flags;
+    uring_cqe_seen(w->uring);
+
+    switch (oev->t) {
+    case SERVER:
+      if (handle_accept(w, res, flags) < 0)
+        return -1;
+      break;
+
+    case ZOMBIE:
+      list_del(&oev->node);
+      client_free(oev->data.client);
+      free(oev);
+      break;
+
+    case CLIENT:
+      // a response done may unblock the next pipelined request
+      if (client_tx_complete(oev->data.client, res) < 0) {
+        if (remove_client(w, oev) < 0)
+          return -1;
+      } else if (oev->data.client->tx_frame == NULL &&
+                 serve_requests(w, oev) < 0) {
+        return -1;
+      }
+      break;
+
+    default:
+      break;
+    }
+  }
+  return 1;
+}
+
+static int handle_client(worker_t *w, struct observed *oev, uint32_t events) {
+  client_t *c = oev->data.client;
+  // zero copy notifications are queued as socket errors
+  if ((events & EPOLLERR) && (c->zerocopy || !list_empty(&c->zc_pending)) &&
+      client_zerocopy_complete(c) > 0)
+    events &= ~EPOLLERR;
+  if (events & (EPOLLRDHUP | EPOLLERR | EPOLLHUP)) {
+    printf("generic error fd=%d\n", c->fd);
+    fflush(stdout);
+    return remove_client(w, oev);
+  }
+
+  int sent = 0;
+  if (events & EPOLLOUT) {
+    int sending = c->tx_frame != NULL;
+    if (client_tx(c) < 0)
+      return remove_client(w, oev);
+    sent = sending && c->tx_frame == NULL;
+  }
+
+  // a response done may unblock the next pipelined request
+  if ((events & EPOLLIN) || sent)
+    return serve_requests(w, oev);
+  return 1;
+}
+
+static void free_clients(struct dlist *list) {
+  struct dlist *itr, *save;
+  list_iterate_safe(itr, save, list) {
+    struct observed *oev = list_get_entry(itr, struct observed, node);
+    list_del(&oev->node);
+    metrics_add(clients, -1);
+    if (oev->data.client->is_auth)
+      metrics_add(clients_auth, -1);
+    client_free(oev->data.client);
+    free(oev);
+  }
+}
+
+static int shutdown_inflight(struct dlist *list) {
+  struct dlist *itr;
+  int n = 0;
+  list_iterate(itr, list) {
+    client_t *c = list_get_entry(itr, struct observed, node)->data.client;
+    if (c->inflight) {
+      shutdown(c->fd, SHUT_RDWR);
+      ++n;
+    }
+  }
+  return n;
+}
+
+// the kernel still reads frames and client memory: wait for the sends
+static void drain_sends(worker_t *w) {
+  struct io_uring_cqe *cqe;
+  int inflight = shutdown_inflight(&w->clients) +
+                 shutdown_inflight(&w->snapshots) +
+                 shutdown_inflight(&w->zombies);
+  for (int i = 0; i < MAX_CAMERAS; ++i)
+    inflight += shutdown_inflight(&w->viewers[i]);
+
+  while (inflight > 0 && uring_submit(w->uring, 1) >= 0) {
+    while ((cqe = uring_peek_cqe(w->uring)) != NULL) {
+      struct observed *oev = (struct observed *)(uintptr_t)cqe->user_data;
+      if (oev->t == SERVER && cqe->res >= 0)
+        close(cqe->res);
+      uring_cqe_seen(w->uring);
+      if (oev->t == ZOMBIE) {
+        list_del(&oev->node);
+        client_free(oev->data.client);
+        free(oev);
+        --inflight;
+      } else if (oev->t == CLIENT) {
+        oev->data.client->inflight = 0;
+        --inflight;
+      }
+    }
+  }
+}
+
+static void *worker_loop(void *arg) {
+  worker_t *w = (worker_t *)arg;
+  struct epoll_event events[EPOLL_BATCH];
+  struct observed *oev;
+  int nfds, n;
+
+  if (w->cpu >= 0) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(w->cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set) != 0)
+      printf("worker %d: cannot set affinity to cpu %d\n", w->id, w->cpu);
+  }
+
+  metrics_register(w->metrics, METRICS_WORKER, w->id);
+  printf("libmjpeg2http worker %d cpu=%d\n", w->id, w->cpu);
+  fflush(stdout);
+
+  for (;;) {
+
+    // sends queued by the last iteration go out in one io_uring_enter
+    if (w->uring != NULL && uring_submit(w->uring, 0) < 0)
+      goto errorOnSubmit;
+
+    metrics_add(syscalls, 1);
+    nfds = epoll_wait(w->epfd, events, EPOLL_BATCH, next_timeout(w));
+    if (nfds == -1) {
+      if (errno == EINTR)
+        continue;
+      perror("epoll_wait");
+      goto errorOnEpollWait;
+    }
+
+    uint64_t start = metrics_usec();
+    for (n = 0; n < nfds; ++n) {
+      oev = (struct observed *)events[n].data.ptr;
+      switch (oev->t) {
+
+      case EXITFD:
+        goto exitFromWorkerLoop;
+
+      case RING:
+        if (handle_new_frames(w, oev->data.fd) < 0)
+          goto errorOnHandleNewFrames;
+        break;
+
+      case SERVER:
+        if (events[n].events & (EPOLLRDHUP | EPOLLERR | EPOLLHUP)) {
+          perror("error on server");
+          goto errorOnServer;
+        }
+        if (events[n].events & EPOLLIN) {
+          if (add_clients(w) < 0)
+            goto errorOnAddClients;
+        }
+        break;
+
+      case CLIENT:
+        if (handle_client(w, oev, events[n].events) < 0)
+          goto errorOnRemoveClient;
+        break;
+
+      case URING:
+        if (handle_completions(w) < 0)
+          goto errorOnCompletions;
+        break;
+
+      default:
+        break;
+      }
+    }
+    if (expire_clients(w) < 0)
+      goto errorOnExpireClients;
+    metrics_observe(&t_metrics->loop, metrics_usec() - start);
+  }
+
+errorOnCompletions:
+errorOnSubmit:
+errorOnExpireClients:
+errorOnRemoveClient:
+errorOnAddClients:
+errorOnServer:
+errorOnHandleNewFrames:
+errorOnEpollWait:
+  // bring down the whole library
+  if (write(w->exit_fd, &(uint64_t){1}, sizeof(uint64_t)) < 0)
+    perror("worker exit");
+
+exitFromWorkerLoop:
+  if (w->uring != NULL)
+    drain_sends(w);
+  free_clients(&w->clients);
+  free_clients(&w->snapshots);
+  for (n = 0; n < MAX_CAMERAS; ++n) {
+    free_clients(&w->viewers[n]);
+    if (w->latest[n] != NULL)
+      frame_unref(w->latest[n]);
+    w->latest[n] = NULL;
+  }
+  client_release_pools();
+
+  printf("libmjpeg2http worker %d exit\n", w->id);
+  fflush(stdout);
+  return NULL;
+}
+
+static int watch(int epfd, int fd, struct observed *o, uint32_t events) {
+  struct epoll_event ev;
+  ev.events = events;
+  ev.data.ptr = o;
+  return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+int worker_start(worker_t *w, char *ipaddress, int port) {
+  pthread_once(&g_welcome_once, init_welcome);
+  init_list_entry(&w->clients);
+  init_list_entry(&w->snapshots);
+  init_list_entry(&w->zombies);
+  for (int i = 0; i < MAX_CAMERAS; ++i) {
+    init_list_entry(&w->viewers[i]);
+    w->latest[i] = NULL;
+  }
+  w->numClients = 0;
+
+  // server socket, ring, exit and io_uring notifications
+  w->watched = calloc(4, sizeof(struct observed));
+  struct observed *server = &w->watched[0], *ring = &w->watched[1],
+                  *exitfd = &w->watched[2], *completions = &w->watched[3];
+
+  w->uring = NULL;
+  if (w->backend == BACKEND_URING) {
+    w->uring = malloc(sizeof(uring_t));
+    if (uring_init(w->uring, URING_ENTRIES, URING_CQ_ENTRIES) < 0) {
+      printf("worker %d: io_uring not available, using epoll\n", w->id);
+      fflush(stdout);
+      free(w->uring);
+      w->uring = NULL;
+    }
+  }
+
+  w->epfd = epoll_create1(0);
+  if (w->epfd == -1) {
+    perror("epoll_create1");
+    goto errorOnEpollCreate;
+  }
+
+  // every worker has its own socket, the kernel spreads connections
+  w->server_fd = server_create(ipaddress, port, w->listen_backlog);
+  if (w->server_fd < 0)
+    goto errorOnServerCreate;
+
+  server->data.fd = w->server_fd;
+  server->t = SERVER;
+  if (w->uring != NULL) {
+    // connections and sends complete on the io_uring
+    completions->data.fd = w->uring->fd;
+    completions->t = URING;
+    if (arm_accept(w) < 0 ||
+        watch(w->epfd, w->uring->fd, completions, EPOLLIN) == -1) {
+      perror("io_uring: accept");
+      goto errorOnRegister;
+    }
+  } else if (watch(w->epfd, w->server_fd, server,
+                   EPOLLIN | EPOLLET | EPOLLRDHUP | EPOLLERR | EPOLLHUP) ==
+             -1) {
+    perror("epoll_ctl: server socket");
+    goto errorOnRegister;
+  }
+
+  ring->data.fd = w->ring->reader[w->id].notify_fd;
+  ring->t = RING;
+  if (watch(w->epfd, ring->data.fd, ring, EPOLLIN) == -1) {
+    perror("epoll_ctl: ring");
+    goto errorOnRegister;
+  }
+
+  exitfd->data.fd = w->exit_fd;
+  exitfd->t = EXITFD;
+  if (watch(w->epfd, w->exit_fd, exitfd, EPOLLIN) == -1) {
+    perror("epoll_ctl: exit_fd");
+    goto errorOnRegister;
+  }
+
+  if (pthread_create(&w->thread, NULL, worker_loop, w) != 0) {
+    perror("pthread_create");
+    goto errorOnRegister;
+  }
+  return 1;
+
+errorOnRegister:
+  close(w->server_fd);
+
+errorOnServerCreate:
+  close(w->epfd);
+
+errorOnEpollCreate:
+  if (w->uring != NULL) {
+    uring_free(w->uring);
+    free(w->uring);
+  }
+  free(w->watched);
+  return -1;
+}
+
+void worker_join(worker_t *w) {
+  pthread_join(w->thread, NULL);
+  shutdown(w->server_fd, SHUT_RDWR);
+  close(w->server_fd);
+  close(w->epfd);
+  if (w->uring != NULL) {
+    uring_free(w->uring);
+    free(w->uring);
+  }
+  free(w->watched);
+}
@@ -0,0 +1,85 @@
+/**
+ *  mjpeg2http
+ *
+ *  Copyright (c) 2022 Antonino Nolano. Licensed under the MIT license, as
+ * follows:
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef WORKER_H
+#define WORKER_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "constants.h"
+#include "list.h"
+#include "metrics.h"
+#include "ring.h"
+#include "shaper.h"
+
+/* how frames are sent: writev on EPOLLOUT or batched io_uring sends */
+enum worker_backend { BACKEND_EPOLL, BACKEND_URING };
+
+/*
+ * network worker: own listening socket (SO_REUSEPORT), epoll set and client
+ * list, frames are read from the shared ring
+ */
+typedef struct worker {
+  int id;
+  int cpu; /* -1 means no affinity */
+  pthread_t thread;
+  int epfd;
+  int server_fd;
+  int exit_fd;
+  ring_t *ring;
+  struct dlist clients;              /* waiting for a request */
+  struct dlist viewers[MAX_CAMERAS]; /* streaming, one list per camera */
+  struct dlist snapshots;            /* waiting for the next capture */
+  struct dlist zombies;              /* removed, send still in flight */
+  frame_t *latest[MAX_CAMERAS];      /* last frame of every camera */
+  int numClients;
+  struct observed *watched;
+  int policy;  /* enum tx_policy of new clients */
+  int backend; /* enum worker_backend, epoll if io_uring is not available */
+  struct uring *uring;
+  uint32_t zerocopy; /* MSG_ZEROCOPY threshold in bytes, 0: off */
+  int tx_queue_max;  /* of new clients */
+  int client_rate;   /* bytes/s of every client, 0: unlimited */
+  shaper_t *egress;  /* bytes/s of the server, NULL: unlimited */
+  int latency;       /* low latency sockets, EPOLLOUT on demand */
+  int listen_backlog;
+  metrics_set_t *metrics;
+
+  /* library callbacks, called from the worker thread with ctx */
+  void *ctx;
+  int (*client_join)(void *ctx);
+  void (*client_leave)(void *ctx);
+  int (*check_token)(void *ctx, uint8_t *start, int count);
+  int (*check_metrics_token)(void *ctx, uint8_t *start, int count);
+  int (*find_camera)(void *ctx, uint8_t *path, int count); /* -1: unknown */
+  void (*camera_join)(void *ctx, int camera);
+  void (*camera_leave)(void *ctx, int camera);
+} worker_t;
+
+int worker_start(worker_t *worker, char *ipaddress, int port);
+void worker_join(worker_t *worker);
+
+#endif